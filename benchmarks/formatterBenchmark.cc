@@ -0,0 +1,80 @@
+/*
+ *  LDForge: LDraw parts authoring CAD
+ *  Copyright (C) 2013, 2014 Santeri Piippo
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+//
+// Compares formatting vertices with LDLineFormatter against the formatting
+// asText used to do, through format() and QString::number.
+//
+// Usage: formatterBenchmark [number of vertices]
+//
+
+#include <cstdlib>
+#include <QCoreApplication>
+#include <QTime>
+#include <QVector>
+#include "main.h"
+#include "basics.h"
+#include "ldFormatter.h"
+
+// =============================================================================
+//
+int main (int argc, char* argv[])
+{
+	QCoreApplication app (argc, argv);
+	const int count = (argc > 1) ? atoi (argv[1]) : 1000000;
+	QVector<Vertex> vertices;
+	vertices.reserve (count);
+	qsrand (1);
+
+	// Mostly plain coordinates, every fourth one rotated
+	for (int i = 0; i < count; ++i)
+	{
+		Vertex vrt ((qrand() % 200001 - 100000) / 1000.0,
+			(qrand() % 200001 - 100000) / 1000.0,
+			(qrand() % 200001 - 100000) / 1000.0);
+
+		if (i % 4 == 0)
+			vrt *= 0.7071067811865476;
+
+		vertices << vrt;
+	}
+
+	QTime timer;
+	timer.start();
+	long oldLength = 0;
+
+	for (const Vertex& vrt : vertices)
+		oldLength += format (" %1 %2 %3", vrt.x(), vrt.y(), vrt.z()).length();
+
+	const int oldTime = timer.restart();
+	long newLength = 0;
+
+	for (const Vertex& vrt : vertices)
+	{
+		LDLineFormatter formatter;
+		formatter.appendVertex (vrt);
+		newLength += formatter.length();
+	}
+
+	const int newTime = timer.restart();
+
+	fprint (stdout, "Formatting %1 vertices:\n", count);
+	fprint (stdout, "    format and QString::number: %1 ms, %2 characters\n", oldTime, oldLength);
+	fprint (stdout, "    LDLineFormatter:            %1 ms, %2 characters\n", newTime, newLength);
+	return (oldLength == newLength) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
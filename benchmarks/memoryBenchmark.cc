@@ -0,0 +1,212 @@
+/*
+ *  LDForge: LDraw parts authoring CAD
+ *  Copyright (C) 2013, 2014 Santeri Piippo
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+//
+// Compiles a model for drawing and reports the memory taken by the compiled
+// geometry. For comparison, the same model is also compiled into the layout
+// compiled objects had before: each object kept the positions and a float RGBA
+// color per vertex for all five complements, and the VBO copies held the same
+// data merged. The sizes of both layouts and the bytes uploaded for the first
+// frame are measured from the actual buffers.
+//
+// Instancing is disabled so that all of the geometry goes into the VBOs, like
+// it did before. This needs a display since the VBOs need a GL context.
+//
+// Usage: memoryBenchmark <model> [LDraw path]
+//
+
+#include <cstdlib>
+#include <QApplication>
+#include "main.h"
+#include "configuration.h"
+#include "colors.h"
+#include "ldDocument.h"
+#include "glRenderer.h"
+#include "glCompiler.h"
+#include "ldObject.h"
+
+EXTERN_CFGENTRY (String,	ldrawPath)
+EXTERN_CFGENTRY (Bool,		useInstancing)
+
+// =============================================================================
+//
+// Compiles @poly into @data the way the compiler used to: three floats per
+// vertex in the surface VBO and four floats per vertex in each color VBO.
+//
+static void compileLegacyPolygon (const GLCompiler* compiler, LDPolygon& poly, LDObjectPtr topobj,
+	QVector<GLfloat>* data)
+{
+	EVBOSurface surface;
+	int numverts;
+
+	switch (poly.num)
+	{
+		case 2:	surface = VBOSF_Lines;		numverts = 2; break;
+		case 3:	surface = VBOSF_Triangles;	numverts = 3; break;
+		case 4:	surface = VBOSF_Quads;		numverts = 4; break;
+		case 5:	surface = VBOSF_CondLines;	numverts = 2; break;
+		default: return;
+	}
+
+	for (EVBOComplement complement = VBOCM_First; complement < VBOCM_NumComplements; ++complement)
+	{
+		QVector<GLfloat>& vbodata = data[GLCompiler::vboNumber (surface, complement)];
+		const QColor color = compiler->getColorForPolygon (poly, topobj, complement);
+
+		for (int vert = 0; vert < numverts; ++vert)
+		{
+			if (complement == VBOCM_Surfaces)
+			{
+				vbodata	<< poly.vertices[vert].x()
+						<< -poly.vertices[vert].y()
+						<< -poly.vertices[vert].z();
+			}
+			else
+			{
+				vbodata	<< ((GLfloat) color.red()) / 255.0f
+						<< ((GLfloat) color.green()) / 255.0f
+						<< ((GLfloat) color.blue()) / 255.0f
+						<< ((GLfloat) color.alpha()) / 255.0f;
+			}
+		}
+	}
+}
+
+// =============================================================================
+//
+// Compiles @doc in the old layout. Returns the bytes held by the per-object
+// vectors and the merged VBO copies. @upload receives the bytes the first frame
+// uploaded: the surface VBO and the normal color VBO of each surface.
+//
+static long measureLegacyLayout (const GLCompiler* compiler, LDDocumentPtr doc, long& upload)
+{
+	QVector<GLfloat> merged[g_numVBOs];
+	QVector<LDPolygon> polygons;
+	long size = 0;
+
+	for (LDObjectPtr obj : doc->objects())
+	{
+		QVector<GLfloat> data[g_numVBOs];
+		polygons.resize (0);
+
+		if (obj->type() == OBJ_Subfile)
+		{
+			obj.staticCast<LDSubfile>()->inlinePolygons (polygons);
+
+			for (LDPolygon& poly : polygons)
+				poly.id = obj->id();
+		}
+		elif (isGeometryType (obj->type()))
+		{
+			LDPolygon poly;
+
+			if (obj->getPolygon (poly))
+				polygons << poly;
+		}
+
+		for (LDPolygon& poly : polygons)
+			compileLegacyPolygon (compiler, poly, obj, data);
+
+		for (int i = 0; i < g_numVBOs; ++i)
+		{
+			size += data[i].size() * sizeof (GLfloat);
+			merged[i] << data[i];
+		}
+	}
+
+	upload = 0;
+
+	for (int i = 0; i < g_numVBOs; ++i)
+		size += merged[i].size() * sizeof (GLfloat);
+
+	for (EVBOSurface surface = VBOSF_First; surface < VBOSF_NumSurfaces; ++surface)
+	{
+		upload += merged[GLCompiler::vboNumber (surface, VBOCM_Surfaces)].size() * sizeof (GLfloat);
+		upload += merged[GLCompiler::vboNumber (surface, VBOCM_NormalColors)].size() * sizeof (GLfloat);
+	}
+
+	return size;
+}
+
+// =============================================================================
+//
+int main (int argc, char* argv[])
+{
+	QApplication app (argc, argv);
+
+	if (argc < 2)
+	{
+		fprint (stderr, "Usage: %1 <model> [LDraw path]\n", argv[0]);
+		return 2;
+	}
+
+	Config::load();
+
+	if (argc > 2)
+		cfg::ldrawPath = argv[2];
+
+	if (not LDPaths::tryConfigure (cfg::ldrawPath))
+	{
+		fprint (stderr, "Bad LDraw path '%1'\n", cfg::ldrawPath);
+		return 2;
+	}
+
+	initColors();
+	cfg::useInstancing = false;
+	LDDocumentPtr doc = openDocument (argv[1], false, false);
+
+	if (doc == null)
+	{
+		fprint (stderr, "%1: could not open\n", argv[1]);
+		return 1;
+	}
+
+	LDDocument::setCurrent (doc);
+	GLRenderer* renderer = new GLRenderer;
+	renderer->setDrawOnly (true);
+	renderer->setDocument (doc);
+	renderer->resize (640, 480);
+	renderer->show();
+	app.processEvents();
+
+	// Compile the document and draw one frame in the normal colors
+	GLCompiler* compiler = renderer->compiler();
+	compiler->compileDocument (doc);
+	renderer->repaint();
+
+	long numVertices = 0;
+
+	for (EVBOSurface surface = VBOSF_First; surface < VBOSF_NumSurfaces; ++surface)
+		numVertices += compiler->vertexCount (surface);
+
+	long uploadBefore;
+	const long memoryBefore = measureLegacyLayout (compiler, doc, uploadBefore);
+	const long memoryAfter = compiler->memoryUsage();
+	const long uploadAfter = compiler->uploadCount();
+
+	fprint (stdout, "%1: %2 objects, %3 vertices\n", argv[1], doc->getObjectCount(), numVertices);
+	fprint (stdout, "Compiled geometry: %1 KiB before, %2 KiB now (%3%)\n",
+		memoryBefore / 1024, memoryAfter / 1024,
+		QString::number (memoryBefore > 0 ? (100.0 * memoryAfter / memoryBefore) : 0.0, 'f', 1));
+	fprint (stdout, "Uploaded for the first frame: %1 KiB before, %2 KiB now\n",
+		uploadBefore / 1024, uploadAfter / 1024);
+
+	delete renderer;
+	doc->dismiss();
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,164 @@
+/*
+ *  LDForge: LDraw parts authoring CAD
+ *  Copyright (C) 2013, 2014 Santeri Piippo
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+//
+// Measures how fast LDraw lines are tokenized and parsed. The tokenization
+// parseLine used to do, splitting the line into a string list and converting
+// the tokens with QString::toDouble, is timed against LDLineTokenizer and
+// parseTokenDouble. parseLine itself is timed as well.
+//
+// Usage: parserBenchmark [number of lines]
+//
+
+#include <cstdlib>
+#include <QApplication>
+#include <QRegExp>
+#include <QStringList>
+#include <QTime>
+#include "main.h"
+#include "ldDocument.h"
+#include "ldObject.h"
+#include "ldTokenizer.h"
+
+// =============================================================================
+//
+// Generates @count lines of all line types, with random coordinates.
+//
+static QStringList generateLines (int count)
+{
+	QStringList lines;
+	qsrand (1);
+
+	auto coordinates = [](int num) -> QString
+	{
+		QString text;
+
+		for (int i = 0; i < num; ++i)
+			text += " " + QString::number ((qrand() % 200001 - 100000) / 1000.0);
+
+		return text;
+	};
+
+	for (int i = 0; i < count; ++i)
+	{
+		switch (i % 8)
+		{
+			case 0: lines << format ("0 Comment number %1", i); break;
+			case 1: lines << "0 BFC INVERTNEXT"; break;
+			case 2: lines << "1 16" + coordinates (3) + " 1 0 0 0 1 0 0 0 1 stud.dat"; break;
+			case 3: lines << "2 24" + coordinates (6); break;
+			case 4: lines << "3 16" + coordinates (9); break;
+			case 5: lines << "4 16" + coordinates (12); break;
+			case 6: lines << "5 24" + coordinates (12); break;
+			default: lines << "0 !LDFORGE VERTEX 16" + coordinates (3); break;
+		}
+	}
+
+	return lines;
+}
+
+// =============================================================================
+//
+// Tokenizes @line the way parseLine used to and returns the sum of its numbers.
+//
+static double legacyTokenize (const QString& line)
+{
+	QStringList tokens = line.split (" ", QString::SkipEmptyParts);
+	QRegExp scient ("\\-?[0-9]+\\.[0-9]+e\\-[0-9]+");
+	double sum = 0.0;
+
+	for (int i = 1; i < tokens.size(); ++i)
+	{
+		bool ok;
+		double value = tokens[i].toDouble (&ok);
+
+		if (ok || scient.exactMatch (tokens[i]))
+			sum += value;
+	}
+
+	return sum;
+}
+
+// =============================================================================
+//
+// Tokenizes @line with LDLineTokenizer and returns the sum of its numbers.
+//
+static double spanTokenize (const QString& line)
+{
+	LDLineTokenizer<QChar> tokens (line.constData(), line.length());
+	double sum = 0.0;
+
+	for (int i = 1; i < tokens.count() && i < LDLineTokenizer<QChar>::MaxTokens; ++i)
+	{
+		double value;
+
+		if (parseTokenDouble (tokens[i].begin, tokens[i].end, value))
+			sum += value;
+	}
+
+	return sum;
+}
+
+// =============================================================================
+//
+int main (int argc, char* argv[])
+{
+	QApplication app (argc, argv, false);
+	const int count = (argc > 1) ? atoi (argv[1]) : 200000;
+	const QStringList lines = generateLines (count);
+
+	// The subfile lines reference stud.dat, which is found from the loaded
+	// documents so that the library is not needed.
+	LDDocumentPtr stud = LDDocument::createNew();
+	stud->setName ("stud.dat");
+
+	QTime timer;
+	timer.start();
+	double legacySum = 0.0;
+
+	for (const QString& line : lines)
+		legacySum += legacyTokenize (line);
+
+	const int legacyTime = timer.restart();
+	double spanSum = 0.0;
+
+	for (const QString& line : lines)
+		spanSum += spanTokenize (line);
+
+	const int spanTime = timer.restart();
+	LDObjectList objs;
+	objs.reserve (count);
+
+	for (const QString& line : lines)
+		objs << parseLine (line);
+
+	const int parseTime = timer.restart();
+	int errors = 0;
+
+	for (LDObjectPtr obj : objs)
+	{
+		if (obj->type() == OBJ_Error)
+			++errors;
+	}
+
+	fprint (stdout, "Tokenizing %1 lines:\n", count);
+	fprint (stdout, "    split and toDouble:    %1 ms (sum %2)\n", legacyTime, legacySum);
+	fprint (stdout, "    LDLineTokenizer:       %1 ms (sum %2)\n", spanTime, spanSum);
+	fprint (stdout, "Parsing %1 lines with parseLine: %2 ms, %3 errors\n", count, parseTime, errors);
+	return (errors == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,140 @@
+/*
+ *  LDForge: LDraw parts authoring CAD
+ *  Copyright (C) 2013, 2014 Santeri Piippo
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+//
+// Rounds all coordinates of documents of growing size the way the round
+// coordinates action does. Each vertex change looks up the line number of the
+// object, so the time per object stays the same only if the lookup is in
+// constant time. For comparison, the time the linear scan lineNumber used to
+// do would take on the same document is measured as well.
+//
+// Usage: roundingBenchmark [largest number of objects]
+//
+
+#include <cstdlib>
+#include <QCoreApplication>
+#include <QTime>
+#include "main.h"
+#include "ldDocument.h"
+#include "ldObject.h"
+#include "miscallenous.h"
+
+EXTERN_CFGENTRY (Int, roundPosition)
+
+// =============================================================================
+//
+static double randomCoordinate()
+{
+	return (qrand() % 2000001 - 1000000) / 10000.0;
+}
+
+// =============================================================================
+//
+static Vertex randomVertex()
+{
+	return Vertex (randomCoordinate(), randomCoordinate(), randomCoordinate());
+}
+
+// =============================================================================
+//
+static LDDocumentPtr generateDocument (int count)
+{
+	LDDocumentPtr doc = LDDocument::createNew();
+
+	for (int i = 0; i < count; ++i)
+		doc->addObject (spawn<LDQuad> (randomVertex(), randomVertex(), randomVertex(), randomVertex()));
+
+	return doc;
+}
+
+// =============================================================================
+//
+// Finds the line number of every object of @doc with a linear scan.
+//
+static long scanLineNumbers (LDDocumentPtr doc)
+{
+	const LDObjectList& objs = doc->objects();
+	long sum = 0;
+
+	for (LDObjectPtr obj : objs)
+	{
+		for (int i = 0; i < objs.size(); ++i)
+		{
+			if (objs[i] == obj)
+			{
+				sum += i;
+				break;
+			}
+		}
+	}
+
+	return sum;
+}
+
+// =============================================================================
+//
+static void roundCoordinates (LDDocumentPtr doc)
+{
+	for (LDObjectPtr obj : doc->objects())
+	{
+		for (int i = 0; i < obj->numVertices(); ++i)
+		{
+			Vertex v = obj->vertex (i);
+			v.apply ([](Axis, double& a) { roundToDecimals (a, cfg::roundPosition); });
+			obj->setVertex (i, v);
+		}
+	}
+}
+
+// =============================================================================
+//
+int main (int argc, char* argv[])
+{
+	QCoreApplication app (argc, argv);
+	const int maxCount = (argc > 1) ? atoi (argv[1]) : 100000;
+	qsrand (1);
+
+	fprint (stdout, "%1 %2 %3 %4\n",
+		QString ("Objects").rightJustified (10),
+		QString ("Rounding (ms)").rightJustified (16),
+		QString ("Per object (us)").rightJustified (16),
+		QString ("Linear scan (ms)").rightJustified (18));
+
+	for (int count = maxCount / 8; count <= maxCount; count *= 2)
+	{
+		LDDocumentPtr doc = generateDocument (count);
+		QTime timer;
+		timer.start();
+		roundCoordinates (doc);
+		const int roundTime = timer.restart();
+		long sum = scanLineNumbers (doc);
+		const int scanTime = timer.restart();
+
+		fprint (stdout, "%1 %2 %3 %4\n",
+			QString::number (count).rightJustified (10),
+			QString::number (roundTime).rightJustified (16),
+			QString::number (roundTime * 1000.0 / count, 'f', 2).rightJustified (16),
+			QString::number (scanTime).rightJustified (18));
+
+		// The sum of all line numbers, just so that the scan is not optimized out
+		if (sum != long (count) * (count - 1) / 2)
+			return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
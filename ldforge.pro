@@ -14,6 +14,7 @@ HEADERS         = src/*.h src/misc/*.h
 FORMS           = ui/*.ui
 QT             += opengl network
 QMAKE_CXXFLAGS += -std=c++0x
+LIBS           += -lz
 CONFIG         += debug_and_release
 
 CONFIG (debug, debug|release) {
@@ -132,14 +132,13 @@ static void doInline (bool deep)
 
 		LDObjectList objs = obj.staticCast<LDSubfile>()->inlineContents (deep, false);
 
-		// Merge in the inlined objects
+		// Merge in the inlined objects. They are fresh copies already, so they
+		// can be inserted as they are.
 		for (LDObjectPtr inlineobj : objs)
 		{
-			QString line = inlineobj->asText();
-			inlineobj->destroy();
-			LDObjectPtr newobj = parseLine (line);
-			getCurrentDocument()->insertObj (idx++, newobj);
-			newobj->select();
+			inlineobj->setParent (LDObjectWeakPtr());
+			getCurrentDocument()->insertObj (idx++, inlineobj);
+			inlineobj->select();
 		}
 
 		// Delete the subfile now as it's been inlined.
@@ -26,6 +26,11 @@
 #include "miscallenous.h"
 #include "ldObject.h"
 #include "ldDocument.h"
+#include "ldFormatter.h"
+#include "ldVertexStore.h"
+
+const Vertex g_origin (0.0f, 0.0f, 0.0f);
+const Matrix g_identity ({1.0f, 0.0f, 0.0f, 0.0f, 1.0f, 0.0f, 0.0f, 0.0f, 1.0f});
 
 Vertex::Vertex() :
 	QVector3D() {}
@@ -91,7 +96,9 @@ QString Vertex::toString (bool mangled) const
 	if (mangled)
 		return format ("(%1, %2, %3)", x(), y(), z());
 
-	return format ("%1 %2 %3", x(), y(), z());
+	LDLineFormatter text;
+	text.appendVertex (*this);
+	return QString::fromLatin1 (text.data() + 1, text.length() - 1);
 }
 
 bool Vertex::operator< (const Vertex& other) const
@@ -143,17 +150,9 @@ void Matrix::dump() const
 //
 QString Matrix::toString() const
 {
-	QString val;
-
-	for (int i = 0; i < 9; ++i)
-	{
-		if (i > 0)
-			val += ' ';
-
-		val += QString::number (m_vals[i]);
-	}
-
-	return val;
+	LDLineFormatter text;
+	text.appendMatrix (*this);
+	return QString::fromLatin1 (text.data() + 1, text.length() - 1);
 }
 
 // =============================================================================
@@ -225,8 +224,28 @@ void LDBoundingBox::calculateFromCurrentDocument()
 	if (not getCurrentDocument())
 		return;
 
-	for (LDObjectPtr obj : getCurrentDocument()->objects())
-		calcObject (obj);
+	LDDocumentPtr doc = getCurrentDocument();
+
+	for (int i = 0; i < doc->getObjectCount(); ++i)
+	{
+		if (doc->isRawLine (i))
+			continue;
+
+		// The vertices of polygons are all in the vertex store of the
+		// document, they are gone through in one go below.
+		LDObjectPtr obj = doc->getObject (i);
+
+		if (obj->type() == OBJ_Subfile)
+			calcObject (obj);
+	}
+
+	Vertex minimum, maximum;
+
+	if (doc->vertexStore()->getExtents (minimum, maximum))
+	{
+		calcVertex (minimum);
+		calcVertex (maximum);
+	}
 }
 
 // =============================================================================
@@ -0,0 +1,277 @@
+/*
+ *  LDForge: LDraw parts authoring CAD
+ *  Copyright (C) 2013, 2014 Santeri Piippo
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <functional>
+#include <QDir>
+#include "batchMode.h"
+#include "ldDocument.h"
+#include "ldObject.h"
+#include "colors.h"
+#include "miscallenous.h"
+
+EXTERN_CFGENTRY (String,	ldrawPath)
+EXTERN_CFGENTRY (Int,		roundPosition)
+EXTERN_CFGENTRY (Int,		roundMatrix)
+
+// An operation returns false if the document failed it, e.g. did not validate.
+using BatchOperation = std::function<bool (LDDocumentPtr)>;
+
+static const char* g_batchUsage =
+	"Usage: %1 --batch [options] files...\n"
+	"\n"
+	"Options:\n"
+	"  --ldraw <path>          use the LDraw library at <path>\n"
+	"  --inline                inline subfile references by one level\n"
+	"  --inline-deep           inline subfile references fully\n"
+	"  --round                 round coordinates to the configured precision\n"
+	"  --translate <x,y,z>     move all objects by the given vector\n"
+	"  --invert                invert all objects\n"
+	"  --validate              report lines that could not be parsed\n"
+	"  --output <dir>          save the results into <dir>\n"
+	"  --save                  save the results over the original files\n"
+	"\n"
+	"Operations are applied in the order they are given.\n";
+
+// =============================================================================
+//
+static bool inlineSubfiles (LDDocumentPtr doc, bool deep)
+{
+	// Work on a copy of the object list, the document gets modified.
+	LDObjectList objs = doc->objects();
+
+	for (LDObjectPtr obj : objs)
+	{
+		if (obj->type() != OBJ_Subfile)
+			continue;
+
+		long idx = obj->lineNumber();
+
+		for (LDObjectPtr inlineobj : obj.staticCast<LDSubfile>()->inlineContents (deep, false))
+		{
+			inlineobj->setParent (LDObjectWeakPtr());
+			doc->insertObj (idx++, inlineobj);
+		}
+
+		obj->destroy();
+	}
+
+	return true;
+}
+
+// =============================================================================
+//
+static bool roundCoordinates (LDDocumentPtr doc)
+{
+	for (LDObjectPtr obj : doc->objects())
+	{
+		LDMatrixObjectPtr mo = obj.dynamicCast<LDMatrixObject>();
+
+		if (mo != null)
+		{
+			Vertex v = mo->position();
+			Matrix t = mo->transform();
+			v.apply ([](Axis, double& a) { roundToDecimals (a, cfg::roundPosition); });
+			applyToMatrix (t, [](int, double& a) { roundToDecimals (a, cfg::roundMatrix); });
+			mo->setPosition (v);
+			mo->setTransform (t);
+		}
+		else
+		{
+			for (int i = 0; i < obj->numVertices(); ++i)
+			{
+				Vertex v = obj->vertex (i);
+				v.apply ([](Axis, double& a) { roundToDecimals (a, cfg::roundPosition); });
+				obj->setVertex (i, v);
+			}
+		}
+	}
+
+	return true;
+}
+
+// =============================================================================
+//
+static bool validate (LDDocumentPtr doc)
+{
+	int numErrors = 0;
+
+	for (int i = 0; i < doc->getObjectCount(); ++i)
+	{
+		LDObjectPtr obj = doc->getObject (i);
+
+		if (obj->type() == OBJ_Error)
+		{
+			fprint (stderr, "%1:%2: %3\n", doc->fullPath(), i + 1,
+				obj.staticCast<LDError>()->reason());
+			++numErrors;
+		}
+	}
+
+	return numErrors == 0;
+}
+
+// =============================================================================
+//
+// Parses "x,y,z" into a vertex.
+//
+static bool parseVector (QString text, Vertex& result)
+{
+	QStringList parts = text.split (",");
+
+	if (parts.size() != 3)
+		return false;
+
+	double coordinates[3];
+
+	for (int i = 0; i < 3; ++i)
+	{
+		bool ok;
+		coordinates[i] = parts[i].toDouble (&ok);
+
+		if (not ok)
+			return false;
+	}
+
+	result = Vertex (coordinates[0], coordinates[1], coordinates[2]);
+	return true;
+}
+
+// =============================================================================
+//
+int runBatchMode (QStringList args)
+{
+	QString program = basename (args.takeFirst());
+	QList<BatchOperation> operations;
+	QStringList files;
+	QString outputDirectory;
+	bool saveInPlace = false;
+
+	auto usage = [&]()
+	{
+		fprint (stderr, g_batchUsage, program);
+		return 2;
+	};
+
+	while (not args.isEmpty())
+	{
+		QString arg = args.takeFirst();
+
+		if (arg == "--batch")
+			continue;
+		elif (arg == "--ldraw" && not args.isEmpty())
+			cfg::ldrawPath = args.takeFirst();
+		elif (arg == "--inline")
+			operations << [](LDDocumentPtr doc) { return inlineSubfiles (doc, false); };
+		elif (arg == "--inline-deep")
+			operations << [](LDDocumentPtr doc) { return inlineSubfiles (doc, true); };
+		elif (arg == "--round")
+			operations << roundCoordinates;
+		elif (arg == "--translate" && not args.isEmpty())
+		{
+			Vertex vect;
+
+			if (not parseVector (args.takeFirst(), vect))
+				return usage();
+
+			operations << [vect](LDDocumentPtr doc)
+			{
+				for (LDObjectPtr obj : doc->objects())
+					obj->move (vect);
+
+				return true;
+			};
+		}
+		elif (arg == "--invert")
+		{
+			operations << [](LDDocumentPtr doc)
+			{
+				for (LDObjectPtr obj : doc->objects())
+					obj->invert();
+
+				return true;
+			};
+		}
+		elif (arg == "--validate")
+			operations << validate;
+		elif (arg == "--output" && not args.isEmpty())
+			outputDirectory = args.takeFirst();
+		elif (arg == "--save")
+			saveInPlace = true;
+		elif (arg.startsWith ("--"))
+			return usage();
+		else
+			files << arg;
+	}
+
+	if (files.isEmpty())
+		return usage();
+
+	if (not LDPaths::tryConfigure (cfg::ldrawPath))
+	{
+		fprint (stderr, "Bad LDraw path '%1': %2\n", cfg::ldrawPath,
+			LDPaths::getError().replace ("<br />", " "));
+		return 2;
+	}
+
+	initColors();
+
+	if (not outputDirectory.isEmpty())
+		QDir().mkpath (outputDirectory);
+
+	int numFailed = 0;
+
+	for (const QString& path : files)
+	{
+		LDDocumentPtr doc = openDocument (path, false, false);
+
+		if (doc == null)
+		{
+			fprint (stderr, "%1: could not open\n", path);
+			++numFailed;
+			continue;
+		}
+
+		// There's no undoing anything here.
+		doc->history()->setIgnoring (true);
+		bool ok = true;
+
+		for (const BatchOperation& operation : operations)
+			ok = operation (doc) && ok;
+
+		QString savepath;
+
+		if (not outputDirectory.isEmpty())
+			savepath = outputDirectory + DIRSLASH + basename (path);
+		elif (saveInPlace)
+			savepath = doc->fullPath();
+
+		if (not savepath.isEmpty() && not doc->save (savepath))
+		{
+			fprint (stderr, "%1: could not save to %2\n", path, savepath);
+			ok = false;
+		}
+
+		if (not ok)
+			++numFailed;
+
+		// Close the document so that it gets released.
+		doc->dismiss();
+	}
+
+	return (numFailed == 0) ? 0 : 1;
+}
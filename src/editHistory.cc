@@ -108,7 +108,9 @@ void History::addStep()
 	m_changesets << m_currentChangeset;
 	m_currentChangeset.clear();
 	setPosition (position() + 1);
-	g_win->updateActions();
+
+	if (g_win != null)
+		g_win->updateActions();
 }
 
 // =============================================================================
@@ -191,7 +193,11 @@ void EditHistory::redo() const
 //
 void SwapHistory::undo() const
 {
-	LDObject::fromID (a)->swap (LDObject::fromID (b));
+	LDObjectPtr one = LDObject::fromHandle (a);
+	LDObjectPtr other = LDObject::fromHandle (b);
+
+	if (one != null && other != null)
+		one->swap (other);
 }
 
 // =============================================================================
@@ -165,10 +165,10 @@ class SwapHistory : public AbstractHistoryEntry
 public:
 	IMPLEMENT_HISTORY_TYPE (Swap)
 
-	SwapHistory (int a, int b) :
+	SwapHistory (qint64 a, qint64 b) :
 		a (a),
 		b (b) {}
 
 private:
-	int a, b;
+	qint64 a, b;
 };
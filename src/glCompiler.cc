@@ -16,9 +16,13 @@
  *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
 #define GL_GLEXT_PROTOTYPES
 #include <GL/glu.h>
 #include <GL/glext.h>
+#include <QGLShaderProgram>
 #include "glCompiler.h"
 #include "ldObject.h"
 #include "colors.h"
@@ -46,6 +50,7 @@ static const GLErrorInfo g_GLErrors[] =
 };
 
 CFGENTRY (String, selectColorBlend, "#0080FF")
+CFGENTRY (Bool, useInstancing, true)
 EXTERN_CFGENTRY (Bool, blackEdges);
 EXTERN_CFGENTRY (String, backgroundColor);
 
@@ -55,6 +60,80 @@ static const QColor		g_BFCBackColor (208, 64, 64);
 
 // static QMap<LDObjectPtr, String> g_objectOrigins;
 
+// Generic vertex attributes of the instancing program
+enum
+{
+	// Per vertex
+	InstanceAttrib_Position,
+	InstanceAttrib_Color,
+	InstanceAttrib_UsesMainColor,
+
+	// Per instance
+	InstanceAttrib_TransformX,
+	InstanceAttrib_TransformY,
+	InstanceAttrib_TransformZ,
+	InstanceAttrib_MainColor,
+	InstanceAttrib_PickColor,
+	InstanceAttrib_RandomColor,
+	InstanceAttrib_Blend,
+
+	InstanceAttrib_Count,
+	InstanceAttrib_FirstPerInstance = InstanceAttrib_TransformX
+};
+
+static const char* g_instanceAttribNames[InstanceAttrib_Count] =
+{
+	"position", "color", "usesMainColor",
+	"transformX", "transformY", "transformZ",
+	"mainColor", "pickColor", "randomColor", "blend",
+};
+
+static const char* g_instanceVertexShader =
+	"attribute vec3 position;\n"
+	"attribute vec4 color;\n"
+	"attribute float usesMainColor;\n"
+	"attribute vec4 transformX;\n"
+	"attribute vec4 transformY;\n"
+	"attribute vec4 transformZ;\n"
+	"attribute vec4 mainColor;\n"
+	"attribute vec4 pickColor;\n"
+	"attribute vec4 randomColor;\n"
+	"attribute float blend;\n"
+	"uniform int complement;\n"
+	"uniform vec4 bfcColor;\n"
+	"uniform vec4 selectColor;\n"
+	"varying vec4 vertexColor;\n"
+	"\n"
+	"void main()\n"
+	"{\n"
+	"	vec4 local = vec4 (position, 1.0);\n"
+	"	vec4 world = vec4 (dot (transformX, local), dot (transformY, local), dot (transformZ, local), 1.0);\n"
+	"	gl_Position = gl_ModelViewProjectionMatrix * world;\n"
+	"\n"
+	"	if (complement == PICK_COLORS)\n"
+	"	{\n"
+	"		vertexColor = pickColor;\n"
+	"		return;\n"
+	"	}\n"
+	"\n"
+	"	if (complement == BFC_FRONT_COLORS || complement == BFC_BACK_COLORS)\n"
+	"		vertexColor = bfcColor;\n"
+	"	else if (complement == RANDOM_COLORS)\n"
+	"		vertexColor = randomColor;\n"
+	"	else\n"
+	"		vertexColor = mix (color, mainColor, usesMainColor);\n"
+	"\n"
+	"	vertexColor.rgb = (vertexColor.rgb + (selectColor.rgb * blend)) / (blend + 1.0);\n"
+	"}\n";
+
+static const char* g_instanceFragmentShader =
+	"varying vec4 vertexColor;\n"
+	"\n"
+	"void main()\n"
+	"{\n"
+	"	gl_FragColor = vertexColor;\n"
+	"}\n";
+
 // =============================================================================
 //
 void checkGLError_private (const char* file, int line)
@@ -80,10 +159,45 @@ void checkGLError_private (const char* file, int line)
 // =============================================================================
 //
 GLCompiler::GLCompiler (GLRenderer* renderer) :
-	m_renderer (renderer)
+	m_renderer (renderer),
+	m_objectBytes (0),
+	m_needRebuild (true),
+	m_uploadCount (0),
+	m_instancing (false),
+	m_instanceProgram (null)
 {
-	needMerge();
-	memset (m_vboSizes, 0, sizeof m_vboSizes);
+	memset (m_usedVertices, 0, sizeof m_usedVertices);
+	memset (m_freeVertices, 0, sizeof m_freeVertices);
+	memset (m_capacity, 0, sizeof m_capacity);
+
+	for (int i = 0; i < g_numVBOs; ++i)
+	{
+		m_vboInUse[i] = (i % VBOCM_NumComplements == VBOCM_Surfaces);
+		m_vboResized[i] = true;
+		m_dirtyBegin[i] = m_dirtyEnd[i] = 0;
+	}
+}
+
+// =============================================================================
+//
+// Does the current GL context support the extension @name?
+//
+static bool hasGLExtension (const char* name)
+{
+	const char* extensions = reinterpret_cast<const char*> (glGetString (GL_EXTENSIONS));
+	const int length = strlen (name);
+
+	if (extensions == null)
+		return false;
+
+	for (const char* it = strstr (extensions, name); it != null; it = strstr (it + length, name))
+	{
+		// Make sure that the match is a whole name and not a prefix of another
+		if ((it == extensions || it[-1] == ' ') && (it[length] == ' ' || it[length] == '\0'))
+			return true;
+	}
+
+	return false;
 }
 
 // =============================================================================
@@ -92,6 +206,41 @@ void GLCompiler::initialize()
 {
 	glGenBuffers (g_numVBOs, &m_vbo[0]);
 	checkGLError();
+
+	// Instanced drawing needs instanced arrays. They are checked for as
+	// extensions since legacy contexts, such as the one QGLWidget creates, may
+	// report an older version than the driver supports. Without them, subfile
+	// references are compiled into the VBOs like everything else.
+	if (cfg::useInstancing
+		&& hasGLExtension ("GL_ARB_instanced_arrays")
+		&& hasGLExtension ("GL_ARB_draw_instanced"))
+	{
+		const QString defines = format (
+			"#version 120\n"
+			"#define PICK_COLORS %1\n"
+			"#define BFC_FRONT_COLORS %2\n"
+			"#define BFC_BACK_COLORS %3\n"
+			"#define RANDOM_COLORS %4\n",
+			int (VBOCM_PickColors), int (VBOCM_BFCFrontColors), int (VBOCM_BFCBackColors),
+			int (VBOCM_RandomColors));
+
+		m_instanceProgram = new QGLShaderProgram;
+		m_instanceProgram->addShaderFromSourceCode (QGLShader::Vertex, defines + g_instanceVertexShader);
+		m_instanceProgram->addShaderFromSourceCode (QGLShader::Fragment, defines + g_instanceFragmentShader);
+
+		for (int i = 0; i < InstanceAttrib_Count; ++i)
+			m_instanceProgram->bindAttributeLocation (g_instanceAttribNames[i], i);
+
+		if (m_instanceProgram->link())
+			m_instancing = true;
+		else
+		{
+			print ("Could not link the instancing program, not using instancing: %1\n",
+				m_instanceProgram->log());
+			delete m_instanceProgram;
+			m_instanceProgram = null;
+		}
+	}
 }
 
 // =============================================================================
@@ -99,6 +248,11 @@ void GLCompiler::initialize()
 GLCompiler::~GLCompiler()
 {
 	glDeleteBuffers (g_numVBOs, &m_vbo[0]);
+
+	for (InstanceGroup& group : m_instanceGroups)
+		releaseInstanceGroup (group);
+
+	delete m_instanceProgram;
 	checkGLError();
 }
 
@@ -113,6 +267,19 @@ uint32 GLCompiler::colorToRGB (const QColor& color)
 		(color.alpha() & 0xFF) << 0x18;
 }
 
+// =============================================================================
+//
+// Packs @color for GL_UNSIGNED_BYTE color arrays, i.e. as the bytes R, G, B, A
+// in memory.
+//
+static uint32 packColor (const QColor& color)
+{
+	const uchar bytes[4] = { uchar (color.red()), uchar (color.green()), uchar (color.blue()), uchar (color.alpha()) };
+	uint32 result;
+	memcpy (&result, bytes, sizeof result);
+	return result;
+}
+
 // =============================================================================
 //
 QColor GLCompiler::indexColorForID (int id) const
@@ -157,7 +324,7 @@ QColor GLCompiler::getColorForPolygon (LDPolygon& poly, LDObjectPtr topobj,
 		case VBOCM_NormalColors:
 			if (poly.color == mainColorIndex)
 			{
-				if (topobj->color() == maincolor())
+				if (topobj == null || topobj->color() == maincolor())
 					qcol = GLRenderer::getMainColor();
 				else
 					qcol = topobj->color().faceColor();
@@ -195,12 +362,7 @@ QColor GLCompiler::getColorForPolygon (LDPolygon& poly, LDObjectPtr topobj,
 		return qcol;
 	}
 
-	double blendAlpha = 0.0;
-
-	if (topobj->isSelected())
-		blendAlpha = 1.0;
-	elif (topobj == m_renderer->objectAtCursor())
-		blendAlpha = 0.5;
+	double blendAlpha = (topobj != null) ? selectionBlend (topobj) : 0.0;
 
 	if (blendAlpha != 0.0)
 	{
@@ -216,10 +378,25 @@ QColor GLCompiler::getColorForPolygon (LDPolygon& poly, LDObjectPtr topobj,
 
 // =============================================================================
 //
+// Returns how much of the selection color is blended into the colors of @obj.
+//
+double GLCompiler::selectionBlend (LDObjectPtr obj) const
+{
+	if (obj->isSelected())
+		return 1.0;
+	elif (obj == m_renderer->objectAtCursor())
+		return 0.5;
+
+	return 0.0;
+}
+
+// =============================================================================
+//
+// Makes the VBOs be rebuilt from scratch the next time they are prepared.
+//
 void GLCompiler::needMerge()
 {
-	for (int i = 0; i < countof (m_vboChanged); ++i)
-		m_vboChanged[i] = true;
+	m_needRebuild = true;
 }
 
 // =============================================================================
@@ -248,8 +425,19 @@ void GLCompiler::compileDocument (LDDocumentPtr doc)
 	if (doc == null)
 		return;
 
-	for (LDObjectPtr obj : doc->objects())
-		compileObject (obj);
+	// The colors of the instanced meshes depend on the configuration too.
+	for (InstanceGroup& group : m_instanceGroups)
+		group.meshChanged = true;
+
+	for (int i = 0; i < doc->getObjectCount(); ++i)
+	{
+		// The comments of a lazily loaded document are left unparsed, they
+		// have nothing to render.
+		if (doc->isRawLine (i))
+			continue;
+
+		compileObject (doc->getObject (i));
+	}
 }
 
 // =============================================================================
@@ -271,25 +459,49 @@ void GLCompiler::prepareVBO (int vbonum)
 	// Compile anything that still awaits it
 	compileStaged();
 
-	if (not m_vboChanged[vbonum])
-		return;
+	if (m_needRebuild || m_document.data() != getCurrentDocument().data())
+		rebuild();
 
-	QVector<GLfloat> vbodata;
+	const EVBOSurface surface = EVBOSurface (vbonum / VBOCM_NumComplements);
+	const EVBOComplement complement = EVBOComplement (vbonum % VBOCM_NumComplements);
 
-	for (auto it = m_objectInfo.begin(); it != m_objectInfo.end(); ++it)
+	// Compact the surface once most of it is degenerate
+	if (m_freeVertices[surface] > 4096 && m_freeVertices[surface] > m_usedVertices[surface] / 2)
+		compact (surface);
+
+	// The colors of a complement are only computed once it is drawn.
+	if (not m_vboInUse[vbonum])
 	{
-		if (it.key() == null)
-			it = m_objectInfo.erase (it);
-		elif (it.key().toStrongRef()->document() == getCurrentDocument() && not it.key().toStrongRef()->isHidden())
-			vbodata += it->data[vbonum];
+		m_vboInUse[vbonum] = true;
+		resizeVBO (vbonum, m_capacity[surface] * bytesPerVertex (complement));
+		m_vboResized[vbonum] = true;
+
+		for (auto it = m_objectInfo.begin(); it != m_objectInfo.end(); ++it)
+		{
+			if (it->offsets[surface] != -1 && it.key() != null)
+				writeColors (*it, it.key().toStrongRef(), surface, complement);
+		}
 	}
 
+	const QByteArray& vbodata = m_vboData[vbonum];
 	glBindBuffer (GL_ARRAY_BUFFER, m_vbo[vbonum]);
-	glBufferData (GL_ARRAY_BUFFER, vbodata.size() * sizeof(GLfloat), vbodata.constData(), GL_STATIC_DRAW);
+
+	if (m_vboResized[vbonum])
+	{
+		glBufferData (GL_ARRAY_BUFFER, vbodata.size(), vbodata.constData(), GL_DYNAMIC_DRAW);
+		m_uploadCount += vbodata.size();
+		m_vboResized[vbonum] = false;
+	}
+	elif (m_dirtyBegin[vbonum] < m_dirtyEnd[vbonum])
+	{
+		const int size = m_dirtyEnd[vbonum] - m_dirtyBegin[vbonum];
+		glBufferSubData (GL_ARRAY_BUFFER, m_dirtyBegin[vbonum], size, vbodata.constData() + m_dirtyBegin[vbonum]);
+		m_uploadCount += size;
+	}
+
 	glBindBuffer (GL_ARRAY_BUFFER, 0);
 	checkGLError();
-	m_vboChanged[vbonum] = false;
-	m_vboSizes[vbonum] = vbodata.size();
+	m_dirtyBegin[vbonum] = m_dirtyEnd[vbonum] = 0;
 }
 
 // =============================================================================
@@ -300,13 +512,394 @@ void GLCompiler::dropObject (LDObjectPtr obj)
 
 	if (it != m_objectInfo.end())
 	{
+		unplaceObject (*it);
+		unplaceInstance (*it);
+		m_objectBytes -= dataSize (*it);
 		m_objectInfo.erase (it);
-		needMerge();
 	}
 
 	unstage (obj);
 }
 
+// =============================================================================
+//
+bool GLCompiler::isDrawn (LDObjectPtr obj) const
+{
+	return obj->document().data() == m_document.data() && not obj->isHidden();
+}
+
+// =============================================================================
+//
+// Replaces the data of @entry with freshly @compiled data of @obj. Ranges are
+// kept if the object is still drawn and the amount of vertices did not change.
+//
+void GLCompiler::storeObject (ObjectVBOInfo& entry, const ObjectVBOInfo& compiled, LDObjectPtr obj, bool drawn)
+{
+	for (EVBOSurface surface = VBOSF_First; surface < VBOSF_NumSurfaces; ++surface)
+	{
+		if (entry.offsets[surface] != -1
+			&& (not drawn || compiled.numVertices (surface) != entry.numVertices (surface)))
+		{
+			freeRange (surface, entry.offsets[surface], entry.numVertices (surface));
+			entry.offsets[surface] = -1;
+		}
+	}
+
+	m_objectBytes += dataSize (compiled) - dataSize (entry);
+
+	for (EVBOSurface surface = VBOSF_First; surface < VBOSF_NumSurfaces; ++surface)
+	{
+		entry.positions[surface] = compiled.positions[surface];
+		entry.colors[surface] = compiled.colors[surface];
+	}
+
+	entry.isChanged = compiled.isChanged;
+	entry.isInstanced = compiled.isInstanced;
+	entry.instance = compiled.instance;
+
+	if (drawn)
+	{
+		for (EVBOSurface surface = VBOSF_First; surface < VBOSF_NumSurfaces; ++surface)
+			placeObject (entry, obj, surface);
+	}
+
+	if (drawn && entry.isInstanced)
+		placeInstance (entry, obj);
+	else
+		unplaceInstance (entry);
+}
+
+// =============================================================================
+//
+// Writes the data of @entry into its range in the VBOs of @surface, allocating
+// the range first if necessary.
+//
+void GLCompiler::placeObject (ObjectVBOInfo& entry, LDObjectPtr obj, EVBOSurface surface)
+{
+	const int numVertices = entry.numVertices (surface);
+
+	if (numVertices == 0)
+		return;
+
+	if (entry.offsets[surface] == -1)
+		entry.offsets[surface] = allocateRange (surface, numVertices);
+
+	writeRange (vboNumber (surface, VBOCM_Surfaces), entry.offsets[surface] * bytesPerVertex (VBOCM_Surfaces),
+		entry.positions[surface].constData(), numVertices * bytesPerVertex (VBOCM_Surfaces));
+
+	for (EVBOComplement complement = VBOCM_First; complement < VBOCM_NumComplements; ++complement)
+	{
+		if (complement != VBOCM_Surfaces && m_vboInUse[vboNumber (surface, complement)])
+			writeColors (entry, obj, surface, complement);
+	}
+}
+
+// =============================================================================
+//
+void GLCompiler::unplaceObject (ObjectVBOInfo& entry)
+{
+	for (EVBOSurface surface = VBOSF_First; surface < VBOSF_NumSurfaces; ++surface)
+	{
+		if (entry.offsets[surface] != -1)
+		{
+			freeRange (surface, entry.offsets[surface], entry.numVertices (surface));
+			entry.offsets[surface] = -1;
+		}
+	}
+}
+
+// =============================================================================
+//
+// Computes the colors of @obj for @complement and writes them into the range
+// of @entry in the VBOs of @surface.
+//
+void GLCompiler::writeColors (ObjectVBOInfo& entry, LDObjectPtr obj, EVBOSurface surface,
+	EVBOComplement complement)
+{
+	const int numVertices = entry.numVertices (surface);
+	const int verticesPerPolygon = numVertices / entry.colors[surface].size();
+	LDPolygon poly;
+	poly.num = (surface == VBOSF_CondLines) ? 5 : verticesPerPolygon;
+	m_colorBuffer.resize (numVertices);
+	uint32* it = m_colorBuffer.data();
+
+	for (int color : entry.colors[surface])
+	{
+		poly.color = color;
+		const uint32 rgba = packColor (getColorForPolygon (poly, obj, complement));
+
+		for (int i = 0; i < verticesPerPolygon; ++i)
+			*it++ = rgba;
+	}
+
+	writeRange (vboNumber (surface, complement), entry.offsets[surface] * bytesPerVertex (complement),
+		m_colorBuffer.constData(), numVertices * bytesPerVertex (complement));
+}
+
+// =============================================================================
+//
+// Finds room for @numVertices vertices in the VBOs of @surface. Returns the
+// offset of the range in vertices.
+//
+int GLCompiler::allocateRange (EVBOSurface surface, int numVertices)
+{
+	QMap<int, int>& freeRanges = m_freeRanges[surface];
+
+	for (auto it = freeRanges.begin(); it != freeRanges.end(); ++it)
+	{
+		if (it.value() < numVertices)
+			continue;
+
+		const int offset = it.key();
+		const int rest = it.value() - numVertices;
+		freeRanges.erase (it);
+
+		if (rest > 0)
+			freeRanges.insert (offset + numVertices, rest);
+
+		m_freeVertices[surface] -= numVertices;
+		return offset;
+	}
+
+	const int offset = m_usedVertices[surface];
+	m_usedVertices[surface] += numVertices;
+
+	if (m_usedVertices[surface] > m_capacity[surface])
+	{
+		m_capacity[surface] = qMax (m_usedVertices[surface] * 2, 4096);
+
+		for (EVBOComplement complement = VBOCM_First; complement < VBOCM_NumComplements; ++complement)
+		{
+			const int vbonum = vboNumber (surface, complement);
+
+			if (m_vboInUse[vbonum])
+			{
+				resizeVBO (vbonum, m_capacity[surface] * bytesPerVertex (complement));
+				m_vboResized[vbonum] = true;
+			}
+		}
+	}
+
+	return offset;
+}
+
+// =============================================================================
+//
+void GLCompiler::freeRange (EVBOSurface surface, int offset, int numVertices)
+{
+	QMap<int, int>& freeRanges = m_freeRanges[surface];
+
+	// A range at the end just makes the used part shorter, along with the free
+	// range that then ends up at the end.
+	if (offset + numVertices == m_usedVertices[surface])
+	{
+		m_usedVertices[surface] = offset;
+
+		if (not freeRanges.isEmpty())
+		{
+			auto last = freeRanges.end() - 1;
+
+			if (last.key() + last.value() == offset)
+			{
+				m_usedVertices[surface] = last.key();
+				m_freeVertices[surface] -= last.value();
+				freeRanges.erase (last);
+			}
+		}
+
+		return;
+	}
+
+	// Zero the coordinates so that the range draws nothing.
+	const int vbonum = vboNumber (surface, VBOCM_Surfaces);
+	const int begin = offset * bytesPerVertex (VBOCM_Surfaces);
+	const int size = numVertices * bytesPerVertex (VBOCM_Surfaces);
+	memset (m_vboData[vbonum].data() + begin, 0, size);
+	writeRange (vbonum, begin, null, size);
+
+	// Merge with the neighbouring free ranges
+	m_freeVertices[surface] += numVertices;
+	auto next = freeRanges.lowerBound (offset);
+
+	if (next != freeRanges.end() && next.key() == offset + numVertices)
+	{
+		numVertices += next.value();
+		next = freeRanges.erase (next);
+	}
+
+	if (next != freeRanges.begin())
+	{
+		auto previous = next - 1;
+
+		if (previous.key() + previous.value() == offset)
+		{
+			previous.value() += numVertices;
+			return;
+		}
+	}
+
+	freeRanges.insert (offset, numVertices);
+}
+
+// =============================================================================
+//
+// Copies @size bytes from @data to @offset in the copy of VBO @vbonum and
+// marks them to be uploaded. If @data is null, the bytes are already there.
+//
+void GLCompiler::writeRange (int vbonum, int offset, const void* data, int size)
+{
+	if (size == 0)
+		return;
+
+	if (data != null)
+		memcpy (m_vboData[vbonum].data() + offset, data, size);
+
+	if (m_dirtyBegin[vbonum] == m_dirtyEnd[vbonum])
+	{
+		m_dirtyBegin[vbonum] = offset;
+		m_dirtyEnd[vbonum] = offset + size;
+	}
+	else
+	{
+		m_dirtyBegin[vbonum] = qMin (m_dirtyBegin[vbonum], offset);
+		m_dirtyEnd[vbonum] = qMax (m_dirtyEnd[vbonum], offset + size);
+	}
+}
+
+// =============================================================================
+//
+// Resizes the copy of VBO @vbonum to @size bytes, zeroing the new bytes.
+//
+void GLCompiler::resizeVBO (int vbonum, int size)
+{
+	const int oldSize = m_vboData[vbonum].size();
+	m_vboData[vbonum].resize (size);
+
+	if (size > oldSize)
+		memset (m_vboData[vbonum].data() + oldSize, 0, size - oldSize);
+}
+
+// =============================================================================
+//
+// Lays out all VBOs from scratch for the current document. The colors of the
+// complements are computed again once they are drawn.
+//
+void GLCompiler::rebuild()
+{
+	m_document = getCurrentDocument();
+	m_needRebuild = false;
+
+	for (EVBOSurface surface = VBOSF_First; surface < VBOSF_NumSurfaces; ++surface)
+	{
+		m_usedVertices[surface] = 0;
+		m_freeVertices[surface] = 0;
+		m_freeRanges[surface].clear();
+
+		for (EVBOComplement complement = VBOCM_First; complement < VBOCM_NumComplements; ++complement)
+		{
+			const int vbonum = vboNumber (surface, complement);
+
+			if (complement != VBOCM_Surfaces)
+			{
+				m_vboInUse[vbonum] = false;
+				m_vboData[vbonum] = QByteArray();
+			}
+
+			m_vboResized[vbonum] = true;
+		}
+	}
+
+	for (InstanceGroup& group : m_instanceGroups)
+	{
+		group.instances.clear();
+		group.owners.clear();
+		group.meshChanged = true;
+		group.dirtyBegin = group.dirtyEnd = 0;
+	}
+
+	for (auto it = m_objectInfo.begin(); it != m_objectInfo.end();)
+	{
+		it->instanceGroup = null;
+		it->instanceIndex = -1;
+
+		if (it.key() == null)
+		{
+			m_objectBytes -= dataSize (*it);
+			it = m_objectInfo.erase (it);
+			continue;
+		}
+
+		for (EVBOSurface surface = VBOSF_First; surface < VBOSF_NumSurfaces; ++surface)
+			it->offsets[surface] = -1;
+
+		LDObjectPtr obj = it.key().toStrongRef();
+
+		if (isDrawn (obj))
+		{
+			for (EVBOSurface surface = VBOSF_First; surface < VBOSF_NumSurfaces; ++surface)
+				placeObject (*it, obj, surface);
+
+			if (it->isInstanced)
+				placeInstance (*it, obj);
+		}
+
+		++it;
+	}
+}
+
+// =============================================================================
+//
+// Moves the ranges of @surface next to each other, getting rid of the free
+// ranges between them.
+//
+void GLCompiler::compact (EVBOSurface surface)
+{
+	m_usedVertices[surface] = 0;
+	m_freeVertices[surface] = 0;
+	m_freeRanges[surface].clear();
+
+	for (auto it = m_objectInfo.begin(); it != m_objectInfo.end(); ++it)
+	{
+		if (it->offsets[surface] != -1)
+		{
+			it->offsets[surface] = -1;
+
+			if (it.key() != null)
+				placeObject (*it, it.key().toStrongRef(), surface);
+		}
+	}
+}
+
+// =============================================================================
+//
+long GLCompiler::dataSize (const ObjectVBOInfo& entry)
+{
+	long size = 0;
+
+	for (int i = 0; i < VBOSF_NumSurfaces; ++i)
+		size += (entry.positions[i].size() * sizeof (GLfloat)) + (entry.colors[i].size() * sizeof (int));
+
+	return size;
+}
+
+// =============================================================================
+//
+// Returns the amount of memory taken by compiled geometry, i.e. the compiled
+// objects and the copies of the VBOs, in bytes.
+//
+long GLCompiler::memoryUsage() const
+{
+	long size = m_objectBytes;
+
+	for (int i = 0; i < g_numVBOs; ++i)
+		size += m_vboData[i].size();
+
+	for (const InstanceGroup& group : m_instanceGroups)
+		size += group.instances.size() * sizeof (InstanceData);
+
+	return size;
+}
+
 // =============================================================================
 //
 void GLCompiler::compileObject (LDObjectPtr obj)
@@ -318,7 +911,7 @@ void GLCompiler::compileObject (LDObjectPtr obj)
 
 	ObjectVBOInfo info;
 	info.isChanged = true;
-	dropObject (obj);
+	unstage (obj);
 
 	switch (obj->type())
 	{
@@ -329,22 +922,30 @@ void GLCompiler::compileObject (LDObjectPtr obj)
 		case OBJ_Line:
 		case OBJ_CondLine:
 		{
-			LDPolygon* poly = obj->getPolygon();
-			poly->id = obj->id();
-			compilePolygon (*poly, obj, &info);
-			delete poly;
+			LDPolygon poly;
+			obj->getPolygon (poly);
+			compilePolygon (poly, &info);
 			break;
 		}
 
 		case OBJ_Subfile:
 		{
 			LDSubfilePtr ref = obj.staticCast<LDSubfile>();
-			auto data = ref->inlinePolygons();
 
-			for (LDPolygon& poly : data)
+			if (m_instancing)
+			{
+				info.isInstanced = true;
+				computeInstance (ref, info.instance);
+				break;
+			}
+
+			m_polygonBuffer.resize (0);
+			ref->inlinePolygons (m_polygonBuffer);
+
+			for (LDPolygon& poly : m_polygonBuffer)
 			{
 				poly.id = obj->id();
-				compilePolygon (poly, obj, &info);
+				compilePolygon (poly, &info);
 			}
 			break;
 		}
@@ -353,13 +954,13 @@ void GLCompiler::compileObject (LDObjectPtr obj)
 			break;
 	}
 
-	m_objectInfo[obj] = info;
-	needMerge();
+	// If the VBOs are about to be rebuilt, the object is laid out then.
+	storeObject (m_objectInfo[obj], info, obj, not m_needRebuild && isDrawn (obj));
 }
 
 // =============================================================================
 //
-void GLCompiler::compilePolygon (LDPolygon& poly, LDObjectPtr topobj, ObjectVBOInfo* objinfo)
+void GLCompiler::compilePolygon (LDPolygon& poly, ObjectVBOInfo* objinfo)
 {
 	EVBOSurface surface;
 	int numverts;
@@ -373,28 +974,333 @@ void GLCompiler::compilePolygon (LDPolygon& poly, LDObjectPtr topobj, ObjectVBOI
 		default: return;
 	}
 
-	for (EVBOComplement complement = VBOCM_First; complement < VBOCM_NumComplements; ++complement)
+	QVector<GLfloat>& positions = objinfo->positions[surface];
+
+	for (int vert = 0; vert < numverts; ++vert)
 	{
-		const int vbonum			= vboNumber (surface, complement);
-		QVector<GLfloat>& vbodata	= objinfo->data[vbonum];
-		const QColor color			= getColorForPolygon (poly, topobj, complement);
+		// Write coordinates. Apparently Z must be flipped too?
+		positions	<< poly.vertices[vert].x()
+					<< -poly.vertices[vert].y()
+					<< -poly.vertices[vert].z();
+	}
+
+	objinfo->colors[surface] << poly.color;
+}
+
+// =============================================================================
+//
+// Computes the attributes of the instance drawn by @ref. The transformation
+// includes the flip of Y and Z that the compiled vertices get as well.
+//
+void GLCompiler::computeInstance (LDSubfilePtr ref, InstanceData& instance) const
+{
+	const Matrix& transform = ref->transform();
+	const Vertex& position = ref->position();
+
+	for (int i = 0; i < 3; ++i)
+	{
+		const double sign = (i == 0) ? 1.0 : -1.0;
+		instance.transform[(i * 4) + 0] = sign * transform[(i * 3) + 0];
+		instance.transform[(i * 4) + 1] = sign * transform[(i * 3) + 1];
+		instance.transform[(i * 4) + 2] = sign * transform[(i * 3) + 2];
+		instance.transform[(i * 4) + 3] = sign * position[(Axis) i];
+	}
+
+	QColor mainColor;
+
+	if (ref->color() == maincolor())
+		mainColor = GLRenderer::getMainColor();
+	else
+		mainColor = ref->color().faceColor();
+
+	if (not mainColor.isValid())
+		mainColor = GLRenderer::getMainColor();
+
+	instance.mainColor = packColor (mainColor);
+	instance.pickColor = packColor (indexColorForID (ref->id()));
+	instance.randomColor = packColor (ref->randomColor());
+	instance.blend = selectionBlend (ref);
+}
+
+// =============================================================================
+//
+// Adds the instance of @entry to the group of the document @obj references, or
+// updates it if it is there already.
+//
+void GLCompiler::placeInstance (ObjectVBOInfo& entry, LDObjectPtr obj)
+{
+	LDDocumentPtr doc = obj.staticCast<LDSubfile>()->fileInfo();
+
+	if (entry.instanceGroup != doc.data())
+		unplaceInstance (entry);
+
+	if (doc == null)
+		return;
+
+	auto it = m_instanceGroups.find (doc.data());
+
+	if (it == m_instanceGroups.end())
+	{
+		InstanceGroup group;
+		group.document = doc;
+		group.meshVBO = group.instanceVBO = 0;
+		group.meshChanged = true;
+		group.capacity = 0;
+		group.dirtyBegin = group.dirtyEnd = 0;
+		memset (group.first, 0, sizeof group.first);
+		memset (group.count, 0, sizeof group.count);
+		it = m_instanceGroups.insert (doc.data(), group);
+	}
 
-		for (int vert = 0; vert < numverts; ++vert)
+	InstanceGroup& group = *it;
+
+	if (entry.instanceGroup == null)
+	{
+		entry.instanceGroup = doc.data();
+		entry.instanceIndex = group.instances.size();
+		group.instances << entry.instance;
+		group.owners << obj;
+	}
+	else
+		group.instances[entry.instanceIndex] = entry.instance;
+
+	markInstanceChanged (group, entry.instanceIndex);
+}
+
+// =============================================================================
+//
+// Removes the instance of @entry from its group. The last instance of the
+// group takes its place.
+//
+void GLCompiler::unplaceInstance (ObjectVBOInfo& entry)
+{
+	if (entry.instanceGroup == null)
+		return;
+
+	InstanceGroup& group = m_instanceGroups[entry.instanceGroup];
+	const int last = group.instances.size() - 1;
+
+	if (entry.instanceIndex != last)
+	{
+		group.instances[entry.instanceIndex] = group.instances[last];
+		group.owners[entry.instanceIndex] = group.owners[last];
+		auto owner = m_objectInfo.find (group.owners[last]);
+
+		if (owner != m_objectInfo.end())
+			owner->instanceIndex = entry.instanceIndex;
+
+		markInstanceChanged (group, entry.instanceIndex);
+	}
+
+	group.instances.resize (last);
+	group.owners.removeLast();
+	entry.instanceGroup = null;
+	entry.instanceIndex = -1;
+}
+
+// =============================================================================
+//
+void GLCompiler::markInstanceChanged (InstanceGroup& group, int index)
+{
+	if (group.dirtyBegin == group.dirtyEnd)
+	{
+		group.dirtyBegin = index;
+		group.dirtyEnd = index + 1;
+	}
+	else
+	{
+		group.dirtyBegin = qMin (group.dirtyBegin, index);
+		group.dirtyEnd = qMax (group.dirtyEnd, index + 1);
+	}
+}
+
+// =============================================================================
+//
+// Builds the mesh of @group if its document has new geometry, and uploads the
+// instances that have changed.
+//
+void GLCompiler::prepareInstanceGroup (InstanceGroup& group)
+{
+	if (group.meshVBO == 0)
+	{
+		glGenBuffers (1, &group.meshVBO);
+		glGenBuffers (1, &group.instanceVBO);
+	}
+
+	group.document->initializeCachedData();
+
+	if (group.meshChanged || group.document->polygonData().constData() != group.polygons.constData())
+	{
+		// Keep a reference to the polygons so that their data pointer tells
+		// whether the document's geometry has changed since. They must not be
+		// detached, hence the const reference.
+		group.polygons = group.document->polygonData();
+		group.meshChanged = false;
+		const QVector<LDPolygon>& polygons = group.polygons;
+		QVector<InstanceVertex> vertices[VBOSF_NumSurfaces];
+
+		for (LDPolygon poly : polygons)
 		{
-			if (complement == VBOCM_Surfaces)
+			EVBOSurface surface;
+			int numverts;
+
+			switch (poly.num)
 			{
-				// Write coordinates. Apparently Z must be flipped too?
-				vbodata	<< poly.vertices[vert].x()
-						<< -poly.vertices[vert].y()
-						<< -poly.vertices[vert].z();
+				case 2:	surface = VBOSF_Lines;		numverts = 2; break;
+				case 3:	surface = VBOSF_Triangles;	numverts = 3; break;
+				case 4:	surface = VBOSF_Quads;		numverts = 4; break;
+				case 5:	surface = VBOSF_CondLines;	numverts = 2; break;
+				default: continue;
 			}
+
+			InstanceVertex vertex;
+			memset (&vertex, 0, sizeof vertex);
+
+			if (poly.color == mainColorIndex)
+				vertex.usesMainColor = 0xFF;
 			else
+				vertex.color = packColor (getColorForPolygon (poly, LDObjectPtr(), VBOCM_NormalColors));
+
+			for (int vert = 0; vert < numverts; ++vert)
 			{
-				vbodata	<< ((GLfloat) color.red()) / 255.0f
-						<< ((GLfloat) color.green()) / 255.0f
-						<< ((GLfloat) color.blue()) / 255.0f
-						<< ((GLfloat) color.alpha()) / 255.0f;
+				for_axes (ax)
+					vertex.position[ax] = poly.vertices[vert][ax];
+
+				vertices[surface] << vertex;
 			}
 		}
+
+		QVector<InstanceVertex> mesh;
+
+		for (EVBOSurface surface = VBOSF_First; surface < VBOSF_NumSurfaces; ++surface)
+		{
+			group.first[surface] = mesh.size();
+			group.count[surface] = vertices[surface].size();
+			mesh += vertices[surface];
+		}
+
+		glBindBuffer (GL_ARRAY_BUFFER, group.meshVBO);
+		glBufferData (GL_ARRAY_BUFFER, mesh.size() * sizeof (InstanceVertex), mesh.constData(), GL_STATIC_DRAW);
+		m_uploadCount += mesh.size() * sizeof (InstanceVertex);
 	}
+
+	glBindBuffer (GL_ARRAY_BUFFER, group.instanceVBO);
+
+	if (group.instances.size() > group.capacity)
+	{
+		group.capacity = group.instances.size() * 2;
+		glBufferData (GL_ARRAY_BUFFER, group.capacity * sizeof (InstanceData), null, GL_DYNAMIC_DRAW);
+		group.dirtyBegin = 0;
+		group.dirtyEnd = group.instances.size();
+	}
+
+	group.dirtyEnd = qMin (group.dirtyEnd, group.instances.size());
+
+	if (group.dirtyBegin < group.dirtyEnd)
+	{
+		const int size = (group.dirtyEnd - group.dirtyBegin) * sizeof (InstanceData);
+		glBufferSubData (GL_ARRAY_BUFFER, group.dirtyBegin * sizeof (InstanceData), size,
+			group.instances.constData() + group.dirtyBegin);
+		m_uploadCount += size;
+	}
+
+	group.dirtyBegin = group.dirtyEnd = 0;
+	glBindBuffer (GL_ARRAY_BUFFER, 0);
+	checkGLError();
+}
+
+// =============================================================================
+//
+void GLCompiler::releaseInstanceGroup (InstanceGroup& group)
+{
+	if (group.meshVBO != 0)
+	{
+		glDeleteBuffers (1, &group.meshVBO);
+		glDeleteBuffers (1, &group.instanceVBO);
+		group.meshVBO = group.instanceVBO = 0;
+	}
+}
+
+// =============================================================================
+//
+// Draws the instanced documents' polygons of @surface with the colors of
+// @complement. Expects the VBOs of the surface to be prepared already.
+//
+void GLCompiler::drawInstances (EVBOSurface surface, EVBOComplement complement, GLenum type)
+{
+	if (m_instanceGroups.isEmpty())
+		return;
+
+	// The fixed-function arrays must not be read by the instanced draws.
+	glDisableClientState (GL_VERTEX_ARRAY);
+	glDisableClientState (GL_COLOR_ARRAY);
+	m_instanceProgram->bind();
+	m_instanceProgram->setUniformValue ("complement", int (complement));
+	m_instanceProgram->setUniformValue ("bfcColor",
+		(complement == VBOCM_BFCBackColors) ? g_BFCBackColor : g_BFCFrontColor);
+	m_instanceProgram->setUniformValue ("selectColor", QColor (cfg::selectColorBlend));
+
+	for (int i = 0; i < InstanceAttrib_Count; ++i)
+		m_instanceProgram->enableAttributeArray (i);
+
+	for (auto it = m_instanceGroups.begin(); it != m_instanceGroups.end();)
+	{
+		InstanceGroup& group = *it;
+
+		// Groups are released here since the GL context is current.
+		if (group.instances.isEmpty())
+		{
+			releaseInstanceGroup (group);
+			it = m_instanceGroups.erase (it);
+			continue;
+		}
+
+		prepareInstanceGroup (group);
+		++it;
+
+		if (group.count[surface] == 0)
+			continue;
+
+		glBindBuffer (GL_ARRAY_BUFFER, group.meshVBO);
+		m_instanceProgram->setAttributeBuffer (InstanceAttrib_Position, GL_FLOAT,
+			offsetof (InstanceVertex, position), 3, sizeof (InstanceVertex));
+		m_instanceProgram->setAttributeBuffer (InstanceAttrib_Color, GL_UNSIGNED_BYTE,
+			offsetof (InstanceVertex, color), 4, sizeof (InstanceVertex));
+		m_instanceProgram->setAttributeBuffer (InstanceAttrib_UsesMainColor, GL_UNSIGNED_BYTE,
+			offsetof (InstanceVertex, usesMainColor), 1, sizeof (InstanceVertex));
+
+		glBindBuffer (GL_ARRAY_BUFFER, group.instanceVBO);
+
+		for (int i = 0; i < 3; ++i)
+		{
+			m_instanceProgram->setAttributeBuffer (InstanceAttrib_TransformX + i, GL_FLOAT,
+				offsetof (InstanceData, transform) + (i * 4 * sizeof (GLfloat)), 4, sizeof (InstanceData));
+		}
+
+		m_instanceProgram->setAttributeBuffer (InstanceAttrib_MainColor, GL_UNSIGNED_BYTE,
+			offsetof (InstanceData, mainColor), 4, sizeof (InstanceData));
+		m_instanceProgram->setAttributeBuffer (InstanceAttrib_PickColor, GL_UNSIGNED_BYTE,
+			offsetof (InstanceData, pickColor), 4, sizeof (InstanceData));
+		m_instanceProgram->setAttributeBuffer (InstanceAttrib_RandomColor, GL_UNSIGNED_BYTE,
+			offsetof (InstanceData, randomColor), 4, sizeof (InstanceData));
+		m_instanceProgram->setAttributeBuffer (InstanceAttrib_Blend, GL_FLOAT,
+			offsetof (InstanceData, blend), 1, sizeof (InstanceData));
+
+		for (int i = InstanceAttrib_FirstPerInstance; i < InstanceAttrib_Count; ++i)
+			glVertexAttribDivisorARB (i, 1);
+
+		glDrawArraysInstancedARB (type, group.first[surface], group.count[surface], group.instances.size());
+		checkGLError();
+	}
+
+	for (int i = 0; i < InstanceAttrib_Count; ++i)
+	{
+		glVertexAttribDivisorARB (i, 0);
+		m_instanceProgram->disableAttributeArray (i);
+	}
+
+	glBindBuffer (GL_ARRAY_BUFFER, 0);
+	m_instanceProgram->release();
+	glEnableClientState (GL_VERTEX_ARRAY);
+	glEnableClientState (GL_COLOR_ARRAY);
 }
@@ -22,25 +22,69 @@
 #include "glShared.h"
 #include <QMap>
 
+class QGLShaderProgram;
+
 // =============================================================================
 //
 class GLCompiler
 {
 public:
+	// Attributes of a single instance of an instanced document, 64 bytes.
+	struct InstanceData
+	{
+		GLfloat		transform[12];	// Rows of the 3x4 matrix from local space
+		uint32		mainColor;		// Color of the polygons of the main color
+		uint32		pickColor;
+		uint32		randomColor;
+		GLfloat		blend;			// How much the selection color is blended in
+	};
+
 	struct ObjectVBOInfo
 	{
-		QVector<GLfloat>	data[g_numVBOs];
+		// Coordinates of the vertices of each surface, three floats each
+		QVector<GLfloat>	positions[VBOSF_NumSurfaces];
+
+		// LDraw color of each polygon of each surface. The colors in the VBOs
+		// are computed from these when the object is laid out.
+		QVector<int>		colors[VBOSF_NumSurfaces];
 		bool				isChanged;
+
+		// Offset of the object's range in each surface, in vertices. -1 if
+		// the object has no range, e.g. because it is hidden.
+		int					offsets[VBOSF_NumSurfaces];
+
+		// Subfile references drawn with instancing have no geometry of their
+		// own, just an instance in the group of the document they reference.
+		bool				isInstanced;
+		InstanceData		instance;
+		LDDocument*			instanceGroup; // null if the instance is not placed
+		int					instanceIndex;
+
+		ObjectVBOInfo() :
+			isInstanced (false),
+			instanceGroup (null),
+			instanceIndex (-1)
+		{
+			for (int i = 0; i < VBOSF_NumSurfaces; ++i)
+				offsets[i] = -1;
+		}
+
+		inline int numVertices (EVBOSurface surface) const
+		{
+			return positions[surface].size() / 3;
+		}
 	};
 
 	GLCompiler (GLRenderer* renderer);
 	~GLCompiler();
 	void				compileDocument (LDDocumentPtr doc);
+	void				drawInstances (EVBOSurface surface, EVBOComplement complement, GLenum type);
 	void				dropObject (LDObjectPtr obj);
 	void				initialize();
 	QColor				getColorForPolygon (LDPolygon& poly, LDObjectPtr topobj,
 											EVBOComplement complement) const;
 	QColor				indexColorForID (int id) const;
+	long				memoryUsage() const;
 	void				needMerge();
 	void				prepareVBO (int vbonum);
 	void				stageForCompilation (LDObjectPtr obj);
@@ -58,22 +102,119 @@ public:
 		return m_vbo[vbonum];
 	}
 
-	inline int			vboSize (int vbonum) const
+	// Amount of vertices to draw from the VBOs of @surface
+	inline int			vertexCount (EVBOSurface surface) const
+	{
+		return m_usedVertices[surface];
+	}
+
+	// Bytes uploaded to the VBOs since the last call to resetUploadCount()
+	inline long			uploadCount() const
+	{
+		return m_uploadCount;
+	}
+
+	inline void			resetUploadCount()
 	{
-		return m_vboSizes[vbonum];
+		m_uploadCount = 0;
+	}
+
+	// Surface VBOs hold three floats per vertex, the others RGBA8 colors.
+	static inline int	bytesPerVertex (EVBOComplement complement)
+	{
+		return (complement == VBOCM_Surfaces) ? 3 * sizeof (GLfloat) : sizeof (uint32);
 	}
 
 private:
+	// A document whose references are drawn with instancing. Its geometry is
+	// laid out once in local space and drawn once per reference.
+	struct InstanceGroup
+	{
+		LDDocumentPtr			document;
+		QVector<LDPolygon>		polygons; // The polygons the mesh was built from
+		GLuint					meshVBO;
+		GLuint					instanceVBO;
+		int						first[VBOSF_NumSurfaces];
+		int						count[VBOSF_NumSurfaces];
+		bool					meshChanged;
+		QVector<InstanceData>	instances;
+		LDObjectWeakList		owners; // The reference of each instance
+		int						capacity; // Instances the instance VBO has room for
+		int						dirtyBegin;
+		int						dirtyEnd;
+	};
+
+	// A vertex of an instanced mesh, 20 bytes.
+	struct InstanceVertex
+	{
+		GLfloat		position[3];
+		uint32		color;
+		uchar		usesMainColor; // 0xFF if the instance's main color is used
+		uchar		padding[3];
+	};
+
 	void			compileStaged();
 	void			compileObject (LDObjectPtr obj);
-	void			compilePolygon (LDPolygon& poly, LDObjectPtr topobj, GLCompiler::ObjectVBOInfo* objinfo);
+	void			compilePolygon (LDPolygon& poly, GLCompiler::ObjectVBOInfo* objinfo);
+	bool			isDrawn (LDObjectPtr obj) const;
+	void			storeObject (ObjectVBOInfo& entry, const ObjectVBOInfo& compiled, LDObjectPtr obj, bool drawn);
+	void			placeObject (ObjectVBOInfo& entry, LDObjectPtr obj, EVBOSurface surface);
+	void			unplaceObject (ObjectVBOInfo& entry);
+	void			writeColors (ObjectVBOInfo& entry, LDObjectPtr obj, EVBOSurface surface,
+						EVBOComplement complement);
+	int				allocateRange (EVBOSurface surface, int numVertices);
+	void			freeRange (EVBOSurface surface, int offset, int numVertices);
+	void			writeRange (int vbonum, int offset, const void* data, int size);
+	void			resizeVBO (int vbonum, int size);
+	void			rebuild();
+	void			compact (EVBOSurface surface);
+	void			computeInstance (LDSubfilePtr ref, InstanceData& instance) const;
+	void			placeInstance (ObjectVBOInfo& entry, LDObjectPtr obj);
+	void			unplaceInstance (ObjectVBOInfo& entry);
+	void			markInstanceChanged (InstanceGroup& group, int index);
+	void			prepareInstanceGroup (InstanceGroup& group);
+	void			releaseInstanceGroup (InstanceGroup& group);
+	double			selectionBlend (LDObjectPtr obj) const;
+
+	static long		dataSize (const ObjectVBOInfo& entry);
 
 	QMap<LDObjectWeakPtr, ObjectVBOInfo>	m_objectInfo;
 	LDObjectWeakList						m_staged; // Objects that need to be compiled
 	GLuint									m_vbo[g_numVBOs];
-	bool									m_vboChanged[g_numVBOs];
-	int										m_vboSizes[g_numVBOs];
 	GLRenderer* const						m_renderer;
+	long									m_objectBytes; // Size of the data in m_objectInfo
+
+	// Each object that is drawn has a range in the VBOs of the surfaces it
+	// has polygons in. The ranges of a surface are allocated from its free
+	// ranges, or from the end of the used part of its VBOs. Freed ranges are
+	// filled with degenerate polygons until the VBOs are compacted.
+	LDDocumentWeakPtr						m_document; // The document drawn
+	bool									m_needRebuild;
+	int										m_usedVertices[VBOSF_NumSurfaces];
+	int										m_freeVertices[VBOSF_NumSurfaces];
+	int										m_capacity[VBOSF_NumSurfaces];
+	QMap<int, int>							m_freeRanges[VBOSF_NumSurfaces]; // offset -> length
+
+	// Copies of the VBO contents, and the parts of them that have changed
+	// since the last upload, in bytes. Color VBOs are only filled in once
+	// they are first drawn.
+	QByteArray								m_vboData[g_numVBOs];
+	bool									m_vboInUse[g_numVBOs];
+	bool									m_vboResized[g_numVBOs];
+	int										m_dirtyBegin[g_numVBOs];
+	int										m_dirtyEnd[g_numVBOs];
+	long									m_uploadCount;
+
+	// Reused for the flattened polygons of subfile references and for the
+	// colors of an object
+	QVector<LDPolygon>						m_polygonBuffer;
+	QVector<uint32>							m_colorBuffer;
+
+	// Instanced documents, available if the GL implementation can draw
+	// instances. Groups without instances are released once drawn.
+	bool									m_instancing;
+	QGLShaderProgram*						m_instanceProgram;
+	QMap<LDDocument*, InstanceGroup>		m_instanceGroups;
 };
 
 #define checkGLError() { checkGLError_private (__FILE__, __LINE__); }
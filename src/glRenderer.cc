@@ -63,6 +63,26 @@ static const Matrix g_circleDrawMatrixTemplates[3] =
 	{ 0, 1, 0, 2, 0, 0, 0, 0, 2 },
 };
 
+// Rotates @v by @angle degrees around the unit axis (@x, @y, @z), like
+// glRotatef does.
+static void rotateVector (double v[3], double angle, double x, double y, double z)
+{
+	const double radians = (angle * pi) / 180.0;
+	const double c = cos (radians);
+	const double s = sin (radians);
+	const double dot = (x * v[0]) + (y * v[1]) + (z * v[2]);
+	const double cross[3] =
+	{
+		(y * v[2]) - (z * v[1]),
+		(z * v[0]) - (x * v[2]),
+		(x * v[1]) - (y * v[0]),
+	};
+	const double axis[3] = { x, y, z };
+
+	for (int i = 0; i < 3; ++i)
+		v[i] = (v[i] * c) + (cross[i] * s) + (axis[i] * dot * (1.0 - c));
+}
+
 CFGENTRY (String,	backgroundColor,			"#FFFFFF")
 CFGENTRY (String,	mainColor,					"#A0A0A0")
 CFGENTRY (Float,	mainColorAlpha,				1.0)
@@ -78,6 +98,7 @@ CFGENTRY (Bool,		drawLineLengths,			true)
 CFGENTRY (Bool,		drawAngles,					false)
 CFGENTRY (Bool,		randomColors,				false)
 CFGENTRY (Bool,		highlightObjectBelowCursor,	true)
+CFGENTRY (Bool,		cpuPicking,					true)
 
 // argh
 const char* g_CameraNames[7] =
@@ -113,6 +134,7 @@ static GLuint g_GLAxes_ColorVBO;
 GLRenderer::GLRenderer (QWidget* parent) : QGLWidget (parent)
 {
 	m_isPicking = m_rangepick = false;
+	m_hasPickMatrices = false;
 	m_camera = (ECamera) cfg::camera;
 	m_drawToolTip = false;
 	m_editMode = ESelectMode;
@@ -369,11 +391,14 @@ void GLRenderer::drawGLScene()
 	{
 		currentDocumentData().needZoomToFit = false;
 		zoomAllToFit();
+		m_virtWidth = zoom();
+		m_virtHeight = (m_height * m_virtWidth) / m_width;
 	}
 
 	if (cfg::drawWireframe && not isPicking())
 		glPolygonMode (GL_FRONT_AND_BACK, GL_LINE);
 
+	m_compiler->resetUploadCount();
 	glClear (GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 	glEnable (GL_DEPTH_TEST);
 
@@ -413,6 +438,12 @@ void GLRenderer::drawGLScene()
 		glRotatef (rot (Z), 0.0f, 0.0f, 1.0f);
 	}
 
+	// Remember the matrices so that objects can be picked on the CPU.
+	glGetDoublev (GL_MODELVIEW_MATRIX, m_modelViewMatrix);
+	glGetDoublev (GL_PROJECTION_MATRIX, m_projectionMatrix);
+	glGetIntegerv (GL_VIEWPORT, m_viewport);
+	m_hasPickMatrices = true;
+
 	glEnableClientState (GL_VERTEX_ARRAY);
 	glEnableClientState (GL_COLOR_ARRAY);
 
@@ -486,7 +517,7 @@ void GLRenderer::drawVBOs (EVBOSurface surface, EVBOComplement colors, GLenum ty
 	m_compiler->prepareVBO (colornum);
 	GLuint surfacevbo = m_compiler->vbo (surfacenum);
 	GLuint colorvbo = m_compiler->vbo (colornum);
-	GLsizei count = m_compiler->vboSize (surfacenum) / 3;
+	GLsizei count = m_compiler->vertexCount (surface);
 
 	if (count > 0)
 	{
@@ -494,11 +525,13 @@ void GLRenderer::drawVBOs (EVBOSurface surface, EVBOComplement colors, GLenum ty
 		glVertexPointer (3, GL_FLOAT, 0, null);
 		checkGLError();
 		glBindBuffer (GL_ARRAY_BUFFER, colorvbo);
-		glColorPointer (4, GL_FLOAT, 0, null);
+		glColorPointer (4, GL_UNSIGNED_BYTE, 0, null);
 		checkGLError();
 		glDrawArrays (type, 0, count);
 		checkGLError();
 	}
+
+	m_compiler->drawInstances (surface, colors, type);
 }
 
 // =============================================================================
@@ -593,8 +626,9 @@ void GLRenderer::paintEvent (QPaintEvent*)
 #ifndef RELEASE
 	if (not isPicking())
 	{
-		QString text = format ("Rotation: (%1, %2, %3)\nPanning: (%4, %5), Zoom: %6",
-			rot(X), rot(Y), rot(Z), pan(X), pan(Y), zoom());
+		QString text = format ("Rotation: (%1, %2, %3)\nPanning: (%4, %5), Zoom: %6\nUploaded: %7 bytes, compiled: %8 KiB",
+			rot(X), rot(Y), rot(Z), pan(X), pan(Y), zoom(), m_compiler->uploadCount(),
+			m_compiler->memoryUsage() / 1024);
 		QRect textSize = metrics.boundingRect (0, 0, m_width, m_height, Qt::AlignCenter, text);
 		paint.setPen (textpen);
 		paint.drawText ((width() - textSize.width()) / 2, height() - textSize.height(), textSize.width(),
@@ -1030,10 +1064,13 @@ void GLRenderer::mouseReleaseEvent (QMouseEvent* ev)
 		Vertex			cursorPosition = coordconv2_3 (m_mousePosition, false);
 		QPoint			cursorPosition2D (m_mousePosition);
 		const Axis		relZ = getRelativeZ();
-		QList<Vertex>	vertices;
 
-		for (auto it = document()->vertices().begin(); it != document()->vertices().end(); ++it)
-			vertices << it.key();
+		// Only vertices within 64 pixels of the cursor are considered, so ask
+		// the vertex index for those. The range is a bit larger than needed
+		// since the exact distance is checked on screen below anyway.
+		const double	unitsPerPixel = (2 * m_virtWidth) / m_width;
+		QVector<Vertex>	vertices = document()->knownVertices().findNear (relZ,
+			cursorPosition, 64.0 * 1.5 * unitsPerPixel);
 
 		// Sort the vertices in order of distance to camera
 		std::sort (vertices.begin(), vertices.end(), [&](const Vertex& a, const Vertex& b) -> bool
@@ -1224,10 +1261,6 @@ void GLRenderer::pick (int mouseX, int mouseY)
 			compileObject (obj);
 	}
 
-	// Paint the picking scene
-	setPicking (true);
-	drawGLScene();
-
 	int x0 = mouseX,
 		  y0 = mouseY;
 	int x1, y1;
@@ -1257,32 +1290,41 @@ void GLRenderer::pick (int mouseX, int mouseY)
 	y0 = max (0, y0);
 	x1 = min (x1, m_width);
 	y1 = min (y1, m_height);
-	const int areawidth = (x1 - x0);
-	const int areaheight = (y1 - y0);
-	const qint32 numpixels = areawidth * areaheight;
-
-	// Allocate space for the pixel data.
-	uchar* const pixeldata = new uchar[4 * numpixels];
-	uchar* pixelptr = &pixeldata[0];
-
-	// Read pixels from the color buffer.
-	glReadPixels (x0, m_height - y1, areawidth, areaheight, GL_RGBA, GL_UNSIGNED_BYTE, pixeldata);
-
 	LDObjectPtr removedObj;
 	QList<qint32> indices;
 
-	// Go through each pixel read and add them to the selection.
-	// Note: black is background, those indices are skipped.
-	for (qint32 i = 0; i < numpixels; ++i)
+	if (not pickOnCPU (x0, y0, x1, y1, indices))
 	{
-		qint32 idx =
-			(*(pixelptr + 0) * 0x10000) +
-			(*(pixelptr + 1) * 0x100) +
-			*(pixelptr + 2);
-		pixelptr += 4;
+		// Paint the picking scene
+		setPicking (true);
+		drawGLScene();
+
+		const int areawidth = (x1 - x0);
+		const int areaheight = (y1 - y0);
+		const qint32 numpixels = areawidth * areaheight;
+
+		// Allocate space for the pixel data.
+		uchar* const pixeldata = new uchar[4 * numpixels];
+		uchar* pixelptr = &pixeldata[0];
+
+		// Read pixels from the color buffer.
+		glReadPixels (x0, m_height - y1, areawidth, areaheight, GL_RGBA, GL_UNSIGNED_BYTE, pixeldata);
 
-		if (idx != 0)
-			indices << idx;
+		// Go through each pixel read and add them to the selection.
+		// Note: black is background, those indices are skipped.
+		for (qint32 i = 0; i < numpixels; ++i)
+		{
+			qint32 idx =
+				(*(pixelptr + 0) * 0x10000) +
+				(*(pixelptr + 1) * 0x100) +
+				*(pixelptr + 2);
+			pixelptr += 4;
+
+			if (idx != 0)
+				indices << idx;
+		}
+
+		delete[] pixeldata;
 	}
 
 	removeDuplicates (indices);
@@ -1307,8 +1349,6 @@ void GLRenderer::pick (int mouseX, int mouseY)
 		obj->select();
 	}
 
-	delete[] pixeldata;
-
 	// Update everything now.
 	g_win->updateSelection();
 
@@ -1324,6 +1364,127 @@ void GLRenderer::pick (int mouseX, int mouseY)
 	repaint();
 }
 
+// =============================================================================
+//
+// Picks the objects in the area [x0, x1) x [y0, y1) from the picking trees of
+// the document, without drawing anything. A single pixel picks the nearest
+// object, larger areas pick all objects within them. Returns false if the
+// picking scene needs to be drawn instead.
+//
+bool GLRenderer::pickOnCPU (int x0, int y0, int x1, int y1, QList<qint32>& indices)
+{
+	if (not cfg::cpuPicking || not m_hasPickMatrices || document() == null)
+		return false;
+
+	if (x1 <= x0 || y1 <= y0)
+		return true;
+
+	if (x1 - x0 == 1 && y1 - y0 == 1)
+	{
+		LDPickRay ray;
+
+		if (not getPickRay (x0 + 0.5, y0 + 0.5, ray))
+			return false;
+
+		const int id = document()->pickObject (ray);
+
+		if (id != 0)
+			indices << id;
+	}
+	else
+	{
+		LDPickFrustum frustum;
+		getPickFrustum (x0, y0, x1, y1, frustum);
+		indices = document()->pickObjects (frustum);
+	}
+
+	return true;
+}
+
+// =============================================================================
+//
+// Converts a point on the screen at @depth (0 is the near plane, 1 the far
+// plane) to LDraw coordinates, using the matrices of the last scene drawn.
+//
+Vertex GLRenderer::unproject (double x, double y, double depth) const
+{
+	GLdouble px, py, pz;
+	gluUnProject (x, m_viewport[3] - y, depth, m_modelViewMatrix, m_projectionMatrix, m_viewport,
+		&px, &py, &pz);
+
+	// The scene is drawn with Y and Z flipped
+	return Vertex (px, -py, -pz);
+}
+
+// =============================================================================
+//
+// Computes the ray through the point (@x, @y) on the screen. Lines are picked
+// if they are within half of the line thickness of the point.
+//
+bool GLRenderer::getPickRay (double x, double y, LDPickRay& ray) const
+{
+	if (not m_hasPickMatrices)
+		return false;
+
+	const Vertex nearPoint = unproject (x, y, 0.0);
+	const Vertex farPoint = unproject (x, y, 1.0);
+	const double radius = max (cfg::lineThickness, 1) / 2.0;
+	ray.origin = nearPoint;
+	ray.direction = farPoint - nearPoint;
+	ray.nearRadius = (unproject (x + 1.0, y, 0.0) - nearPoint).length() * radius;
+	ray.farRadius = (unproject (x + 1.0, y, 1.0) - farPoint).length() * radius;
+	return true;
+}
+
+// =============================================================================
+//
+// Computes the frustum of the rectangle [x0, x1] x [y0, y1] on the screen.
+//
+void GLRenderer::getPickFrustum (int x0, int y0, int x1, int y1, LDPickFrustum& frustum) const
+{
+	// The corners on the near plane, then on the far plane
+	Vertex corners[8];
+	Vertex center;
+
+	for (int i = 0; i < 8; ++i)
+	{
+		corners[i] = unproject ((i & 1) ? x1 : x0, (i & 2) ? y1 : y0, (i & 4) ? 1.0 : 0.0);
+		center += corners[i] / 8;
+	}
+
+	// Three corners on each plane: left, right, top, bottom, near, far.
+	static const int planeCorners[LDPickFrustum::NumPlanes][3] =
+	{
+		{ 0, 2, 4 },
+		{ 1, 3, 5 },
+		{ 0, 1, 4 },
+		{ 2, 3, 6 },
+		{ 0, 1, 2 },
+		{ 4, 5, 6 },
+	};
+
+	for (int i = 0; i < LDPickFrustum::NumPlanes; ++i)
+	{
+		const Vertex& a = corners[planeCorners[i][0]];
+		const Vertex& b = corners[planeCorners[i][1]];
+		const Vertex& c = corners[planeCorners[i][2]];
+		QVector3D normal = QVector3D::crossProduct (b - a, c - a);
+		double d = -QVector3D::dotProduct (normal, a);
+
+		// Make the normal point inwards
+		if (QVector3D::dotProduct (normal, center) + d < 0.0)
+		{
+			normal = -normal;
+			d = -d;
+		}
+
+		frustum.planes[i][0] = normal.x();
+		frustum.planes[i][1] = normal.y();
+		frustum.planes[i][2] = normal.z();
+		frustum.planes[i][3] = d;
+	}
+}
+
 // =============================================================================
 //
 void GLRenderer::setEditMode (EditMode const& a)
@@ -1853,94 +2014,92 @@ void GLRenderer::zoomToFit()
 	if (document() == null || m_width == -1 || m_height == -1)
 		return;
 
-	bool lastfilled = false;
-	bool firstrun = true;
-	const uint32 white = 0xFFFFFFFF;
-	bool inward = true;
-	const int w = m_width, h = m_height;
-	int runaway = 50;
+	const LDVertexIndex& vertices = document()->knownVertices();
+	Vertex min, max;
 
-	glClearColor (1.0, 1.0, 1.0, 1.0);
-	glDisable (GL_DITHER);
+	if (not vertices.bounds (min, max))
+		return;
 
-	// Use the pick list while drawing the scene, this way we can tell whether borders
-	// are background or not.
-	setPicking (true);
+	// Leave a little room between the model and the edges of the view
+	const double margin = 1.05;
+	const double aspect = double (m_width) / m_height;
+	double fit = -HUGE_VAL;
 
-	while (--runaway)
+	if (camera() == EFreeCamera)
 	{
-		if (zoom() > 10000.0 || zoom() < 0.0)
-		{
-			// Obviously, there's nothing to draw if we get here.
-			// Default to 30.0f and break out.
-			zoom() = 30.0;
-			break;
-		}
-
-		zoomNotch (inward);
-
-		uchar* cap = new uchar[4 * w * h];
-		drawGLScene();
-		glReadPixels (0, 0, w, h, GL_RGBA, GL_UNSIGNED_BYTE, cap);
-		uint32* imgdata = reinterpret_cast<uint32*> (cap);
-		bool filled = false;
+		// The view is a 45 degree perspective from 2 + zoom units away, so a
+		// point is in view if its distance from the view axis is at most its
+		// distance from the camera times tan 22.5. This is linear in the zoom,
+		// so each vertex gives the zoom needed to bring it into view directly.
+		const double focal = 1.0 / tan (pi / 8);
 
-		// Check the top and bottom rows
-		for (int i = 0; i < w; ++i)
+		vertices.forEachVertex ([&](const Vertex& a)
 		{
-			if (imgdata[i] != white || imgdata[((h - 1) * w) + i] != white)
-			{
-				filled = true;
-				break;
-			}
-		}
+			double v[3];
+			toCameraSpace (a, v);
+			fit = qMax (fit, ((margin * focal * fabs (v[X])) / aspect) + v[Z] - 2.0);
+			fit = qMax (fit, (margin * focal * fabs (v[Y])) + v[Z] - 2.0);
 
-		// Left and right edges
-		if (filled == false)
+			// Keep the vertex beyond the near plane as well
+			fit = qMax (fit, v[Z] - 1.0);
+		});
+	}
+	else
+	{
+		// Fixed cameras look along the coordinate axes, so the model fits if the
+		// corners of its bounding box fit. The zoom is half of the width of the
+		// view in LDraw units.
+		for (int i = 0; i < 8; ++i)
 		{
-			for (int i = 0; i < h; ++i)
-			{
-				if (imgdata[i * w] != white || imgdata[(i * w) + w - 1] != white)
-				{
-					filled = true;
-					break;
-				}
-			}
+			const Vertex corner ((i & 1) ? max.x() : min.x(),
+				(i & 2) ? max.y() : min.y(),
+				(i & 4) ? max.z() : min.z());
+			double v[3];
+			toCameraSpace (corner, v);
+			fit = qMax (fit, margin * fabs (v[X]));
+			fit = qMax (fit, margin * fabs (v[Y]) * aspect);
 		}
 
-		delete[] cap;
-
-		if (firstrun)
-		{
-			// If this is the first run, we don't know enough to determine
-			// whether the zoom was to fit, so we mark in our knowledge so
-			// far and start over.
-			inward = not filled;
-			firstrun = false;
-		}
-		else
-		{
-			// If this run filled the screen and the last one did not, the
-			// last run had ideal zoom - zoom a bit back and we should reach it.
-			if (filled && not lastfilled)
-			{
-				zoomNotch (false);
-				break;
-			}
+		// Obviously, there's nothing to draw if we get here.
+		if (fit <= 0.0)
+			return;
+	}
 
-			// If this run did not fill the screen and the last one did, we've
-			// now reached ideal zoom so we're done here.
-			if (not filled && lastfilled)
-				break;
+	if (fit <= 10000.0)
+		zoom() = fit;
+}
 
-			inward = not filled;
-		}
+// =============================================================================
+//
+// Transforms @a the way the current camera transforms the scene, except for the
+// zoom. For the free camera, the result is relative to a camera at the origin.
+//
+void GLRenderer::toCameraSpace (const Vertex& a, double out[3]) const
+{
+	// The scene is drawn with Y and Z negated
+	out[X] = a.x();
+	out[Y] = -a.y();
+	out[Z] = -a.z();
 
-		lastfilled = filled;
+	if (camera() == EFreeCamera)
+	{
+		rotateVector (out, rot (Z), 0, 0, 1);
+		rotateVector (out, rot (Y), 0, 1, 0);
+		rotateVector (out, rot (X), 1, 0, 0);
+	}
+	elif (camera() == EBackCamera)
+	{
+		rotateVector (out, 180.0, 0, 0, 1);
+		rotateVector (out, 180.0, 1, 0, 0);
+	}
+	elif (camera() != EFrontCamera)
+	{
+		const LDFixedCameraInfo& info = g_FixedCameras[camera()];
+		rotateVector (out, 90.0, info.glrotate[0], info.glrotate[1], info.glrotate[2]);
 	}
 
-	setBackground();
-	setPicking (false);
+	out[X] += pan (X);
+	out[Y] += pan (Y);
 }
 
 // =============================================================================
@@ -2013,17 +2172,30 @@ void GLRenderer::mouseDoubleClickEvent (QMouseEvent* ev)
 
 // =============================================================================
 //
-LDOverlayPtr GLRenderer::findOverlayObject (ECamera cam)
+// Finds the overlay objects of the current document in one pass, indexed by
+// camera. Raw lines are plain comments and can be skipped without parsing.
+//
+void GLRenderer::findOverlayObjects (LDOverlayPtr* overlays)
 {
-	for (LDObjectPtr obj : document()->objects())
+	for (ECamera cam = EFirstCamera; cam < ENumCameras; ++cam)
+		overlays[cam].clear();
+
+	for (int i = 0; i < document()->getObjectCount(); ++i)
 	{
-		LDOverlayPtr ovlobj = obj.dynamicCast<LDOverlay>();
+		if (document()->isRawLine (i))
+			continue;
 
-		if (ovlobj != null && obj.staticCast<LDOverlay>()->camera() == cam)
-			return ovlobj;
-	}
+		LDObjectPtr obj = document()->getObject (i);
+
+		if (obj->type() != OBJ_Overlay)
+			continue;
 
-	return LDOverlayPtr();
+		LDOverlayPtr ovlobj = obj.staticCast<LDOverlay>();
+		int cam = ovlobj->camera();
+
+		if (cam >= EFirstCamera && cam < ENumCameras && overlays[cam] == null)
+			overlays[cam] = ovlobj;
+	}
 }
 
 // =============================================================================
@@ -2032,13 +2204,16 @@ LDOverlayPtr GLRenderer::findOverlayObject (ECamera cam)
 //
 void GLRenderer::initOverlaysFromObjects()
 {
+	LDOverlayPtr overlays[ENumCameras];
+	findOverlayObjects (overlays);
+
 	for (ECamera cam = EFirstCamera; cam < ENumCameras; ++cam)
 	{
 		if (cam == EFreeCamera)
 			continue;
 
 		LDGLOverlay& meta = currentDocumentData().overlays[cam];
-		LDOverlayPtr ovlobj = findOverlayObject (cam);
+		LDOverlayPtr ovlobj = overlays[cam];
 
 		if (ovlobj == null && meta.img != null)
 		{
@@ -2059,13 +2234,18 @@ void GLRenderer::initOverlaysFromObjects()
 //
 void GLRenderer::updateOverlayObjects()
 {
+	// Each camera only touches its own overlay object, so the objects can all
+	// be looked up before the loop.
+	LDOverlayPtr overlays[ENumCameras];
+	findOverlayObjects (overlays);
+
 	for (ECamera cam = EFirstCamera; cam < ENumCameras; ++cam)
 	{
 		if (cam == EFreeCamera)
 			continue;
 
 		LDGLOverlay& meta = currentDocumentData().overlays[cam];
-		LDOverlayPtr ovlobj = findOverlayObject (cam);
+		LDOverlayPtr ovlobj = overlays[cam];
 
 		if (meta.img == null && ovlobj != null)
 		{
@@ -2145,10 +2325,17 @@ void GLRenderer::highlightCursorObject()
 	LDObjectWeakPtr oldObject = objectAtCursor();
 	qint32 newIndex;
 
+	QList<qint32> indices;
+
 	if (isCameraMoving() || not cfg::highlightObjectBelowCursor)
 	{
 		newIndex = 0;
 	}
+	elif (pickOnCPU (m_mousePosition.x(), m_mousePosition.y(),
+		m_mousePosition.x() + 1, m_mousePosition.y() + 1, indices))
+	{
+		newIndex = indices.isEmpty() ? 0 : indices[0];
+	}
 	else
 	{
 		setPicking (true);
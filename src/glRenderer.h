@@ -231,6 +231,12 @@ private:
 	Vertex					m_rectverts[4];
 	QColor					m_bgcolor;
 
+	// The matrices of the last scene drawn, for picking on the CPU
+	GLdouble				m_modelViewMatrix[16];
+	GLdouble				m_projectionMatrix[16];
+	GLint					m_viewport[4];
+	bool					m_hasPickMatrices;
+
 	void					addDrawnVertex (Vertex m_hoverpos);
 	void					calcCameraIcons();
 	void					clampAngle (double& angle) const;
@@ -239,7 +245,7 @@ private:
 	QPoint					coordconv3_2 (const Vertex& pos3d) const;
 	void					drawBlip (QPainter& paint, QPoint pos) const;
 	void					drawVBOs (EVBOSurface surface, EVBOComplement colors, GLenum type);
-	LDOverlayPtr			findOverlayObject (ECamera cam);
+	void					findOverlayObjects (LDOverlayPtr* overlays);
 	double					getCircleDrawDist (int pos) const;
 	Matrix					getCircleDrawMatrix (double scale);
 	void					getRelativeAxes (Axis& relX, Axis& relY) const;
@@ -247,7 +253,13 @@ private:
 	inline double&			pan (Axis ax);
 	inline const double&	pan (Axis ax) const;
 	void					pick (int mouseX, int mouseY);
+	bool					pickOnCPU (int x0, int y0, int x1, int y1, QList<qint32>& indices);
+	bool					getPickRay (double x, double y, LDPickRay& ray) const;
+	void					getPickFrustum (int x0, int y0, int x1, int y1, LDPickFrustum& frustum) const;
+	Vertex					unproject (double x, double y, double depth) const;
+	void					toCameraSpace (const Vertex& a, double out[3]) const;
 	inline double&			rot (Axis ax);
+	inline const double&	rot (Axis ax) const;
 	void					updateRectVerts();
 	inline double&			zoom();
 	void					zoomToFit();
@@ -282,6 +294,14 @@ inline double& GLRenderer::rot (Axis ax)
 					currentDocumentData().rotZ;
 }
 
+inline double const& GLRenderer::rot (Axis ax) const
+{
+	return
+		(ax == X) ? currentDocumentData().rotX :
+		(ax == Y) ? currentDocumentData().rotY :
+					currentDocumentData().rotZ;
+}
+
 inline double& GLRenderer::pan (Axis ax)
 {
 	return (ax == X) ? currentDocumentData().panX[camera()] :
@@ -0,0 +1,892 @@
+/*
+ *  LDForge: LDraw parts authoring CAD
+ *  Copyright (C) 2013, 2014 Santeri Piippo
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include "ldBVH.h"
+#include "ldDocument.h"
+#include "ldObject.h"
+
+enum
+{
+	MaxLeafSize = 4,
+	MaxDepth = 64,
+	MaxClipVertices = 4 + LDPickFrustum::NumPlanes,
+};
+
+//
+// A ray or a frustum in the coordinates of a tree, and the transformation
+// from those coordinates to LDraw coordinates. The t of a ray is the same in
+// all coordinates, as the transformation is affine.
+//
+struct LDPickSpace
+{
+	const LDPickRay*	ray; // null for frustum queries
+	double				origin[3];
+	double				direction[3];
+	double				inflate; // How much boxes are grown for the ray
+	double				planes[LDPickFrustum::NumPlanes][4];
+	bool				isLocal;
+	double				matrix[9];
+	double				position[3];
+
+	void toWorld (const Vertex& a, double out[3]) const
+	{
+		if (not isLocal)
+		{
+			for (int i = 0; i < 3; ++i)
+				out[i] = a[(Axis) i];
+
+			return;
+		}
+
+		for (int i = 0; i < 3; ++i)
+		{
+			out[i] = (matrix[(i * 3) + 0] * a.x()) + (matrix[(i * 3) + 1] * a.y())
+				+ (matrix[(i * 3) + 2] * a.z()) + position[i];
+		}
+	}
+};
+
+struct LDItemBox
+{
+	double	min[3];
+	double	max[3];
+};
+
+// =============================================================================
+//
+static inline double dot (const double* a, const double* b)
+{
+	return (a[0] * b[0]) + (a[1] * b[1]) + (a[2] * b[2]);
+}
+
+// =============================================================================
+//
+static inline void cross (const double* a, const double* b, double* out)
+{
+	out[0] = (a[1] * b[2]) - (a[2] * b[1]);
+	out[1] = (a[2] * b[0]) - (a[0] * b[2]);
+	out[2] = (a[0] * b[1]) - (a[1] * b[0]);
+}
+
+// =============================================================================
+//
+// Conditional lines are picked by their line, not by their control points.
+//
+static inline int pickVertexCount (const LDPolygon& poly)
+{
+	return (poly.num == 5) ? 2 : poly.num;
+}
+
+// =============================================================================
+//
+static void addToBox (LDItemBox& box, const double* a)
+{
+	for (int i = 0; i < 3; ++i)
+	{
+		box.min[i] = qMin (box.min[i], a[i]);
+		box.max[i] = qMax (box.max[i], a[i]);
+	}
+}
+
+// =============================================================================
+//
+static void resetBox (LDItemBox& box)
+{
+	for (int i = 0; i < 3; ++i)
+	{
+		box.min[i] = HUGE_VAL;
+		box.max[i] = -HUGE_VAL;
+	}
+}
+
+// =============================================================================
+//
+static void buildNode (const QVector<LDItemBox>& boxes, QVector<LDBVHNode>& nodes, QVector<int>& order,
+	int begin, int end)
+{
+	const int index = nodes.size();
+	nodes.append (LDBVHNode());
+	LDItemBox bounds, centers;
+	resetBox (bounds);
+	resetBox (centers);
+
+	for (int i = begin; i < end; ++i)
+	{
+		const LDItemBox& box = boxes[order[i]];
+		double center[3];
+
+		for (int j = 0; j < 3; ++j)
+			center[j] = (box.min[j] + box.max[j]) / 2;
+
+		addToBox (bounds, box.min);
+		addToBox (bounds, box.max);
+		addToBox (centers, center);
+	}
+
+	LDBVHNode node;
+	memcpy (node.min, bounds.min, sizeof node.min);
+	memcpy (node.max, bounds.max, sizeof node.max);
+
+	// Split along the axis the centers are the most spread on.
+	int axis = 0;
+
+	for (int i = 1; i < 3; ++i)
+	{
+		if (centers.max[i] - centers.min[i] > centers.max[axis] - centers.min[axis])
+			axis = i;
+	}
+
+	if (end - begin <= MaxLeafSize || centers.max[axis] <= centers.min[axis])
+	{
+		node.first = begin;
+		node.count = end - begin;
+		nodes[index] = node;
+		return;
+	}
+
+	const int middle = (begin + end) / 2;
+	std::nth_element (order.begin() + begin, order.begin() + middle, order.begin() + end,
+		[&](int a, int b)
+		{
+			return boxes[a].min[axis] + boxes[a].max[axis] < boxes[b].min[axis] + boxes[b].max[axis];
+		});
+
+	buildNode (boxes, nodes, order, begin, middle);
+	node.first = nodes.size();
+	node.count = 0;
+	buildNode (boxes, nodes, order, middle, end);
+	nodes[index] = node;
+}
+
+// =============================================================================
+//
+static void buildNodes (const QVector<LDItemBox>& boxes, QVector<LDBVHNode>& nodes, QVector<int>& order)
+{
+	nodes.clear();
+	order.resize (boxes.size());
+
+	for (int i = 0; i < order.size(); ++i)
+		order[i] = i;
+
+	if (not boxes.isEmpty())
+		buildNode (boxes, nodes, order, 0, boxes.size());
+}
+
+// =============================================================================
+//
+// Clips [t0, t1] of the ray of @space to @node, grown by the inflation of the
+// space. Returns false if nothing is left.
+//
+static bool clipRayToBox (const LDPickSpace& space, const LDBVHNode& node, double& t0, double& t1)
+{
+	for (int i = 0; i < 3; ++i)
+	{
+		const double min = node.min[i] - space.inflate;
+		const double max = node.max[i] + space.inflate;
+
+		if (space.direction[i] == 0.0)
+		{
+			if (space.origin[i] < min || space.origin[i] > max)
+				return false;
+
+			continue;
+		}
+
+		double ta = (min - space.origin[i]) / space.direction[i];
+		double tb = (max - space.origin[i]) / space.direction[i];
+
+		if (ta > tb)
+			std::swap (ta, tb);
+
+		t0 = qMax (t0, ta);
+		t1 = qMin (t1, tb);
+
+		if (t0 > t1)
+			return false;
+	}
+
+	return true;
+}
+
+// =============================================================================
+//
+static bool frustumHitsBox (const LDPickSpace& space, const LDBVHNode& node)
+{
+	for (const double* plane : space.planes)
+	{
+		double corner[3];
+
+		for (int i = 0; i < 3; ++i)
+			corner[i] = (plane[i] >= 0.0) ? node.max[i] : node.min[i];
+
+		if (dot (plane, corner) + plane[3] < 0.0)
+			return false;
+	}
+
+	return true;
+}
+
+// =============================================================================
+//
+static bool rayHitsTriangle (const LDPickSpace& space, const double* a, const double* b,
+	const double* c, double& t)
+{
+	double edge1[3], edge2[3], p[3], q[3], offset[3];
+
+	for (int i = 0; i < 3; ++i)
+	{
+		edge1[i] = b[i] - a[i];
+		edge2[i] = c[i] - a[i];
+		offset[i] = space.origin[i] - a[i];
+	}
+
+	cross (space.direction, edge2, p);
+	const double det = dot (edge1, p);
+
+	if (det == 0.0)
+		return false;
+
+	const double u = dot (offset, p) / det;
+
+	if (u < 0.0 || u > 1.0)
+		return false;
+
+	cross (offset, edge1, q);
+	const double v = dot (space.direction, q) / det;
+
+	if (v < 0.0 || u + v > 1.0)
+		return false;
+
+	t = dot (edge2, q) / det;
+	return t >= 0.0 && t <= 1.0;
+}
+
+// =============================================================================
+//
+// Lines are hit if they pass within the pick radius of the ray. This is done
+// in LDraw coordinates, since the radius does not transform with the subfile.
+//
+static bool rayHitsLine (const LDPickSpace& space, const Vertex& v0, const Vertex& v1, double& t)
+{
+	const LDPickRay& ray = *space.ray;
+	double a[3], b[3], rayOrigin[3], rayDirection[3], lineDirection[3], offset[3];
+	space.toWorld (v0, a);
+	space.toWorld (v1, b);
+
+	for (int i = 0; i < 3; ++i)
+	{
+		rayOrigin[i] = ray.origin[(Axis) i];
+		rayDirection[i] = ray.direction[(Axis) i];
+		lineDirection[i] = b[i] - a[i];
+		offset[i] = rayOrigin[i] - a[i];
+	}
+
+	// Find the closest points of the ray and the line.
+	const double rayLengthSq = dot (rayDirection, rayDirection);
+	const double lineLengthSq = dot (lineDirection, lineDirection);
+	const double f = dot (lineDirection, offset);
+	const double c = dot (rayDirection, offset);
+	double u;
+
+	if (lineLengthSq == 0.0)
+	{
+		u = 0.0;
+		t = qBound (0.0, -c / rayLengthSq, 1.0);
+	}
+	else
+	{
+		const double projection = dot (rayDirection, lineDirection);
+		const double denom = (rayLengthSq * lineLengthSq) - (projection * projection);
+		t = (denom != 0.0) ? qBound (0.0, ((projection * f) - (c * lineLengthSq)) / denom, 1.0) : 0.0;
+		u = ((projection * t) + f) / lineLengthSq;
+
+		if (u < 0.0)
+		{
+			u = 0.0;
+			t = qBound (0.0, -c / rayLengthSq, 1.0);
+		}
+		elif (u > 1.0)
+		{
+			u = 1.0;
+			t = qBound (0.0, (projection - c) / rayLengthSq, 1.0);
+		}
+	}
+
+	double distanceSq = 0.0;
+
+	for (int i = 0; i < 3; ++i)
+	{
+		const double delta = (rayOrigin[i] + (rayDirection[i] * t)) - (a[i] + (lineDirection[i] * u));
+		distanceSq += delta * delta;
+	}
+
+	return distanceSq <= ray.radius (t) * ray.radius (t);
+}
+
+// =============================================================================
+//
+static bool rayHitsPolygon (const LDPickSpace& space, const LDPolygon& poly, double& t)
+{
+	if (poly.num == 2 || poly.num == 5)
+		return rayHitsLine (space, poly.vertices[0], poly.vertices[1], t);
+
+	if (poly.num != 3 && poly.num != 4)
+		return false;
+
+	double vertices[4][3];
+
+	for (int i = 0; i < poly.num; ++i)
+	for (int j = 0; j < 3; ++j)
+		vertices[i][j] = poly.vertices[i][(Axis) j];
+
+	if (not rayHitsTriangle (space, vertices[0], vertices[1], vertices[2], t)
+		&& (poly.num != 4 || not rayHitsTriangle (space, vertices[0], vertices[2], vertices[3], t)))
+	{
+		return false;
+	}
+
+	// Faces are drawn with a polygon offset, so that lines on them are drawn
+	// over them. Push faces back by the pick radius for the same effect.
+	const LDPickRay& ray = *space.ray;
+	t += ray.radius (t) / ray.direction.length();
+	return true;
+}
+
+// =============================================================================
+//
+static bool frustumHitsPolygon (const LDPickSpace& space, const LDPolygon& poly)
+{
+	const int numVertices = pickVertexCount (poly);
+
+	if (numVertices == 2)
+	{
+		// Clip the line to the planes
+		double a[3], b[3];
+		double t0 = 0.0, t1 = 1.0;
+
+		for (int j = 0; j < 3; ++j)
+		{
+			a[j] = poly.vertices[0][(Axis) j];
+			b[j] = poly.vertices[1][(Axis) j];
+		}
+
+		for (const double* plane : space.planes)
+		{
+			const double da = dot (plane, a) + plane[3];
+			const double db = dot (plane, b) + plane[3];
+
+			if (da < 0.0 && db < 0.0)
+				return false;
+
+			if (da < 0.0)
+				t0 = qMax (t0, da / (da - db));
+			elif (db < 0.0)
+				t1 = qMin (t1, da / (da - db));
+
+			if (t0 > t1)
+				return false;
+		}
+
+		return true;
+	}
+
+	if (numVertices != 3 && numVertices != 4)
+		return false;
+
+	// Clip the polygon to the planes and see if anything is left of it.
+	double buffers[2][MaxClipVertices][3];
+	double (*input)[3] = buffers[0];
+	double (*output)[3] = buffers[1];
+	int count = numVertices;
+
+	for (int i = 0; i < count; ++i)
+	for (int j = 0; j < 3; ++j)
+		input[i][j] = poly.vertices[i][(Axis) j];
+
+	for (const double* plane : space.planes)
+	{
+		int outCount = 0;
+
+		for (int i = 0; i < count; ++i)
+		{
+			const double* current = input[i];
+			const double* next = input[(i + 1) % count];
+			const double dc = dot (plane, current) + plane[3];
+			const double dn = dot (plane, next) + plane[3];
+
+			if (dc >= 0.0)
+				memcpy (output[outCount++], current, sizeof output[0]);
+
+			if ((dc >= 0.0) != (dn >= 0.0))
+			{
+				const double s = dc / (dc - dn);
+
+				for (int j = 0; j < 3; ++j)
+					output[outCount][j] = current[j] + ((next[j] - current[j]) * s);
+
+				++outCount;
+			}
+		}
+
+		if (outCount == 0)
+			return false;
+
+		std::swap (input, output);
+		count = outCount;
+	}
+
+	return true;
+}
+
+// =============================================================================
+//
+void LDPolygonBVH::build (const QVector<LDPolygon>& polygons)
+{
+	QVector<LDItemBox> boxes;
+	boxes.reserve (polygons.size());
+	m_polygons = polygons;
+
+	for (const LDPolygon& poly : polygons)
+	{
+		LDItemBox box;
+		resetBox (box);
+
+		for (int i = 0; i < pickVertexCount (poly); ++i)
+		{
+			const double vertex[3] = { poly.vertices[i].x(), poly.vertices[i].y(), poly.vertices[i].z() };
+			addToBox (box, vertex);
+		}
+
+		boxes << box;
+	}
+
+	buildNodes (boxes, m_nodes, m_order);
+}
+
+// =============================================================================
+//
+void LDPolygonBVH::clear()
+{
+	m_polygons.clear();
+	m_nodes.clear();
+	m_order.clear();
+}
+
+// =============================================================================
+//
+bool LDPolygonBVH::bounds (Vertex& min, Vertex& max) const
+{
+	if (m_nodes.isEmpty())
+		return false;
+
+	const LDBVHNode& root = m_nodes[0];
+	min = Vertex (root.min[0], root.min[1], root.min[2]);
+	max = Vertex (root.max[0], root.max[1], root.max[2]);
+	return true;
+}
+
+// =============================================================================
+//
+// Finds the polygon nearest along the ray of @space that is nearer than
+// @nearest, and updates @nearest to it. Returns whether one was found.
+//
+bool LDPolygonBVH::raycast (const LDPickSpace& space, double& nearest) const
+{
+	if (m_nodes.isEmpty())
+		return false;
+
+	bool found = false;
+	int stack[MaxDepth];
+	int top = 0;
+	stack[top++] = 0;
+
+	while (top > 0)
+	{
+		const int index = stack[--top];
+		const LDBVHNode& node = m_nodes[index];
+		double t0 = 0.0, t1 = nearest;
+
+		if (not clipRayToBox (space, node, t0, t1))
+			continue;
+
+		if (node.count == 0)
+		{
+			stack[top++] = node.first;
+			stack[top++] = index + 1;
+			continue;
+		}
+
+		for (int i = node.first; i < node.first + node.count; ++i)
+		{
+			double t;
+
+			if (rayHitsPolygon (space, m_polygons[m_order[i]], t) && t < nearest)
+			{
+				nearest = t;
+				found = true;
+			}
+		}
+	}
+
+	return found;
+}
+
+// =============================================================================
+//
+// Is any polygon at least partially within the frustum of @space?
+//
+bool LDPolygonBVH::intersects (const LDPickSpace& space) const
+{
+	if (m_nodes.isEmpty())
+		return false;
+
+	int stack[MaxDepth];
+	int top = 0;
+	stack[top++] = 0;
+
+	while (top > 0)
+	{
+		const int index = stack[--top];
+		const LDBVHNode& node = m_nodes[index];
+
+		if (not frustumHitsBox (space, node))
+			continue;
+
+		if (node.count == 0)
+		{
+			stack[top++] = node.first;
+			stack[top++] = index + 1;
+			continue;
+		}
+
+		for (int i = node.first; i < node.first + node.count; ++i)
+		{
+			if (frustumHitsPolygon (space, m_polygons[m_order[i]]))
+				return true;
+		}
+	}
+
+	return false;
+}
+
+// =============================================================================
+//
+void LDObjectBVH::build (LDDocumentPtr document)
+{
+	QVector<LDItemBox> boxes;
+	clear();
+
+	for (int i = 0; i < document->getObjectCount(); ++i)
+	{
+		// The comments of a lazily loaded document are left unparsed, they
+		// have nothing to render.
+		if (document->isRawLine (i))
+			continue;
+
+		LDObjectPtr obj = document->getObject (i);
+		Entry entry;
+		LDItemBox box;
+		resetBox (box);
+		entry.object = obj;
+
+		if (obj->type() == OBJ_Subfile)
+		{
+			LDSubfilePtr ref = obj.staticCast<LDSubfile>();
+			Vertex min, max;
+
+			if (ref->fileInfo() == null || not ref->fileInfo()->polygonTree().bounds (min, max))
+				continue;
+
+			const Matrix& m = ref->transform();
+
+			for (int j = 0; j < 9; ++j)
+				entry.matrix[j] = m[j];
+
+			for (int j = 0; j < 3; ++j)
+				entry.position[j] = ref->position()[(Axis) j];
+
+			const double det = (m[0] * ((m[4] * m[8]) - (m[5] * m[7])))
+				- (m[1] * ((m[3] * m[8]) - (m[5] * m[6])))
+				+ (m[2] * ((m[3] * m[7]) - (m[4] * m[6])));
+
+			entry.inverseNorm = 0.0;
+
+			if (det != 0.0)
+			{
+				entry.inverse[0] = ((m[4] * m[8]) - (m[5] * m[7])) / det;
+				entry.inverse[1] = ((m[2] * m[7]) - (m[1] * m[8])) / det;
+				entry.inverse[2] = ((m[1] * m[5]) - (m[2] * m[4])) / det;
+				entry.inverse[3] = ((m[5] * m[6]) - (m[3] * m[8])) / det;
+				entry.inverse[4] = ((m[0] * m[8]) - (m[2] * m[6])) / det;
+				entry.inverse[5] = ((m[2] * m[3]) - (m[0] * m[5])) / det;
+				entry.inverse[6] = ((m[3] * m[7]) - (m[4] * m[6])) / det;
+				entry.inverse[7] = ((m[1] * m[6]) - (m[0] * m[7])) / det;
+				entry.inverse[8] = ((m[0] * m[4]) - (m[1] * m[3])) / det;
+
+				// The Frobenius norm bounds how much the inverse can stretch
+				// the pick radius.
+				for (double a : entry.inverse)
+					entry.inverseNorm += a * a;
+
+				entry.inverseNorm = sqrt (entry.inverseNorm);
+			}
+
+			// Bound the transformed corners of the document's bounds
+			for (int corner = 0; corner < 8; ++corner)
+			{
+				Vertex v ((corner & 1) ? max.x() : min.x(),
+					(corner & 2) ? max.y() : min.y(),
+					(corner & 4) ? max.z() : min.z());
+				v.transform (m, ref->position());
+				const double vertex[3] = { v.x(), v.y(), v.z() };
+				addToBox (box, vertex);
+			}
+		}
+		elif (obj->getPolygon (entry.polygon))
+		{
+			for (int j = 0; j < pickVertexCount (entry.polygon); ++j)
+			{
+				const Vertex& v = entry.polygon.vertices[j];
+				const double vertex[3] = { v.x(), v.y(), v.z() };
+				addToBox (box, vertex);
+			}
+		}
+		else
+			continue;
+
+		m_entries << entry;
+		boxes << box;
+	}
+
+	buildNodes (boxes, m_nodes, m_order);
+}
+
+// =============================================================================
+//
+void LDObjectBVH::clear()
+{
+	m_entries.clear();
+	m_nodes.clear();
+	m_order.clear();
+}
+
+// =============================================================================
+//
+// Tests @entry against the ray or the frustum of @world. For rays, @nearest is
+// updated if the entry is nearer than it and true is returned.
+//
+bool LDObjectBVH::testEntry (const Entry& entry, const LDPickSpace& world, double* nearest) const
+{
+	LDObjectPtr obj = entry.object.toStrongRef();
+
+	if (obj == null || obj->isHidden())
+		return false;
+
+	if (obj->type() != OBJ_Subfile)
+	{
+		double t;
+
+		if (nearest == null)
+			return frustumHitsPolygon (world, entry.polygon);
+
+		if (not rayHitsPolygon (world, entry.polygon, t) || t >= *nearest)
+			return false;
+
+		*nearest = t;
+		return true;
+	}
+
+	LDDocumentPtr doc = obj.staticCast<LDSubfile>()->fileInfo();
+
+	if (doc == null)
+		return false;
+
+	LDPickSpace local (world);
+	local.isLocal = true;
+	memcpy (local.matrix, entry.matrix, sizeof local.matrix);
+	memcpy (local.position, entry.position, sizeof local.position);
+
+	if (nearest == null)
+	{
+		// Planes go to the document's coordinates through the transpose.
+		for (int i = 0; i < LDPickFrustum::NumPlanes; ++i)
+		{
+			const double* plane = world.planes[i];
+
+			for (int j = 0; j < 3; ++j)
+			{
+				local.planes[i][j] = (entry.matrix[j] * plane[0]) + (entry.matrix[3 + j] * plane[1])
+					+ (entry.matrix[6 + j] * plane[2]);
+			}
+
+			local.planes[i][3] = dot (plane, entry.position) + plane[3];
+		}
+
+		return doc->polygonTree().intersects (local);
+	}
+
+	if (entry.inverseNorm == 0.0)
+	{
+		// The transformation flattens the document, so the ray cannot be moved
+		// into its coordinates. Test the polygons one by one instead.
+		bool found = false;
+
+		for (LDPolygon poly : doc->polygonData())
+		{
+			for (int i = 0; i < pickVertexCount (poly); ++i)
+			{
+				double vertex[3];
+				local.toWorld (poly.vertices[i], vertex);
+				poly.vertices[i] = Vertex (vertex[0], vertex[1], vertex[2]);
+			}
+
+			double t;
+
+			if (rayHitsPolygon (world, poly, t) && t < *nearest)
+			{
+				*nearest = t;
+				found = true;
+			}
+		}
+
+		return found;
+	}
+
+	double offset[3];
+
+	for (int i = 0; i < 3; ++i)
+		offset[i] = world.origin[i] - entry.position[i];
+
+	for (int i = 0; i < 3; ++i)
+	{
+		local.origin[i] = dot (&entry.inverse[i * 3], offset);
+		local.direction[i] = dot (&entry.inverse[i * 3], world.direction);
+	}
+
+	local.inflate = world.inflate * entry.inverseNorm;
+	return doc->polygonTree().raycast (local, *nearest);
+}
+
+// =============================================================================
+//
+int LDObjectBVH::pick (const LDPickRay& ray) const
+{
+	if (m_nodes.isEmpty())
+		return 0;
+
+	LDPickSpace world;
+	memset (&world, 0, sizeof world);
+	world.ray = &ray;
+	world.isLocal = false;
+
+	for (int i = 0; i < 3; ++i)
+	{
+		world.origin[i] = ray.origin[(Axis) i];
+		world.direction[i] = ray.direction[(Axis) i];
+	}
+
+	// Boxes are grown by the largest pick radius the ray has within the tree.
+	double t0 = 0.0, t1 = 1.0;
+	world.inflate = qMax (ray.nearRadius, ray.farRadius);
+
+	if (not clipRayToBox (world, m_nodes[0], t0, t1))
+		return 0;
+
+	world.inflate = qMax (ray.radius (t0), ray.radius (t1));
+	double nearest = HUGE_VAL;
+	const Entry* nearestEntry = null;
+	int stack[MaxDepth];
+	int top = 0;
+	stack[top++] = 0;
+
+	while (top > 0)
+	{
+		const int index = stack[--top];
+		const LDBVHNode& node = m_nodes[index];
+		t0 = 0.0;
+		t1 = qMin (nearest, 1.0);
+
+		if (not clipRayToBox (world, node, t0, t1))
+			continue;
+
+		if (node.count == 0)
+		{
+			stack[top++] = node.first;
+			stack[top++] = index + 1;
+			continue;
+		}
+
+		for (int i = node.first; i < node.first + node.count; ++i)
+		{
+			if (testEntry (m_entries[m_order[i]], world, &nearest))
+				nearestEntry = &m_entries[m_order[i]];
+		}
+	}
+
+	if (nearestEntry == null)
+		return 0;
+
+	return nearestEntry->object.toStrongRef()->id();
+}
+
+// =============================================================================
+//
+QList<int> LDObjectBVH::pick (const LDPickFrustum& frustum) const
+{
+	QList<int> ids;
+
+	if (m_nodes.isEmpty())
+		return ids;
+
+	LDPickSpace world;
+	memset (&world, 0, sizeof world);
+	world.isLocal = false;
+	memcpy (world.planes, frustum.planes, sizeof world.planes);
+	int stack[MaxDepth];
+	int top = 0;
+	stack[top++] = 0;
+
+	while (top > 0)
+	{
+		const int index = stack[--top];
+		const LDBVHNode& node = m_nodes[index];
+
+		if (not frustumHitsBox (world, node))
+			continue;
+
+		if (node.count == 0)
+		{
+			stack[top++] = node.first;
+			stack[top++] = index + 1;
+			continue;
+		}
+
+		for (int i = node.first; i < node.first + node.count; ++i)
+		{
+			const Entry& entry = m_entries[m_order[i]];
+
+			if (testEntry (entry, world, null))
+				ids << entry.object.toStrongRef()->id();
+		}
+	}
+
+	return ids;
+}
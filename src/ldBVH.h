@@ -0,0 +1,134 @@
+/*
+ *  LDForge: LDraw parts authoring CAD
+ *  Copyright (C) 2013, 2014 Santeri Piippo
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#include <QVector>
+#include "main.h"
+#include "basics.h"
+#include "glShared.h"
+
+//
+// Bounding volume hierarchies for picking objects on the CPU.
+//
+// Each document keeps an LDPolygonBVH over its flattened polygons in its own
+// coordinates. The document being edited also keeps an LDObjectBVH over its
+// objects. Objects with a polygon are tested directly. Subfile references
+// are tested by moving the ray or frustum into the coordinates of the
+// referenced document and querying the document's LDPolygonBVH.
+//
+
+//
+// A ray through a pixel from the near plane to the far plane, in LDraw
+// coordinates. Positions along the ray are given as t, 0 on the near plane
+// and 1 on the far plane. Lines are hit within the pick radius of the ray,
+// which grows linearly from the near plane to the far plane so that it stays
+// the same on screen.
+//
+struct LDPickRay
+{
+	Vertex	origin;
+	Vertex	direction; // origin + direction is on the far plane
+	double	nearRadius;
+	double	farRadius;
+
+	inline double radius (double t) const
+	{
+		return nearRadius + ((farRadius - nearRadius) * t);
+	}
+};
+
+//
+// A convex volume, i.e. the frustum of a rubber band selection. A point is
+// inside if a*x + b*y + c*z + d >= 0 holds for each plane (a, b, c, d).
+//
+struct LDPickFrustum
+{
+	enum { NumPlanes = 6 };
+	double planes[NumPlanes][4];
+};
+
+// A node of a flattened tree. Leaves have a non-zero count of items, which
+// begin at first in the item order. The children of an inner node are the
+// next node and the node at first.
+struct LDBVHNode
+{
+	double	min[3];
+	double	max[3];
+	int		first;
+	int		count;
+};
+
+struct LDPickSpace;
+
+//
+// BVH over a list of polygons. The polygon list is shared, not copied.
+//
+class LDPolygonBVH
+{
+public:
+	void build (const QVector<LDPolygon>& polygons);
+	void clear();
+	bool bounds (Vertex& min, Vertex& max) const;
+	bool raycast (const LDPickSpace& space, double& nearest) const;
+	bool intersects (const LDPickSpace& space) const;
+
+	// Was the tree built from this very polygon data?
+	inline bool isBuiltFrom (const QVector<LDPolygon>& polygons) const
+	{
+		return not m_nodes.isEmpty() && polygons.constData() == m_polygons.constData();
+	}
+
+private:
+	QVector<LDPolygon>	m_polygons;
+	QVector<LDBVHNode>	m_nodes;
+	QVector<int>		m_order;
+};
+
+//
+// BVH over the objects of a document.
+//
+class LDObjectBVH
+{
+public:
+	void build (LDDocumentPtr document);
+	void clear();
+
+	// Returns the ID of the object nearest along @ray, 0 if there is none.
+	int pick (const LDPickRay& ray) const;
+
+	// Returns the IDs of the objects that are at least partially within
+	// @frustum.
+	QList<int> pick (const LDPickFrustum& frustum) const;
+
+private:
+	struct Entry
+	{
+		LDObjectWeakPtr	object;
+		LDPolygon		polygon; // if the object is not a subfile reference
+		double			matrix[9]; // the transformation of a subfile reference
+		double			position[3];
+		double			inverse[9];
+		double			inverseNorm; // 0 if the matrix cannot be inverted
+	};
+
+	QVector<Entry>		m_entries;
+	QVector<LDBVHNode>	m_nodes;
+	QVector<int>		m_order;
+
+	bool testEntry (const Entry& entry, const LDPickSpace& world, double* nearest) const;
+};
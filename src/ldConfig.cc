@@ -43,7 +43,7 @@ static bool parseLDConfigTag (LDConfigParser& pars, char const* tag, QString& va
 //
 void LDConfigParser::parseLDConfig()
 {
-	QFile* fp = openLDrawFile ("LDConfig.ldr", false);
+	QIODevice* fp = openLDrawFile ("LDConfig.ldr", false);
 
 	if (fp == null)
 	{
@@ -16,11 +16,17 @@
  *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <climits>
 #include <QMessageBox>
 #include <QFileDialog>
+#include <QBuffer>
 #include <QDir>
+#include <QFileInfo>
+#include <QSet>
 #include <QTime>
 #include <QApplication>
+#include <QtConcurrentRun>
+#include <QtConcurrentMap>
 
 #include "main.h"
 #include "configuration.h"
@@ -31,14 +37,24 @@
 #include "dialogs.h"
 #include "glRenderer.h"
 #include "glCompiler.h"
+#include "ldTokenizer.h"
+#include "ldLibraryArchive.h"
+#include "ldLibraryIndex.h"
+#include "ldGeometryCache.h"
+#include "ldDocumentWriter.h"
+#include "ldVertexStore.h"
 
 CFGENTRY (String,			ldrawPath, "")
 CFGENTRY (List,				recentFiles, {})
+CFGENTRY (Bool,				parallelLoading, true)
+CFGENTRY (Bool,				useGeometryCache, true)
+CFGENTRY (Int,				lazyLoadingThreshold, 100000)
 EXTERN_CFGENTRY (String,	downloadFilePath)
 EXTERN_CFGENTRY (Bool,		useLogoStuds)
 
 static bool g_loadingMainFile = false;
 static const int g_maxRecentFiles = 10;
+static const int g_parseChunkSize = 4096;
 static bool g_aborted = false;
 static LDDocumentPtr g_logoedStud;
 static LDDocumentPtr g_logoedStud2;
@@ -46,6 +62,15 @@ static QList<LDDocumentWeakPtr> g_allDocuments;
 static QList<LDDocumentPtr> g_explicitDocuments;
 static LDDocumentPtr g_currentDocument;
 
+// Documents whose geometry came from the geometry cache have no subfile objects
+// to track their dependencies with. Instead, they are listed here under the
+// paths of the files their geometry was built from.
+static QHash<QString, QSet<LDDocument*>> g_cachedDependents;
+
+// The embedded files that references resolve to while a document is being
+// loaded. If null, the embedded files of the current document are used.
+static const QList<LDDocumentPtr>* g_embeddedScope = null;
+
 const QStringList g_specialSubdirectories ({ "s", "48", "8" });
 
 // =============================================================================
@@ -75,6 +100,22 @@ namespace LDPaths
 
 	bool tryConfigure (QString path)
 	{
+		// The library can also be a zip archive, e.g. complete.zip
+		if (QFileInfo (path).isFile())
+		{
+			if (not LDLibraryArchive::open (path))
+			{
+				pathError = "Not an LDraw library archive! Must<br />have LDConfig.ldr, parts/ and p/.";
+				return false;
+			}
+
+			pathInfo.LDConfigPath = LDLibraryArchive::instance()->find ("LDConfig.ldr");
+			QString root = dirname (pathInfo.LDConfigPath);
+			pathInfo.partsPath = format ("%1" DIRSLASH "parts", root);
+			pathInfo.primsPath = format ("%1" DIRSLASH "p", root);
+			return true;
+		}
+
 		QDir dir;
 
 		if (not dir.cd (path))
@@ -95,6 +136,7 @@ namespace LDPaths
 		pathInfo.partsPath = format ("%1" DIRSLASH "parts", path);
 		pathInfo.LDConfigPath = format ("%1" DIRSLASH "LDConfig.ldr", path);
 		pathInfo.primsPath = format ("%1" DIRSLASH "p", path);
+		LDLibraryArchive::close();
 
 		return true;
 	}
@@ -126,7 +168,8 @@ namespace LDPaths
 LDDocument::LDDocument (LDDocumentPtr* selfptr) :
 	m_isImplicit (true),
 	m_flags (0),
-	m_gldata (new LDGLData)
+	m_gldata (new LDGLData),
+	m_vertexStore (new LDVertexStore)
 {
 	*selfptr = LDDocumentPtr (this);
 	setSelf (*selfptr);
@@ -135,6 +178,15 @@ LDDocument::LDDocument (LDDocumentPtr* selfptr) :
 	setHistory (new History);
 	history()->setDocument (*selfptr);
 	m_needsReCache = true;
+	m_isFlattening = false;
+	m_pickTreeChanged = true;
+	m_knownVerticesChanged = false;
+	m_hasDeferredObjects = false;
+	m_needsCacheStore = true;
+	m_firstUnnumbered = 0;
+	m_lazyFile = null;
+	m_lazyBuffer = null;
+	m_numRawLines = 0;
 	g_allDocuments << *selfptr;
 }
 
@@ -154,13 +206,36 @@ LDDocument::~LDDocument()
 	print ("Deleted %1", getDisplayName());
 	g_allDocuments.removeOne (self());
 	m_flags |= DOCF_IsBeingDestroyed;
+
+	// The objects may outlive the document but they no longer count as
+	// references to their subfiles.
+	for (LDObjectPtr obj : m_objects)
+	{
+		if (obj != null && obj->type() == OBJ_Subfile && obj.staticCast<LDSubfile>()->fileInfo() != null)
+			obj.staticCast<LDSubfile>()->fileInfo()->removeReference (obj.staticCast<LDSubfile>().data());
+	}
+	releaseLazyContents();
+	forgetGeometryDependencies();
 	delete m_history;
 	delete m_gldata;
+
+	// Objects may outlive the document, the store goes away with the last one.
+	m_vertexStore->orphan();
+}
+
+// =============================================================================
+//
+void LDDocument::setEmbeddedDocuments (QList<LDDocumentPtr> const& a)
+{
+	m_embeddedDocuments = a;
+
+	// Embedded files are hidden from everything but this document
+	for (LDDocumentPtr doc : m_embeddedDocuments)
+		doc->m_flags |= DOCF_IsEmbedded;
 }
 
 // =============================================================================
 //
-extern QMap<long, LDObjectWeakPtr>	g_allObjects;
 void LDDocument::setImplicit (bool const& a)
 {
 	if (m_isImplicit != a)
@@ -169,6 +244,7 @@ void LDDocument::setImplicit (bool const& a)
 
 		if (a == false)
 		{
+			loadDeferredObjects();
 			g_explicitDocuments << self().toStrongRef();
 			print ("Opened %1", name());
 
@@ -181,13 +257,6 @@ void LDDocument::setImplicit (bool const& a)
 		{
 			g_explicitDocuments.removeOne (self().toStrongRef());
 			print ("Closed %1", name());
-			int count = 0;
-			for (LDObjectPtr obj : g_allObjects)
-			{
-				LDSubfilePtr ref = obj.dynamicCast<LDSubfile>();
-				if (ref && ref->fileInfo() == self())
-					count++;
-			}
 		}
 
 		if (g_win != null)
@@ -218,13 +287,61 @@ LDDocumentPtr findDocument (QString name)
 {
 	for (LDDocumentPtr file : g_allDocuments)
 	{
-		if (file->name() == name)
+		if (file->name() == name && not (file->flags() & DOCF_IsEmbedded))
 			return file;
 	}
 
 	return LDDocumentPtr();
 }
 
+// =============================================================================
+//
+// Finds an embedded file of the multi-part document in scope, ignoring case.
+//
+static LDDocumentPtr findEmbeddedDocument (QString name)
+{
+	const QList<LDDocumentPtr>* scope = g_embeddedScope;
+
+	if (scope == null)
+	{
+		if (LDDocument::current() == null)
+			return LDDocumentPtr();
+
+		scope = &LDDocument::current()->embeddedDocuments();
+	}
+
+	for (LDDocumentPtr doc : *scope)
+	{
+		if (doc->name().compare (name, Qt::CaseInsensitive) == 0)
+			return doc;
+	}
+
+	return LDDocumentPtr();
+}
+
+// =============================================================================
+//
+// Sets the embedded files that references resolve to for as long as the scope
+// object lives.
+//
+class LDEmbeddedScope
+{
+public:
+	LDEmbeddedScope (const QList<LDDocumentPtr>* scope) :
+		m_previous (g_embeddedScope)
+	{
+		g_embeddedScope = scope;
+	}
+
+	~LDEmbeddedScope()
+	{
+		g_embeddedScope = m_previous;
+	}
+
+private:
+	const QList<LDDocumentPtr>* m_previous;
+};
+
 // =============================================================================
 //
 QString dirname (QString path)
@@ -256,8 +373,57 @@ QString basename (QString path)
 
 // =============================================================================
 //
-static QString findLDrawFilePath (QString relpath, bool subdirs)
+// LDSearchContext
+//
+// What finding an LDraw file depends on besides the library itself: the
+// directories of the open documents, which are searched first, and the
+// configured paths. The context is taken in the main thread, after that it is
+// plain data so files can be looked up in worker threads.
+//
+struct LDSearchContext
+{
+	QStringList		documentDirectories;
+	QString			ldrawPath;
+	QString			downloadPath;
+
+	static LDSearchContext current();
+};
+
+// =============================================================================
+//
+LDSearchContext LDSearchContext::current()
+{
+	LDLibraryArchive* archive = LDLibraryArchive::instance();
+	LDSearchContext context;
+	context.ldrawPath = cfg::ldrawPath;
+	context.downloadPath = cfg::downloadFilePath;
+
+	for (LDDocumentPtr doc : g_allDocuments)
+	{
+		if (doc->fullPath().isEmpty() || (archive != null && archive->contains (doc->fullPath())))
+			continue;
+
+		// Many documents share a directory, there's no need to look twice.
+		QString docdir = dirname (doc->fullPath());
+
+		if (not context.documentDirectories.contains (docdir))
+			context.documentDirectories << docdir;
+	}
+
+	return context;
+}
+
+// =============================================================================
+//
+// Finds the LDraw file @relpath. The look-ups go through the library index so
+// that no file system queries are needed once the directories are indexed. If
+// the library is a zip archive, the library look-ups go to the archive instead.
+// This is safe to call in worker threads.
+//
+static QString findLDrawFilePath (const LDSearchContext& context, QString relpath, bool subdirs)
 {
+	LDLibraryIndex* index = LDLibraryIndex::instance();
+	LDLibraryArchive* archive = LDLibraryArchive::instance();
 	QString fullPath;
 
 	// LDraw models use Windows-style path separators. If we're not on Windows,
@@ -271,15 +437,11 @@ static QString findLDrawFilePath (QString relpath, bool subdirs)
 	// in the immediate vicinity of a current model to override stock LDraw stuff.
 	QString reltop = basename (dirname (relpath));
 
-	for (LDDocumentPtr doc : g_allDocuments)
+	for (const QString& docdir : context.documentDirectories)
 	{
-		if (doc->fullPath().isEmpty())
-			continue;
-
-		QString partpath = format ("%1/%2", dirname (doc->fullPath()), relpath);
-		QFile f (partpath);
+		QString partpath = index->find (docdir, relpath);
 
-		if (f.exists())
+		if (not partpath.isEmpty())
 		{
 			// ensure we don't mix subfiles and 48-primitives with non-subfiles and non-48
 			QString proptop = basename (dirname (partpath));
@@ -300,26 +462,45 @@ static QString findLDrawFilePath (QString relpath, bool subdirs)
 		}
 	}
 
-	if (QFile::exists (relpath))
-		return relpath;
+	if (QDir::isAbsolutePath (relpath))
+	{
+		if (QFile::exists (relpath))
+			return relpath;
+	}
+	else
+	{
+		fullPath = index->find (QDir::currentPath(), relpath);
+
+		if (not fullPath.isEmpty())
+			return fullPath;
+	}
 
 	// Try with just the LDraw path first
-	fullPath = format ("%1" DIRSLASH "%2", cfg::ldrawPath, relpath);
+	if (archive != null)
+		fullPath = archive->find (relpath);
+	else
+		fullPath = index->find (context.ldrawPath, relpath);
 
-	if (QFile::exists (fullPath))
+	if (not fullPath.isEmpty())
 		return fullPath;
 
 	if (subdirs)
 	{
 		// Look in sub-directories: parts and p. Also look in net_downloadpath, since that's
 		// where we download parts from the PT to.
-		for (const QString& topdir : QList<QString> ({ cfg::ldrawPath, cfg::downloadFilePath }))
+		for (const QString& topdir : QList<QString> ({ context.ldrawPath, context.downloadPath }))
 		{
+			if (topdir.isEmpty())
+				continue;
+
 			for (const QString& subdir : QList<QString> ({ "parts", "p" }))
 			{
-				fullPath = format ("%1" DIRSLASH "%2" DIRSLASH "%3", topdir, subdir, relpath);
+				if (archive != null && topdir == context.ldrawPath)
+					fullPath = archive->find (format ("%1/%2", subdir, relpath));
+				else
+					fullPath = index->find (format ("%1" DIRSLASH "%2", topdir, subdir), relpath);
 
-				if (QFile::exists (fullPath))
+				if (not fullPath.isEmpty())
 					return fullPath;
 			}
 		}
@@ -331,10 +512,9 @@ static QString findLDrawFilePath (QString relpath, bool subdirs)
 
 // =============================================================================
 //
-QFile* openLDrawFile (QString relpath, bool subdirs, QString* pathpointer)
+QIODevice* openLDrawFile (QString relpath, bool subdirs, QString* pathpointer)
 {
-	print ("Opening %1...\n", relpath);
-	QString path = findLDrawFilePath (relpath, subdirs);
+	QString path = findLDrawFilePath (LDSearchContext::current(), relpath, subdirs);
 
 	if (pathpointer != null)
 		*pathpointer = path;
@@ -342,708 +522,1684 @@ QFile* openLDrawFile (QString relpath, bool subdirs, QString* pathpointer)
 	if (path.isEmpty())
 		return null;
 
-	QFile* fp = new QFile (path);
-
-	if (fp->open (QIODevice::ReadOnly))
-		return fp;
-
-	fp->deleteLater();
-	return null;
+	return LDLibraryArchive::openFile (path);
 }
 
 // =============================================================================
 //
-void LDFileLoader::start()
+// LDParsedLine
+//
+// The outcome of parsing a single line of LDraw code. Parsing a line into an
+// LDParsedLine only reads the line and touches no global state, so it can be
+// done in worker threads. createObject() then turns it into the actual
+// LDObject, which has to be done in the main thread.
+//
+struct LDParsedLine
 {
-	setDone (false);
-	setProgress (0);
-	setAborted (false);
-
-	if (isOnForeground())
-	{
-		g_aborted = false;
-
-		// Show a progress dialog if we're loading the main ldDocument.here so we can
-		// show progress updates and keep the WM posted that we're still here.
-		// Of course we cannot exec() the dialog because then the dialog would
-		// block.
-		dlg = new OpenProgressDialog (g_win);
-		dlg->setNumLines (lines().size());
-		dlg->setModal (true);
-		dlg->show();
-
-		// Connect the loader in so we can show updates
-		connect (this, SIGNAL (workDone()), dlg, SLOT (accept()));
-		connect (dlg, SIGNAL (rejected()), this, SLOT (abort()));
-	}
-	else
-		dlg = null;
-
-	// Begin working
-	work (0);
-}
+	LDObjectType		type;
+	LDBFC::Statement	statement;
+	int32				color;
+	int32				integers[5];		// overlay camera and geometry
+	double				coordinates[12];	// vertices, or position and matrix of a subfile
+	QString				text;				// comment text, file name or error reason
+};
 
 // =============================================================================
 //
-void LDFileLoader::work (int i)
+// LDLineParser
+//
+// Parses a single line of LDraw code into an LDParsedLine. The line is tokenized
+// in place with LDLineTokenizer and dispatched by its line code through a table
+// of line types. Errors are not thrown: the failing check marks the result as
+// an error and stores the reason.
+//
+template<typename Char>
+class LDLineParser
 {
-	// User wishes to abort, so stop here now.
-	if (isAborted())
-	{
-		for (LDObjectPtr obj : m_objects)
-			obj->destroy();
+public:
+	LDLineParser (const Char* data, int length, LDParsedLine& result) :
+		m_end (data + length),
+		m_tokens (data, length),
+		m_result (result) {}
 
-		m_objects.clear();
-		setDone (true);
-		return;
-	}
+	void parse();
 
-	// Parse up to 300 lines per iteration
-	int max = i + 300;
+private:
+	using ParseFunction = void (LDLineParser::*)();
 
-	for (; i < max && i < (int) lines().size(); ++i)
+	// Describes a line type or a meta command: how many tokens it must have,
+	// which of them must be numbers and what parses it. A token count of 0
+	// means that the count is not checked.
+	struct Syntax
 	{
-		QString line = lines()[i];
-
-		// Trim the trailing newline
-		QChar c;
-
-		while (line.endsWith ("\n") || line.endsWith ("\r"))
-			line.chop (1);
-
-		LDObjectPtr obj = parseLine (line);
-
-		// Check for parse errors and warn about tthem
-		if (obj->type() == OBJ_Error)
-		{
-			print ("Couldn't parse line #%1: %2", progress() + 1, obj.staticCast<LDError>()->reason());
-
-			if (warnings() != null)
-				(*warnings())++;
-		}
-
-		m_objects << obj;
-		setProgress (i);
-
-		// If we have a dialog pointer, update the progress now
-		if (isOnForeground())
-			dlg->updateProgress (i);
+		const char*		name;
+		int				numTokens;
+		int				firstNumber;
+		int				lastNumber;
+		ParseFunction	parse;
+	};
+
+	const Char*				m_end;
+	LDLineTokenizer<Char>	m_tokens;
+	LDParsedLine&			m_result;
+
+	bool			checkSyntax (const Syntax& syntax);
+	bool			checkTokenCount (int num);
+	bool			checkTokenNumbers (int min, int max);
+	void			fail (const QString& reason);
+	void			parseComment();
+	void			parseOverlay();
+	void			parsePolygon();
+	void			parseSubfile();
+	void			parseVertex();
+	void			tokensToCoordinates (int first, int count);
+	double			tokenToDouble (int i) const;
+	int32			tokenToNumber (int i) const;
+
+	inline const LDToken<Char>& token (int i) const
+	{
+		return m_tokens[i];
 	}
+};
 
-	// If we're done now, tell the environment we're done and stop.
-	if (i >= ((int) lines().size()) - 1)
+// =============================================================================
+//
+template<typename Char>
+void LDLineParser<Char>::parse()
+{
+	// Line codes 0 - 5, indexed by the line code
+	static const Syntax lineTypes[] =
 	{
-		emit workDone();
-		setDone (true);
+		{ "comment",	0,	0,	-1,	&LDLineParser::parseComment },
+		{ "subfile",	15,	1,	13,	&LDLineParser::parseSubfile },
+		{ "line",		8,	1,	7,	&LDLineParser::parsePolygon },
+		{ "triangle",	11,	1,	10,	&LDLineParser::parsePolygon },
+		{ "quad",		14,	1,	13,	&LDLineParser::parsePolygon },
+		{ "condline",	14,	1,	13,	&LDLineParser::parsePolygon },
+	};
+
+	if (m_tokens.count() == 0)
+	{
+		// Line was empty, or only consisted of whitespace
+		m_result.type = OBJ_Empty;
 		return;
 	}
 
-	// Otherwise, continue, by recursing back.
-	if (not isDone())
-	{
-		// If we have a dialog to show progress output to, we cannot just call
-		// work() again immediately as the dialog needs some processor cycles as
-		// well. Thus, take a detour through the event loop by using the
-		// meta-object system.
-		//
-		// This terminates the loop here and control goes back to the function
-		// which called the file loader. It will keep processing the event loop
-		// until we're ready (see loadFileContents), thus the event loop will
-		// eventually catch the invokation we throw here and send us back. Though
-		// it's not technically recursion anymore, more like a for loop. :P
-		if (isOnForeground())
-			QMetaObject::invokeMethod (this, "work", Qt::QueuedConnection, Q_ARG (int, i));
-		else
-			work (i);
-	}
+	char code = tokenChar (*token (0).begin);
+
+	if (token (0).length() != 1 || code < '0' || code > '9')
+		fail ("Illogical line code");
+	elif (code - '0' >= countof (lineTypes))
+		fail ("Unknown line code number");
+	elif (checkSyntax (lineTypes[code - '0']))
+		(this->*lineTypes[code - '0'].parse)();
 }
 
 // =============================================================================
 //
-void LDFileLoader::abort()
+template<typename Char>
+void LDLineParser<Char>::fail (const QString& reason)
 {
-	setAborted (true);
-
-	if (isOnForeground())
-		g_aborted = true;
+	m_result.type = OBJ_Error;
+	m_result.text = reason;
 }
 
 // =============================================================================
 //
-LDObjectList loadFileContents (QFile* fp, int* numWarnings, bool* ok)
+template<typename Char>
+bool LDLineParser<Char>::checkSyntax (const Syntax& syntax)
 {
-	QStringList lines;
-	LDObjectList objs;
-
-	if (numWarnings)
-		*numWarnings = 0;
-
-	// Read in the lines
-	while (not fp->atEnd())
-		lines << QString::fromUtf8 (fp->readLine());
-
-	LDFileLoader* loader = new LDFileLoader;
-	loader->setWarnings (numWarnings);
-	loader->setLines (lines);
-	loader->setOnForeground (g_loadingMainFile);
-	loader->start();
-
-	// After start() returns, if the loader isn't done yet, it's delaying
-	// its next iteration through the event loop. We need to catch this here
-	// by telling the event loop to tick, which will tick the file loader again.
-	// We keep doing this until the file loader is ready.
-	while (not loader->isDone())
-		qApp->processEvents();
+	return (syntax.numTokens == 0 || checkTokenCount (syntax.numTokens))
+		&& checkTokenNumbers (syntax.firstNumber, syntax.lastNumber);
+}
 
-	// If we wanted the success value, supply that now
-	if (ok)
-		*ok = not loader->isAborted();
+// =============================================================================
+//
+template<typename Char>
+bool LDLineParser<Char>::checkTokenCount (int num)
+{
+	if (m_tokens.count() == num)
+		return true;
 
-	objs = loader->objects();
-	delete loader;
-	return objs;
+	fail (format ("Bad amount of tokens, expected %1, got %2", num, m_tokens.count()));
+	return false;
 }
 
 // =============================================================================
 //
-LDDocumentPtr openDocument (QString path, bool search, bool implicit, LDDocumentPtr fileToOverride)
+template<typename Char>
+bool LDLineParser<Char>::checkTokenNumbers (int min, int max)
 {
-	// Convert the file name to lowercase since some parts contain uppercase
-	// file names. I'll assume here that the library will always use lowercase
-	// file names for the actual parts..
-	QFile* fp;
-	QString fullpath;
-
-	if (search)
-		fp = openLDrawFile (path.toLower(), true, &fullpath);
-	else
+	for (int i = min; i <= max; ++i)
 	{
-		fp = new QFile (path);
-		fullpath = path;
+		// Hexadecimal numbers need to be valid. Anything else goes through as
+		// the number parser yields zero for garbage.
+		int64 value;
 
-		if (not fp->open (QIODevice::ReadOnly))
+		if (token (i).startsWith ("0x")
+			&& (not parseTokenInteger (token (i).begin + 2, token (i).end, 16, value)
+				|| value < INT32_MIN || value > INT32_MAX))
 		{
-			delete fp;
-			return LDDocumentPtr();
+			fail (format ("Token #%1 was `%2`, expected a number", (i + 1), token (i).toString()));
+			return false;
 		}
 	}
 
-	if (not fp)
-		return LDDocumentPtr();
-
-	LDDocumentPtr load = (fileToOverride != null ? fileToOverride : LDDocument::createNew());
-	load->setImplicit (implicit);
-	load->setFullPath (fullpath);
-	load->setName (LDDocument::shortenName (load->fullPath()));
+	return true;
+}
 
-	// Loading the file shouldn't count as actual edits to the document.
-	load->history()->setIgnoring (true);
+// =============================================================================
+//
+template<typename Char>
+double LDLineParser<Char>::tokenToDouble (int i) const
+{
+	double value;
 
-	int numWarnings;
-	bool ok;
-	LDObjectList objs = loadFileContents (fp, &numWarnings, &ok);
-	fp->close();
-	fp->deleteLater();
+	if (not parseTokenDouble (token (i).begin, token (i).end, value))
+		return 0.0;
 
-	if (not ok)
-	{
-		load->dismiss();
-		return LDDocumentPtr();
-	}
+	return value;
+}
 
-	load->addObjects (objs);
+// =============================================================================
+//
+template<typename Char>
+int32 LDLineParser<Char>::tokenToNumber (int i) const
+{
+	int64 value;
+	const LDToken<Char>& tok = token (i);
+	bool ok = tok.startsWith ("0x")
+		? parseTokenInteger (tok.begin + 2, tok.end, 16, value)
+		: parseTokenInteger (tok.begin, tok.end, 10, value);
 
-	if (g_loadingMainFile)
-	{
-		LDDocument::setCurrent (load);
-		g_win->R()->setDocument (load);
-		print (QObject::tr ("File %1 parsed successfully (%2 errors)."), path, numWarnings);
-	}
+	return ok ? value : 0;
+}
 
-	load->history()->setIgnoring (false);
-	return load;
+// =============================================================================
+//
+template<typename Char>
+void LDLineParser<Char>::tokensToCoordinates (int first, int count)
+{
+	for (int i = 0; i < count; ++i)
+		m_result.coordinates[i] = tokenToDouble (first + i);
 }
 
 // =============================================================================
 //
-bool LDDocument::isSafeToClose()
+template<typename Char>
+void LDLineParser<Char>::parseComment()
 {
-	typedef QMessageBox msgbox;
-	setlocale (LC_ALL, "C");
+	// Comment text starts after the line code and the character following it
+	const Char* textBegin = token (0).begin + 2;
+	const Char* textEnd = m_end;
 
-	// If we have unsaved changes, warn and give the option of saving.
-	if (hasUnsavedChanges())
+	// Handle BFC statements
+	if (m_tokens.count() > 2 && token (1) == "BFC")
 	{
-		QString message = format (tr ("There are unsaved changes to %1. Should it be saved?"), getDisplayName());
+		// MLCAD is notorious for stuffing these statements in parts it
+		// creates. The valid statements are matched first, MLCAD-style
+		// invertnext, clip and noclip are corrected afterwards.
+		static const struct
+		{
+			const char*			text;
+			LDBFC::Statement	statement;
+		} mlcadStatements[] =
+		{
+			{ "CERTIFY INVERTNEXT",	LDBFC::InvertNext },
+			{ "CERTIFY CLIP",		LDBFC::Clip },
+			{ "CERTIFY NOCLIP",		LDBFC::NoClip },
+		};
 
-		int button = msgbox::question (g_win, tr ("Unsaved Changes"), message,
-			(msgbox::Yes | msgbox::No | msgbox::Cancel), msgbox::Cancel);
+		// The statement is whatever follows the BFC token
+		const Char* statementBegin = token (1).end;
+		m_result.type = OBJ_BFC;
 
-		switch (button)
+		for (int i = 0; i < LDBFC::NumStatements; ++i)
 		{
-			case msgbox::Yes:
-			{
-				// If we don't have a file path yet, we have to ask the user for one.
-				if (name().length() == 0)
-				{
-					QString newpath = QFileDialog::getSaveFileName (g_win, tr ("Save As"),
-						getCurrentDocument()->name(), tr ("LDraw files (*.dat *.ldr)"));
+			m_result.statement = (LDBFC::Statement) i;
 
-					if (newpath.length() == 0)
-						return false;
+			if (simplifiedEquals (statementBegin, textEnd, LDBFC::k_statementStrings[i]))
+				return;
+		}
 
-					setName (newpath);
-				}
+		for (int i = 0; i < countof (mlcadStatements); ++i)
+		{
+			m_result.statement = mlcadStatements[i].statement;
 
-				if (not save())
-				{
-					message = format (tr ("Failed to save %1 (%2)\nDo you still want to close?"),
-						name(), strerror (errno));
+			if (simplifiedEquals (statementBegin, textEnd, mlcadStatements[i].text))
+				return;
+		}
+	}
 
-					if (msgbox::critical (g_win, tr ("Save Failure"), message,
-						(msgbox::Yes | msgbox::No), msgbox::No) == msgbox::No)
-					{
-						return false;
-					}
-				}
-				break;
-			}
+	// Handle LDForge-specific types, they're embedded into comments too
+	if (m_tokens.count() > 2 && token (1) == "!LDFORGE")
+	{
+		static const Syntax metaCommands[] =
+		{
+			{ "VERTEX",		7,	3,	6,	&LDLineParser::parseVertex },
+			{ "OVERLAY",	9,	5,	8,	&LDLineParser::parseOverlay },
+		};
 
-			case msgbox::Cancel:
-				return false;
+		for (int i = 0; i < countof (metaCommands); ++i)
+		{
+			if (token (2) == metaCommands[i].name)
+			{
+				if (checkSyntax (metaCommands[i]))
+					(this->*metaCommands[i].parse)();
 
-			default:
-				break;
+				return;
+			}
 		}
 	}
 
-	return true;
+	// Just a regular comment:
+	m_result.type = OBJ_Comment;
+	m_result.text = (textBegin < textEnd) ? tokenString (textBegin, textEnd - textBegin) : QString();
 }
 
 // =============================================================================
 //
-void closeAll()
+template<typename Char>
+void LDLineParser<Char>::parseVertex()
 {
-	for (LDDocumentPtr file : g_explicitDocuments)
-		file->dismiss();
+	// Vertex (0 !LDFORGE VERTEX)
+	m_result.type = OBJ_Vertex;
+	m_result.color = tokenToNumber (3);
+	tokensToCoordinates (4, 3);
 }
 
 // =============================================================================
 //
-void newFile()
+template<typename Char>
+void LDLineParser<Char>::parseOverlay()
 {
-	// Create a new anonymous file and set it to our current
-	LDDocumentPtr f = LDDocument::createNew();
-	f->setName ("");
-	f->setImplicit (false);
-	LDDocument::setCurrent (f);
-	LDDocument::closeInitialFile();
-	g_win->R()->setDocument (f);
-	g_win->doFullRefresh();
-	g_win->updateTitle();
-	g_win->updateActions();
+	m_result.type = OBJ_Overlay;
+	m_result.text = token (3).toString();
+
+	for (int i = 0; i < countof (m_result.integers); ++i)
+	{
+		int64 value;
+
+		if (not parseTokenInteger (token (4 + i).begin, token (4 + i).end, 10, value))
+			value = 0;
+
+		m_result.integers[i] = value;
+	}
 }
 
 // =============================================================================
 //
-void addRecentFile (QString path)
+template<typename Char>
+void LDLineParser<Char>::parseSubfile()
 {
-	auto& rfiles = cfg::recentFiles;
-	int idx = rfiles.indexOf (path);
+	m_result.type = OBJ_Subfile;
+	m_result.color = tokenToNumber (1);
+	m_result.text = token (14).toString();
+	tokensToCoordinates (2, 12); // position 2 - 4, matrix 5 - 13
+}
 
-	// If this file already is in the list, pop it out.
-	if (idx != -1)
+// =============================================================================
+//
+template<typename Char>
+void LDLineParser<Char>::parsePolygon()
+{
+	// Line / Triangle / Quadrilateral / Conditional line
+	switch (tokenChar (*token (0).begin))
 	{
-		if (rfiles.size() == 1)
-			return; // only recent file - abort and do nothing
-
-		// Pop it out.
-		rfiles.removeAt (idx);
+		case '2': m_result.type = OBJ_Line; break;
+		case '3': m_result.type = OBJ_Triangle; break;
+		case '4': m_result.type = OBJ_Quad; break;
+		default:  m_result.type = OBJ_CondLine; break;
 	}
 
-	// If there's too many recent files, drop one out.
-	while (rfiles.size() > (g_maxRecentFiles - 1))
-		rfiles.removeAt (0);
-
-	// Add the file
-	rfiles << path;
-
-	Config::save();
-	g_win->updateRecentFilesMenu();
+	m_result.color = tokenToNumber (1);
+	tokensToCoordinates (2, m_tokens.count() - 2);
 }
 
 // =============================================================================
-// Open an LDraw file and set it as the main model
-// =============================================================================
-void openMainFile (QString path)
+//
+static inline Vertex coordinatesToVertex (const double* coordinates)
 {
-	// If there's already a file with the same name, this file must replace it.
-	LDDocumentPtr documentToReplace;
-	LDDocumentPtr file;
-	QString shortName = LDDocument::shortenName (path);
+	return Vertex (coordinates[0], coordinates[1], coordinates[2]);
+}
 
-	for (LDDocumentWeakPtr doc : g_allDocuments)
+// =============================================================================
+//
+// Turns a parsed line into an LDObject. @data and @length point to the line
+// itself, which is only needed if the object turns out to be an error.
+//
+template<typename Char>
+static LDObjectPtr createObject (const LDParsedLine& parsed, const Char* data, int length)
+{
+	switch (parsed.type)
 	{
-		if (doc.toStrongRef()->name() == shortName)
+		case OBJ_Empty:
+			return spawn<LDEmpty>();
+
+		case OBJ_Comment:
 		{
-			documentToReplace = doc;
-			break;
+			LDCommentPtr obj = spawn<LDComment>();
+			obj->setText (parsed.text);
+			return obj;
 		}
-	}
-
-	// We cannot open this file if the document this would replace is not
-	// safe to close.
-	if (documentToReplace != null && not documentToReplace->isSafeToClose())
-		return;
-
-	g_loadingMainFile = true;
-
-	// If we're replacing an existing document, clear the document and
-	// make it ready for being loaded to.
-	if (documentToReplace != null)
-	{
-		file = documentToReplace;
-		file->clear();
-	}
 
-	file = openDocument (path, false, false, file);
+		case OBJ_BFC:
+			return spawn<LDBFC> (parsed.statement);
 
-	if (file == null)
-	{
-		if (not g_aborted)
+		case OBJ_Vertex:
 		{
-			// Tell the user loading failed.
-			setlocale (LC_ALL, "C");
-			critical (format (QObject::tr ("Failed to open %1: %2"), path, strerror (errno)));
+			LDVertexPtr obj = spawn<LDVertex>();
+			obj->setColor (LDColor::fromIndex (parsed.color));
+			obj->pos = coordinatesToVertex (&parsed.coordinates[0]);
+			return obj;
 		}
 
-		g_loadingMainFile = false;
-		return;
-	}
-
-	file->setImplicit (false);
-
-	// If we have an anonymous, unchanged file open as the only open file
-	// (aside of the one we just opened), close it now.
-	LDDocument::closeInitialFile();
-
-	// Rebuild the object tree view now.
-	LDDocument::setCurrent (file);
-	g_win->doFullRefresh();
-
-	// Add it to the recent files list.
-	addRecentFile (path);
-	g_loadingMainFile = false;
-}
+		case OBJ_Overlay:
+		{
+			LDOverlayPtr obj = spawn<LDOverlay>();
+			obj->setFileName (parsed.text);
+			obj->setCamera (parsed.integers[0]);
+			obj->setX (parsed.integers[1]);
+			obj->setY (parsed.integers[2]);
+			obj->setWidth (parsed.integers[3]);
+			obj->setHeight (parsed.integers[4]);
+			return obj;
+		}
 
-// =============================================================================
-//
-bool LDDocument::save (QString savepath)
-{
-	if (isImplicit())
-		return false;
+		case OBJ_Subfile:
+		{
+			// Try open the file. Disable g_loadingMainFile temporarily since we're
+			// not loading the main file now, but the subfile in question.
+			bool tmp = g_loadingMainFile;
+			g_loadingMainFile = false;
+			LDDocumentPtr load = getDocument (parsed.text);
+			g_loadingMainFile = tmp;
+
+			// If we cannot open the file, mark it an error. Note we cannot use LDParseError
+			// here because the error object needs the document reference.
+			if (not load)
+			{
+				LDErrorPtr obj = spawn<LDError> (tokenString (data, length),
+					format ("Could not open %1", parsed.text));
+				obj->setFileReferenced (parsed.text);
+				return obj;
+			}
 
-	if (not savepath.length())
-		savepath = fullPath();
+			LDSubfilePtr obj = spawn<LDSubfile>();
+			obj->setColor (LDColor::fromIndex (parsed.color));
+			obj->setPosition (coordinatesToVertex (&parsed.coordinates[0]));
 
-	// If the second object in the list holds the file name, update that now.
-	LDObjectPtr nameObject = getObject (1);
+			Matrix transform;
 
-	if (nameObject != null && nameObject->type() == OBJ_Comment)
-	{
-		LDCommentPtr nameComment = nameObject.staticCast<LDComment>();
+			for (int i = 0; i < 9; ++i)
+				transform[i] = parsed.coordinates[i + 3];
 
-		if (nameComment->text().left (6) == "Name: ")
-		{
-			QString newname = shortenName (savepath);
-			nameComment->setText (format ("Name: %1", newname));
-			g_win->buildObjList();
+			obj->setTransform (transform);
+			obj->setFileInfo (load);
+			return obj;
 		}
-	}
-
-	QByteArray data;
-
-	// File is open, now save the model to it. Note that LDraw requires files to
-	// have DOS line endings, so we terminate the lines with \r\n.
-	for (LDObjectPtr obj : objects())
-		data.append ((obj->asText() + "\r\n").toUtf8());
 
-	QFile f (savepath);
+		case OBJ_Line:
+		case OBJ_Triangle:
+		case OBJ_Quad:
+		case OBJ_CondLine:
+		{
+			LDObjectPtr obj = LDObject::getDefault (parsed.type);
+			obj->setColor (LDColor::fromIndex (parsed.color));
 
-	if (not f.open (QIODevice::WriteOnly))
-		return false;
+			for (int i = 0; i < obj->numVertices(); ++i)
+				obj->setVertex (i, coordinatesToVertex (&parsed.coordinates[i * 3]));
 
-	f.write (data);
-	f.close();
+			return obj;
+		}
 
-	// We have successfully saved, update the save position now.
-	setSavePosition (history()->position());
-	setFullPath (savepath);
-	setName (shortenName (savepath));
+		case OBJ_Error:
+		case OBJ_NumTypes:
+			break;
+	}
 
-	g_win->updateDocumentListItem (self().toStrongRef());
-	g_win->updateTitle();
-	return true;
+	// Strange line we couldn't parse
+	return spawn<LDError> (tokenString (data, length), parsed.text);
 }
 
 // =============================================================================
 //
-void LDDocument::clear()
+template<typename Char>
+static LDObjectPtr parseLineBuffer (const Char* data, int length)
 {
-	for (LDObjectPtr obj : objects())
-		forgetObject (obj);
+	LDParsedLine parsed;
+	LDLineParser<Char> (data, length, parsed).parse();
+	return createObject (parsed, data, length);
 }
 
 // =============================================================================
-//
-static void checkTokenCount (const QStringList& tokens, int num)
+// This is the LDraw code parser function. It takes in a string containing LDraw
+// code and returns the object parsed from it. parseLine never returns null,
+// the object will be LDError if it could not be parsed properly.
+// =============================================================================
+LDObjectPtr parseLine (QString line)
 {
-	if (tokens.size() != num)
-		throw QString (format ("Bad amount of tokens, expected %1, got %2", num, tokens.size()));
+	return parseLineBuffer (line.constData(), line.length());
 }
 
 // =============================================================================
 //
-static void checkTokenNumbers (const QStringList& tokens, int min, int max)
+LDFileBuffer::LDFileBuffer (QIODevice* fp) :
+	m_file (qobject_cast<QFile*> (fp)),
+	m_map (null)
 {
-	bool ok;
+	qint64 size = fp->size();
+	QBuffer* buffer = qobject_cast<QBuffer*> (fp);
 
-	QRegExp scient ("\\-?[0-9]+\\.[0-9]+e\\-[0-9]+");
+	// Map the file into memory if we can. Sequential devices and files that
+	// cannot be mapped are read in with a single read instead. Files from the
+	// library archive are in memory already.
+	if (m_file != null && size > 0 && not fp->isSequential())
+		m_map = m_file->map (0, size);
 
-	for (int i = min; i <= max; ++i)
+	if (m_map != null)
 	{
-		// Check hex
-		if (tokens[i].startsWith ("0x"))
-		{
-			tokens[i].mid (2).toInt (&ok, 16);
-
-			if (not ok)
-			{
-				// Check for floating point
-				tokens[i].toDouble (&ok);
-
-				// Also check scientific notation, e.g. 7.99361e-15
-				if (not ok && not scient.exactMatch (tokens[i]))
-				{
-					throw QString (format ("Token #%1 was `%2`, expected a number (matched length: %3)",
-						(i + 1), tokens[i], scient.matchedLength()));
-				}
-			}
-		}
+		m_data = reinterpret_cast<const char*> (m_map);
+		m_size = size;
+	}
+	else
+	{
+		m_contents = (buffer != null) ? buffer->data() : fp->readAll();
+		m_data = m_contents.constData();
+		m_size = m_contents.size();
 	}
+
+	findLines();
 }
 
 // =============================================================================
 //
-static Vertex parseVertex (QStringList& s, const int n)
+LDFileBuffer::LDFileBuffer (const QByteArray& contents) :
+	m_file (null),
+	m_map (null),
+	m_contents (contents),
+	m_data (m_contents.constData()),
+	m_size (m_contents.size())
 {
-	Vertex v;
-	v.apply ([&] (Axis ax, double& a) { a = s[n + ax].toDouble(); });
-	return v;
+	findLines();
 }
 
-static int32 stringToNumber (QString a)
+// =============================================================================
+//
+void LDFileBuffer::findLines()
 {
-	int base = 10;
+	// Skip the UTF-8 byte order mark
+	if (m_size >= 3 && memcmp (m_data, "\xEF\xBB\xBF", 3) == 0)
+	{
+		m_data += 3;
+		m_size -= 3;
+	}
+
+	// Find the line boundaries. memchr is vectorized by the C library, so this
+	// scans the buffer many bytes at a time.
+	const char* it = m_data;
+	const char* end = m_data + m_size;
 
-	if (a.startsWith ("0x"))
+	while (it < end)
 	{
-		a.remove (0, 2);
-		base = 16;
+		m_lineOffsets << (it - m_data);
+		const char* newline = reinterpret_cast<const char*> (memchr (it, '\n', end - it));
+		it = (newline != null) ? newline + 1 : end;
 	}
 
-	return a.toLong (null, base);
+	m_lineOffsets << m_size;
 }
 
 // =============================================================================
-// This is the LDraw code parser function. It takes in a string containing LDraw
-// code and returns the object parsed from it. parseLine never returns null,
-// the object will be LDError if it could not be parsed properly.
+//
+LDFileBuffer::LDFileBuffer (const LDFileBuffer& buffer, int first, int last) :
+	m_file (null),
+	m_map (null),
+	m_data (buffer.m_data),
+	m_size (buffer.m_size),
+	m_lineOffsets (buffer.m_lineOffsets.mid (first, last - first + 1)) {}
+
 // =============================================================================
-LDObjectPtr parseLine (QString line)
+//
+LDFileBuffer::~LDFileBuffer()
 {
-	try
-	{
-		QStringList tokens = line.split (" ", QString::SkipEmptyParts);
-
-		if (tokens.size() <= 0)
-		{
-			// Line was empty, or only consisted of whitespace
-			return spawn<LDEmpty>();
-		}
+	if (m_map != null)
+		m_file->unmap (m_map);
+}
 
-		if (tokens[0].length() != 1 || not tokens[0][0].isDigit())
-			throw QString ("Illogical line code");
+// =============================================================================
+//
+int LDFileBuffer::lineLength (int i) const
+{
+	const char* data = lineData (i);
+	int length = int (qMin<qint64> (m_lineOffsets[i + 1] - m_lineOffsets[i], INT_MAX));
 
-		int num = tokens[0][0].digitValue();
+	// Trim the trailing newline
+	while (length > 0 && (data[length - 1] == '\n' || data[length - 1] == '\r'))
+		--length;
 
-		switch (num)
-		{
-			case 0:
-			{
-				// Comment
-				QString commentText (line.mid (line.indexOf ("0") + 2));
-				QString commentTextSimplified (commentText.simplified());
+	return length;
+}
 
-				// Handle BFC statements
-				if (tokens.size() > 2 && tokens[1] == "BFC")
-				{
-					for (int i = 0; i < LDBFC::NumStatements; ++i)
-						if (commentTextSimplified == format ("BFC %1", LDBFC::k_statementStrings [i]))
-							return spawn<LDBFC> ((LDBFC::Statement) i);
-
-					// MLCAD is notorious for stuffing these statements in parts it
-					// creates. The above block only handles valid statements, so we
-					// need to handle MLCAD-style invertnext, clip and noclip separately.
-					if (commentTextSimplified == "BFC CERTIFY INVERTNEXT")
-						return spawn<LDBFC> (LDBFC::InvertNext);
-					elif (commentTextSimplified == "BFC CERTIFY CLIP")
-						return spawn<LDBFC> (LDBFC::Clip);
-					elif (commentTextSimplified == "BFC CERTIFY NOCLIP")
-						return spawn<LDBFC> (LDBFC::NoClip);
-				}
+// =============================================================================
+//
+// Tells whether the line in @data is a plain comment by peeking at its first two
+// tokens. BFC statements and LDForge meta commands are not plain comments.
+//
+static bool isPlainComment (const char* data, int length)
+{
+	const char* end = data + length;
+	LDToken<char> tokens[2];
 
-				if (tokens.size() > 2 && tokens[1] == "!LDFORGE")
-				{
-					// Handle LDForge-specific types, they're embedded into comments too
-					if (tokens[2] == "VERTEX")
-					{
-						// Vertex (0 !LDFORGE VERTEX)
-						checkTokenCount (tokens, 7);
-						checkTokenNumbers (tokens, 3, 6);
-
-						LDVertexPtr obj = spawn<LDVertex>();
-						obj->setColor (LDColor::fromIndex (stringToNumber (tokens[3])));
-						obj->pos.apply ([&](Axis ax, double& value) { value = tokens[4 + ax].toDouble(); });
-						return obj;
-					}
-					elif (tokens[2] == "OVERLAY")
-					{
-						checkTokenCount (tokens, 9);
-						checkTokenNumbers (tokens, 5, 8);
-
-						LDOverlayPtr obj = spawn<LDOverlay>();
-						obj->setFileName (tokens[3]);
-						obj->setCamera (tokens[4].toLong());
-						obj->setX (tokens[5].toLong());
-						obj->setY (tokens[6].toLong());
-						obj->setWidth (tokens[7].toLong());
-						obj->setHeight (tokens[8].toLong());
-						return obj;
-					}
-				}
+	for (int i = 0; i < countof (tokens); ++i)
+	{
+		while (data != end && *data == ' ')
+			++data;
 
-				// Just a regular comment:
-				LDCommentPtr obj = spawn<LDComment>();
-				obj->setText (commentText);
-				return obj;
-			}
+		tokens[i].begin = data;
 
-			case 1:
-			{
-				// Subfile
-				checkTokenCount (tokens, 15);
-				checkTokenNumbers (tokens, 1, 13);
-
-				// Try open the file. Disable g_loadingMainFile temporarily since we're
-				// not loading the main file now, but the subfile in question.
-				bool tmp = g_loadingMainFile;
-				g_loadingMainFile = false;
-				LDDocumentPtr load = getDocument (tokens[14]);
-				g_loadingMainFile = tmp;
-
-				// If we cannot open the file, mark it an error. Note we cannot use LDParseError
-				// here because the error object needs the document reference.
-				if (not load)
-				{
-					LDErrorPtr obj = spawn<LDError> (line, format ("Could not open %1", tokens[14]));
-					obj->setFileReferenced (tokens[14]);
-					return obj;
-				}
+		while (data != end && *data != ' ')
+			++data;
 
-				LDSubfilePtr obj = spawn<LDSubfile>();
-				obj->setColor (LDColor::fromIndex (stringToNumber (tokens[1])));
-				obj->setPosition (parseVertex (tokens, 2));  // 2 - 4
+		tokens[i].end = data;
+	}
 
-				Matrix transform;
+	return tokens[0] == "0" && tokens[1] != "BFC" && tokens[1] != "!LDFORGE";
+}
 
-				for (int i = 0; i < 9; ++i)
-					transform[i] = tokens[i + 5].toDouble(); // 5 - 13
+// =============================================================================
+//
+// LDParseChunk
+//
+// A range of lines that the parallel file loader parses in a worker thread.
+// The results are turned into objects in the main thread, in line order.
+//
+struct LDParseChunk
+{
+	int						first;
+	int						last;
+	bool					skipsComments;
+	QVector<LDParsedLine>	results;
+	QFuture<void>			future;
+};
 
-				obj->setTransform (transform);
-				obj->setFileInfo (load);
-				return obj;
-			}
+// =============================================================================
+//
+// Worker thread function of the parallel file loader
+//
+static void parseChunk (const LDFileBuffer* buffer, LDParseChunk* chunk)
+{
+	chunk->results.resize (chunk->last - chunk->first);
 
-			case 2:
-			{
-				checkTokenCount (tokens, 8);
-				checkTokenNumbers (tokens, 1, 7);
+	for (int i = chunk->first; i < chunk->last; ++i)
+	{
+		if (chunk->skipsComments && isPlainComment (buffer->lineData (i), buffer->lineLength (i)))
+			continue;
 
-				// Line
-				LDLinePtr obj (spawn<LDLine>());
-				obj->setColor (LDColor::fromIndex (stringToNumber (tokens[1])));
+		LDLineParser<char> (buffer->lineData (i), buffer->lineLength (i),
+			chunk->results[i - chunk->first]).parse();
+	}
+}
 
-				for (int i = 0; i < 2; ++i)
-					obj->setVertex (i, parseVertex (tokens, 2 + (i * 3)));   // 2 - 7
+// =============================================================================
+//
+LDFileLoader::LDFileLoader() :
+	m_isParallel (false),
+	m_keepsCommentsRaw (false),
+	dlg (null),
+	m_pendingLine (0) {}
 
-				return obj;
+// =============================================================================
+//
+LDFileLoader::~LDFileLoader()
+{
+	finishChunks();
+}
+
+// =============================================================================
+//
+void LDFileLoader::start()
+{
+	setDone (false);
+	setProgress (0);
+	setAborted (false);
+
+	if (isOnForeground())
+	{
+		g_aborted = false;
+
+		// Show a progress dialog if we're loading the main ldDocument.here so we can
+		// show progress updates and keep the WM posted that we're still here.
+		// Of course we cannot exec() the dialog because then the dialog would
+		// block.
+		dlg = new OpenProgressDialog (g_win);
+		dlg->setNumLines (buffer()->numLines());
+		dlg->setModal (true);
+		dlg->show();
+
+		// Connect the loader in so we can show updates
+		connect (this, SIGNAL (workDone()), dlg, SLOT (accept()));
+		connect (dlg, SIGNAL (rejected()), this, SLOT (abort()));
+	}
+	else
+		dlg = null;
+
+	// In parallel mode, hand the lines out to the thread pool in chunks. The
+	// chunks are then picked up in order by work().
+	if (isParallel())
+	{
+		for (int i = 0; i < buffer()->numLines(); i += g_parseChunkSize)
+		{
+			LDParseChunk* chunk = new LDParseChunk;
+			chunk->first = i;
+			chunk->last = qMin (i + g_parseChunkSize, buffer()->numLines());
+			chunk->skipsComments = keepsCommentsRaw();
+			chunk->future = QtConcurrent::run (parseChunk, buffer(), chunk);
+			m_chunks << chunk;
+		}
+
+		connect (&m_chunkWatcher, SIGNAL (finished()), this, SLOT (resume()));
+	}
+
+	// Begin working
+	work (0);
+}
+
+// =============================================================================
+//
+// Waits for the parse chunks to finish and releases them.
+//
+void LDFileLoader::finishChunks()
+{
+	for (LDParseChunk* chunk : m_chunks)
+	{
+		chunk->future.waitForFinished();
+		delete chunk;
+	}
+
+	m_chunks.clear();
+}
+
+// =============================================================================
+//
+// Adds the object parsed from line @i to the object list
+//
+void LDFileLoader::addParsedObject (int i, LDObjectPtr obj)
+{
+	// Check for parse errors and warn about tthem
+	if (obj->type() == OBJ_Error)
+	{
+		print ("Couldn't parse line #%1: %2", i + 1, obj.staticCast<LDError>()->reason());
+
+		if (warnings() != null)
+			(*warnings())++;
+	}
+
+	m_objects << obj;
+	setProgress (i);
+}
+
+// =============================================================================
+//
+// Tells whether line @i is left for the document to parse later. If so, a null
+// object is added in its place.
+//
+bool LDFileLoader::keepRawLine (int i)
+{
+	if (not keepsCommentsRaw() || not isPlainComment (buffer()->lineData (i), buffer()->lineLength (i)))
+		return false;
+
+	m_objects << LDObjectPtr();
+	setProgress (i);
+	return true;
+}
+
+// =============================================================================
+//
+// Parses lines starting from @i directly in this thread. Returns the line
+// to continue from.
+//
+int LDFileLoader::parseLines (int i)
+{
+	// Parse up to 300 lines per iteration
+	int max = i + 300;
+
+	for (; i < max && i < buffer()->numLines(); ++i)
+	{
+		if (not keepRawLine (i))
+			addParsedObject (i, parseLineBuffer (buffer()->lineData (i), buffer()->lineLength (i)));
+
+		// If we have a dialog pointer, update the progress now
+		if (isOnForeground())
+			dlg->updateProgress (i);
+	}
+
+	return i;
+}
+
+// =============================================================================
+//
+// Creates the objects of the chunk starting from line @i once the chunk has
+// been parsed. Returns the line to continue from, which is @i itself if the
+// chunk is not ready yet.
+//
+int LDFileLoader::takeChunk (int i)
+{
+	LDParseChunk* chunk = m_chunks[i / g_parseChunkSize];
+
+	if (not chunk->future.isFinished())
+	{
+		// If we have a dialog, we must not block the event loop. Come back
+		// once the chunk is done.
+		if (isOnForeground())
+		{
+			m_pendingLine = i;
+			m_chunkWatcher.setFuture (chunk->future);
+			return i;
+		}
+
+		chunk->future.waitForFinished();
+	}
+
+	for (; i < chunk->last; ++i)
+	{
+		if (keepRawLine (i))
+			continue;
+
+		const LDParsedLine& parsed = chunk->results[i - chunk->first];
+		addParsedObject (i, createObject (parsed, buffer()->lineData (i), buffer()->lineLength (i)));
+	}
+
+	chunk->results.clear();
+
+	if (isOnForeground())
+		dlg->updateProgress (i);
+
+	return i;
+}
+
+// =============================================================================
+//
+void LDFileLoader::resume()
+{
+	work (m_pendingLine);
+}
+
+// =============================================================================
+//
+void LDFileLoader::work (int i)
+{
+	// User wishes to abort, so stop here now.
+	if (isAborted())
+	{
+		finishChunks();
+
+		for (LDObjectPtr obj : m_objects)
+		{
+			if (obj != null)
+				obj->destroy();
+		}
+
+		m_objects.clear();
+		setDone (true);
+		return;
+	}
+
+	int start = i;
+
+	if (isParallel() && i < buffer()->numLines())
+	{
+		i = takeChunk (i);
+
+		// Chunk is not ready yet, resume() calls us back once it is.
+		if (i == start)
+			return;
+	}
+	else
+		i = parseLines (i);
+
+	// If we're done now, tell the environment we're done and stop.
+	if (i >= buffer()->numLines())
+	{
+		emit workDone();
+		setDone (true);
+		return;
+	}
+
+	// Otherwise, continue, by recursing back.
+	if (not isDone())
+	{
+		// If we have a dialog to show progress output to, we cannot just call
+		// work() again immediately as the dialog needs some processor cycles as
+		// well. Thus, take a detour through the event loop by using the
+		// meta-object system.
+		//
+		// This terminates the loop here and control goes back to the function
+		// which called the file loader. It will keep processing the event loop
+		// until we're ready (see loadFileContents), thus the event loop will
+		// eventually catch the invokation we throw here and send us back. Though
+		// it's not technically recursion anymore, more like a for loop. :P
+		if (isOnForeground())
+			QMetaObject::invokeMethod (this, "work", Qt::QueuedConnection, Q_ARG (int, i));
+		else
+			work (i);
+	}
+}
+
+// =============================================================================
+//
+void LDFileLoader::abort()
+{
+	setAborted (true);
+
+	if (isOnForeground())
+		g_aborted = true;
+}
+
+// =============================================================================
+//
+// LDPrefetchedFile
+//
+// A subfile that prefetchSubfiles() loads and parses ahead of time. The search
+// context and cache location are resolved in the main thread beforehand.
+//
+struct LDPrefetchedFile
+{
+	QString							name;
+	QString							fullPath;
+	const LDSearchContext*			searchContext;
+	const LDGeometryCache::Location*	cacheLocation; // null if the cache is not used
+	QFile*							file;
+	LDFileBuffer*					buffer;
+	QVector<LDParsedLine>			lines;
+	QStringList						references;
+	bool							isVisited;
+	bool							isCached;
+	QVector<LDPolygon>				cachedPolygons;
+	QList<Vertex>					cachedVertices;
+	QStringList						cachedDependencies;
+
+	LDPrefetchedFile (QString name, const LDSearchContext* searchContext,
+		const LDGeometryCache::Location* cacheLocation) :
+		name (name),
+		searchContext (searchContext),
+		cacheLocation (cacheLocation),
+		file (new QFile),
+		buffer (null),
+		isVisited (false),
+		isCached (false) {}
+
+	~LDPrefetchedFile()
+	{
+		delete buffer;
+		delete file;
+	}
+};
+
+// =============================================================================
+//
+// Worker thread function of prefetchSubfiles(): finds, reads and parses a file.
+// This must not touch anything but the file itself and the plain data it was
+// given: the documents and the objects are created in the main thread.
+//
+static void prefetchFile (LDPrefetchedFile* prefetch)
+{
+	prefetch->fullPath = findLDrawFilePath (*prefetch->searchContext, prefetch->name, true);
+
+	if (prefetch->fullPath.isEmpty())
+		return;
+
+	// If the geometry is cached, the file does not need to be parsed and its
+	// subfiles are not needed at all.
+	if (prefetch->cacheLocation != null && LDGeometryCache::load (*prefetch->cacheLocation,
+		prefetch->fullPath, prefetch->cachedPolygons, prefetch->cachedVertices,
+		prefetch->cachedDependencies))
+	{
+		prefetch->isCached = true;
+		return;
+	}
+
+	LDLibraryArchive* archive = LDLibraryArchive::instance();
+
+	if (archive != null && archive->contains (prefetch->fullPath))
+	{
+		bool ok;
+		QByteArray contents = archive->read (prefetch->fullPath, &ok);
+
+		if (not ok)
+		{
+			prefetch->fullPath.clear();
+			return;
+		}
+
+		prefetch->buffer = new LDFileBuffer (contents);
+	}
+	else
+	{
+		prefetch->file->setFileName (prefetch->fullPath);
+
+		if (not prefetch->file->open (QIODevice::ReadOnly))
+		{
+			prefetch->fullPath.clear();
+			return;
+		}
+
+		prefetch->buffer = new LDFileBuffer (prefetch->file);
+	}
+
+	prefetch->lines.resize (prefetch->buffer->numLines());
+
+	for (int i = 0; i < prefetch->lines.size(); ++i)
+	{
+		LDParsedLine& parsed = prefetch->lines[i];
+		LDLineParser<char> (prefetch->buffer->lineData (i), prefetch->buffer->lineLength (i), parsed).parse();
+
+		if (parsed.type == OBJ_Subfile)
+			prefetch->references << parsed.text;
+	}
+}
+
+// =============================================================================
+//
+// Creates the document of a prefetched file, after the documents it depends on.
+//
+static void createPrefetchedDocument (QMap<QString, LDPrefetchedFile*>& files, QString name,
+	QList<LDDocumentPtr>& documents)
+{
+	LDPrefetchedFile* prefetch = files.value (name.toLower());
+
+	// If the file was already created or it is being created further up the
+	// stack (a cyclic reference), there's nothing to do here.
+	if (prefetch == null || prefetch->isVisited || prefetch->fullPath.isEmpty())
+		return;
+
+	prefetch->isVisited = true;
+
+	for (const QString& reference : prefetch->references)
+		createPrefetchedDocument (files, reference, documents);
+
+	LDDocumentPtr load = LDDocument::createNew();
+	load->setImplicit (true);
+	load->setFullPath (prefetch->fullPath);
+	load->setName (LDDocument::shortenName (load->fullPath()));
+
+	if (prefetch->isCached)
+	{
+		load->setCachedGeometry (prefetch->cachedPolygons, prefetch->cachedVertices,
+			prefetch->cachedDependencies);
+		documents << load;
+		return;
+	}
+
+	load->history()->setIgnoring (true);
+
+	// Library files do not see the embedded files of whatever is being loaded
+	LDEmbeddedScope scope (&load->embeddedDocuments());
+	LDObjectList objs;
+
+	for (int i = 0; i < prefetch->lines.size(); ++i)
+	{
+		LDObjectPtr obj = createObject (prefetch->lines[i], prefetch->buffer->lineData (i),
+			prefetch->buffer->lineLength (i));
+
+		if (obj->type() == OBJ_Error)
+			print ("Couldn't parse line #%1: %2", i + 1, obj.staticCast<LDError>()->reason());
+
+		objs << obj;
+	}
+
+	load->addObjects (objs);
+	load->history()->setIgnoring (false);
+	documents << load;
+
+	// Don't hold on to the file any longer than necessary
+	delete prefetch->buffer;
+	prefetch->buffer = null;
+	prefetch->file->close();
+	prefetch->lines.clear();
+}
+
+// =============================================================================
+//
+// Loads the subfiles referenced by the file in @buffer ahead of time. The
+// reference tree is walked one level at a time, and the files of each level
+// are read and parsed in parallel in the thread pool. The documents are then
+// created in the main thread, dependencies first, so that parsing the file
+// itself only needs to look up its subfiles.
+//
+// The returned list holds the created documents. It needs to be kept until
+// the objects referencing them have been created.
+//
+static QList<LDDocumentPtr> prefetchSubfiles (const LDFileBuffer& buffer)
+{
+	QList<LDDocumentPtr> documents;
+	QMap<QString, LDPrefetchedFile*> files;
+	QList<LDPrefetchedFile*> level;
+	QStringList references;
+	const LDSearchContext searchContext = LDSearchContext::current();
+	const LDGeometryCache::Location cacheLocation = LDGeometryCache::currentLocation();
+	const LDGeometryCache::Location* usedCacheLocation = cfg::useGeometryCache ? &cacheLocation : null;
+
+	// Find the references of this file. There's no need to parse it in full.
+	for (int i = 0; i < buffer.numLines(); ++i)
+	{
+		LDLineTokenizer<char> tokens (buffer.lineData (i), buffer.lineLength (i));
+
+		if (tokens.count() == 15 && tokens[0] == "1")
+		{
+			QString reference = tokens[14].toString();
+
+			// Embedded files are created by the multi-part document itself
+			if (findEmbeddedDocument (reference) == null)
+				references << reference;
+		}
+	}
+
+	while (not references.isEmpty())
+	{
+		for (const QString& reference : references)
+		{
+			QString key = reference.toLower();
+
+			if (not files.contains (key) && findDocument (reference) == null && findDocument (key) == null)
+			{
+				LDPrefetchedFile* prefetch = new LDPrefetchedFile (key, &searchContext, usedCacheLocation);
+				files[key] = prefetch;
+				level << prefetch;
 			}
+		}
+
+		references.clear();
+		QtConcurrent::blockingMap (level, prefetchFile);
+
+		for (LDPrefetchedFile* prefetch : level)
+			references << prefetch->references;
+
+		level.clear();
+	}
+
+	for (LDPrefetchedFile* prefetch : files)
+		createPrefetchedDocument (files, prefetch->name, documents);
+
+	qDeleteAll (files);
+	return documents;
+}
+
+// =============================================================================
+//
+static LDObjectList loadBufferContents (const LDFileBuffer& buffer, int* numWarnings, bool* ok,
+	bool keepCommentsRaw = false)
+{
+	LDObjectList objs;
+
+	if (numWarnings)
+		*numWarnings = 0;
+
+	// Load the subfiles ahead of time. The documents need to stay alive
+	// until the objects referencing them have been created.
+	QList<LDDocumentPtr> subfiles;
+
+	if (cfg::parallelLoading)
+		subfiles = prefetchSubfiles (buffer);
+
+	LDFileLoader* loader = new LDFileLoader;
+	loader->setWarnings (numWarnings);
+	loader->setBuffer (&buffer);
+	loader->setOnForeground (g_loadingMainFile);
+	loader->setKeepsCommentsRaw (keepCommentsRaw);
+
+	// Files with more than a chunk's worth of lines are parsed in the thread
+	// pool. Smaller files are not worth the trouble.
+	loader->setParallel (cfg::parallelLoading && buffer.numLines() > g_parseChunkSize);
+	loader->start();
+
+	// After start() returns, if the loader isn't done yet, it's delaying
+	// its next iteration through the event loop. We need to catch this here
+	// by telling the event loop to tick, which will tick the file loader again.
+	// We keep doing this until the file loader is ready.
+	while (not loader->isDone())
+		qApp->processEvents (QEventLoop::WaitForMoreEvents);
+
+	// If we wanted the success value, supply that now
+	if (ok)
+		*ok = not loader->isAborted();
+
+	objs = loader->objects();
+	delete loader;
+	return objs;
+}
+
+// =============================================================================
+//
+LDObjectList loadFileContents (QIODevice* fp, int* numWarnings, bool* ok)
+{
+	// Map the file in. The lines are parsed straight from the buffer.
+	LDFileBuffer buffer (fp);
+	return loadBufferContents (buffer, numWarnings, ok);
+}
+
+// =============================================================================
+//
+// LDMpdSection
+//
+// A file embedded in a multi-part document: the lines between its 0 FILE and
+// 0 NOFILE lines, and the subfiles these lines reference.
+//
+struct LDMpdSection
+{
+	QString		name;
+	int			first;
+	int			last;
+	QStringList	references;
+	bool		isLoaded;
+};
+
+// =============================================================================
+//
+// Splits a multi-part document into its embedded files. Returns an empty list
+// if the file in @buffer is a regular LDraw file, i.e. if it does not start
+// with a 0 FILE line. Lines outside of 0 FILE / 0 NOFILE blocks are ignored.
+//
+static QList<LDMpdSection> findMpdSections (const LDFileBuffer& buffer)
+{
+	QList<LDMpdSection> sections;
+	bool isInFile = false;
+
+	for (int i = 0; i < buffer.numLines(); ++i)
+	{
+		LDLineTokenizer<char> tokens (buffer.lineData (i), buffer.lineLength (i));
+
+		if (tokens.count() >= 3 && tokens[0] == "0" && tokens[1] == "FILE")
+		{
+			if (isInFile)
+				sections.last().last = i;
+
+			const char* lineEnd = buffer.lineData (i) + buffer.lineLength (i);
+			LDMpdSection section;
+			section.name = tokenString (tokens[2].begin, lineEnd - tokens[2].begin).trimmed();
+			section.first = i + 1;
+			section.last = buffer.numLines();
+			section.isLoaded = false;
+			sections << section;
+			isInFile = true;
+		}
+		elif (tokens.count() == 2 && tokens[0] == "0" && tokens[1] == "NOFILE")
+		{
+			if (isInFile)
+				sections.last().last = i;
+
+			isInFile = false;
+		}
+		elif (sections.isEmpty())
+		{
+			// Anything but empty lines before the first 0 FILE means that
+			// this is not a multi-part document.
+			if (tokens.count() > 0)
+				return sections;
+		}
+		elif (isInFile && tokens.count() == 15 && tokens[0] == "1")
+			sections.last().references << tokens[14].toString().toLower();
+	}
+
+	return sections;
+}
+
+// =============================================================================
+//
+// Loads the contents of the embedded file @i into its document, after the
+// embedded files it references.
+//
+static void loadMpdSection (const LDFileBuffer& buffer, QList<LDMpdSection>& sections,
+	const QList<LDDocumentPtr>& documents, int i, int* numWarnings)
+{
+	if (sections[i].isLoaded)
+		return;
+
+	// Mark the section loaded up front so that cyclic references terminate
+	sections[i].isLoaded = true;
+
+	for (const QString& reference : sections[i].references)
+	{
+		for (int j = 1; j < sections.size(); ++j)
+		{
+			if (sections[j].name.toLower() == reference)
+			{
+				loadMpdSection (buffer, sections, documents, j, numWarnings);
+				break;
+			}
+		}
+	}
+
+	LDFileBuffer lines (buffer, sections[i].first, sections[i].last);
+	LDDocumentPtr doc = documents[i - 1];
+	int warnings;
+	bool tmp = g_loadingMainFile;
+	g_loadingMainFile = false;
+	doc->history()->setIgnoring (true);
+	doc->addObjects (loadBufferContents (lines, &warnings, null));
+	doc->history()->setIgnoring (false);
+	g_loadingMainFile = tmp;
+	*numWarnings += warnings;
+}
+
+// =============================================================================
+//
+// Loads a multi-part document. The first embedded file is the main model and
+// its objects are returned. Every other embedded file gets an implicit
+// document, named after the file, which @doc holds on to. These documents are
+// all created before anything is parsed so that references to embedded files
+// find them with getDocument() instead of searching the library.
+//
+static LDObjectList loadMpdContents (LDDocumentPtr doc, const LDFileBuffer& buffer,
+	QList<LDMpdSection>& sections, int* numWarnings, bool* ok)
+{
+	QList<LDDocumentPtr> documents;
+
+	for (int i = 1; i < sections.size(); ++i)
+	{
+		LDDocumentPtr embedded = LDDocument::createNew();
+		embedded->setName (sections[i].name);
+		documents << embedded;
+	}
+
+	doc->setMpdName (sections[0].name);
+	doc->setEmbeddedDocuments (documents);
+	int embeddedWarnings = 0;
+
+	for (int i = 1; i < sections.size(); ++i)
+		loadMpdSection (buffer, sections, documents, i, &embeddedWarnings);
+
+	LDFileBuffer lines (buffer, sections[0].first, sections[0].last);
+	LDObjectList objs = loadBufferContents (lines, numWarnings, ok);
+	*numWarnings += embeddedWarnings;
+	return objs;
+}
+
+// =============================================================================
+//
+LDDocumentPtr openDocument (QString path, bool search, bool implicit, LDDocumentPtr fileToOverride)
+{
+	// Convert the file name to lowercase since some parts contain uppercase
+	// file names. I'll assume here that the library will always use lowercase
+	// file names for the actual parts..
+	QString fullpath = search ? findLDrawFilePath (LDSearchContext::current(), path.toLower(), true) : path;
+
+	if (fullpath.isEmpty())
+		return LDDocumentPtr();
+
+	// Implicit documents can be loaded from the geometry cache, in which case
+	// the file is not even opened. Their objects are then only parsed if
+	// something needs them.
+	if (implicit && fileToOverride == null && cfg::useGeometryCache)
+	{
+		QVector<LDPolygon> polygons;
+		QList<Vertex> vertices;
+		QStringList dependencies;
+
+		if (LDGeometryCache::load (LDGeometryCache::currentLocation(), fullpath, polygons, vertices,
+			dependencies))
+		{
+			LDDocumentPtr load = LDDocument::createNew();
+			load->setImplicit (true);
+			load->setFullPath (fullpath);
+			load->setName (LDDocument::shortenName (load->fullPath()));
+			load->setCachedGeometry (polygons, vertices, dependencies);
+			return load;
+		}
+	}
+
+	QIODevice* fp = LDLibraryArchive::openFile (fullpath);
+
+	if (not fp)
+		return LDDocumentPtr();
+
+	LDDocumentPtr load = (fileToOverride != null ? fileToOverride : LDDocument::createNew());
+	load->setImplicit (implicit);
+	load->setFullPath (fullpath);
+	load->setName (LDDocument::shortenName (load->fullPath()));
 
-			case 3:
-			{
-				checkTokenCount (tokens, 11);
-				checkTokenNumbers (tokens, 1, 10);
+	// Loading the file shouldn't count as actual edits to the document.
+	load->history()->setIgnoring (true);
 
-				// Triangle
-				LDTrianglePtr obj (spawn<LDTriangle>());
-				obj->setColor (LDColor::fromIndex (stringToNumber (tokens[1])));
+	// Drop the embedded files of whatever was loaded into the document before
+	load->setMpdName ("");
+	load->setEmbeddedDocuments (QList<LDDocumentPtr>());
 
-				for (int i = 0; i < 3; ++i)
-					obj->setVertex (i, parseVertex (tokens, 2 + (i * 3)));   // 2 - 10
+	// References in this document only see its own embedded files
+	LDEmbeddedScope scope (&load->embeddedDocuments());
 
-				return obj;
-			}
+	LDFileBuffer* buffer = new LDFileBuffer (fp);
+	QList<LDMpdSection> sections = findMpdSections (*buffer);
 
-			case 4:
-			case 5:
-			{
-				checkTokenCount (tokens, 14);
-				checkTokenNumbers (tokens, 1, 13);
+	// The comments of huge files are not parsed up front. The document takes the
+	// file and its buffer and parses comments as they are needed.
+	const bool lazy = not implicit && sections.isEmpty() && cfg::lazyLoadingThreshold > 0
+		&& buffer->numLines() >= cfg::lazyLoadingThreshold;
+	int numWarnings;
+	bool ok;
+	LDObjectList objs;
 
-				// Quadrilateral / Conditional line
-				LDObjectPtr obj;
+	if (sections.isEmpty())
+		objs = loadBufferContents (*buffer, &numWarnings, &ok, lazy);
+	else
+		objs = loadMpdContents (load, *buffer, sections, &numWarnings, &ok);
 
-				if (num == 4)
-					obj = spawn<LDQuad>();
-				else
-					obj = spawn<LDCondLine>();
+	if (lazy && ok)
+		load->setLazyContents (fp, buffer, objs);
+	else
+	{
+		delete buffer;
+		fp->close();
+		delete fp;
+	}
+
+	if (not ok)
+	{
+		load->dismiss();
+		return LDDocumentPtr();
+	}
+
+	if (not lazy)
+		load->addObjects (objs);
+
+	if (g_loadingMainFile)
+	{
+		LDDocument::setCurrent (load);
 
-				obj->setColor (LDColor::fromIndex (stringToNumber (tokens[1])));
+		if (g_win != null)
+			g_win->R()->setDocument (load);
 
-				for (int i = 0; i < 4; ++i)
-					obj->setVertex (i, parseVertex (tokens, 2 + (i * 3)));   // 2 - 13
+		print (QObject::tr ("File %1 parsed successfully (%2 errors)."), path, numWarnings);
+	}
 
-				return obj;
+	load->history()->setIgnoring (false);
+	return load;
+}
+
+// =============================================================================
+//
+bool LDDocument::isSafeToClose()
+{
+	typedef QMessageBox msgbox;
+	setlocale (LC_ALL, "C");
+
+	// If we have unsaved changes, warn and give the option of saving.
+	if (hasUnsavedChanges())
+	{
+		QString message = format (tr ("There are unsaved changes to %1. Should it be saved?"), getDisplayName());
+
+		int button = msgbox::question (g_win, tr ("Unsaved Changes"), message,
+			(msgbox::Yes | msgbox::No | msgbox::Cancel), msgbox::Cancel);
+
+		switch (button)
+		{
+			case msgbox::Yes:
+			{
+				// If we don't have a file path yet, we have to ask the user for one.
+				if (name().length() == 0)
+				{
+					QString newpath = QFileDialog::getSaveFileName (g_win, tr ("Save As"),
+						getCurrentDocument()->name(), tr ("LDraw files (*.dat *.ldr)"));
+
+					if (newpath.length() == 0)
+						return false;
+
+					setName (newpath);
+				}
+
+				if (not save())
+				{
+					message = format (tr ("Failed to save %1 (%2)\nDo you still want to close?"),
+						name(), strerror (errno));
+
+					if (msgbox::critical (g_win, tr ("Save Failure"), message,
+						(msgbox::Yes | msgbox::No), msgbox::No) == msgbox::No)
+					{
+						return false;
+					}
+				}
+				break;
 			}
 
+			case msgbox::Cancel:
+				return false;
+
 			default:
-				throw QString ("Unknown line code number");
+				break;
+		}
+	}
+
+	return true;
+}
+
+// =============================================================================
+//
+void closeAll()
+{
+	for (LDDocumentPtr file : g_explicitDocuments)
+		file->dismiss();
+}
+
+// =============================================================================
+//
+void newFile()
+{
+	// Create a new anonymous file and set it to our current
+	LDDocumentPtr f = LDDocument::createNew();
+	f->setName ("");
+	f->setImplicit (false);
+	LDDocument::setCurrent (f);
+	LDDocument::closeInitialFile();
+
+	if (g_win != null)
+	{
+		g_win->R()->setDocument (f);
+		g_win->doFullRefresh();
+		g_win->updateTitle();
+		g_win->updateActions();
+	}
+}
+
+// =============================================================================
+//
+void addRecentFile (QString path)
+{
+	auto& rfiles = cfg::recentFiles;
+	int idx = rfiles.indexOf (path);
+
+	// If this file already is in the list, pop it out.
+	if (idx != -1)
+	{
+		if (rfiles.size() == 1)
+			return; // only recent file - abort and do nothing
+
+		// Pop it out.
+		rfiles.removeAt (idx);
+	}
+
+	// If there's too many recent files, drop one out.
+	while (rfiles.size() > (g_maxRecentFiles - 1))
+		rfiles.removeAt (0);
+
+	// Add the file
+	rfiles << path;
+
+	Config::save();
+
+	if (g_win != null)
+		g_win->updateRecentFilesMenu();
+}
+
+// =============================================================================
+// Open an LDraw file and set it as the main model
+// =============================================================================
+void openMainFile (QString path)
+{
+	// If there's already a file with the same name, this file must replace it.
+	LDDocumentPtr documentToReplace;
+	LDDocumentPtr file;
+	QString shortName = LDDocument::shortenName (path);
+
+	for (LDDocumentWeakPtr doc : g_allDocuments)
+	{
+		if (doc.toStrongRef()->name() == shortName)
+		{
+			documentToReplace = doc;
+			break;
+		}
+	}
+
+	// We cannot open this file if the document this would replace is not
+	// safe to close.
+	if (documentToReplace != null && not documentToReplace->isSafeToClose())
+		return;
+
+	g_loadingMainFile = true;
+
+	// If we're replacing an existing document, clear the document and
+	// make it ready for being loaded to.
+	if (documentToReplace != null)
+	{
+		file = documentToReplace;
+		file->clear();
+	}
+
+	file = openDocument (path, false, false, file);
+
+	if (file == null)
+	{
+		if (not g_aborted)
+		{
+			// Tell the user loading failed.
+			setlocale (LC_ALL, "C");
+			critical (format (QObject::tr ("Failed to open %1: %2"), path, strerror (errno)));
+		}
+
+		g_loadingMainFile = false;
+		return;
+	}
+
+	file->setImplicit (false);
+
+	// If we have an anonymous, unchanged file open as the only open file
+	// (aside of the one we just opened), close it now.
+	LDDocument::closeInitialFile();
+
+	// Rebuild the object tree view now.
+	LDDocument::setCurrent (file);
+
+	if (g_win != null)
+		g_win->doFullRefresh();
+
+	// Add it to the recent files list.
+	addRecentFile (path);
+	g_loadingMainFile = false;
+}
+
+// =============================================================================
+//
+bool LDDocument::save (QString savepath)
+{
+	if (isImplicit())
+		return false;
+
+	if (not savepath.length())
+		savepath = fullPath();
+
+	// If the second object in the list holds the file name, update that now.
+	LDObjectPtr nameObject = getObject (1);
+
+	if (nameObject != null && nameObject->type() == OBJ_Comment)
+	{
+		LDCommentPtr nameComment = nameObject.staticCast<LDComment>();
+
+		if (nameComment->text().left (6) == "Name: ")
+		{
+			QString newname = shortenName (savepath);
+			nameComment->setText (format ("Name: %1", newname));
+
+			if (g_win != null)
+				g_win->buildObjList();
+		}
+	}
+
+	LDDocumentWriter writer;
+
+	if (not writer.open (savepath))
+		return false;
+
+	// A multi-part document is written out with its embedded files
+	bool isMpd = not mpdName().isEmpty();
+
+	if (isMpd)
+		writer.writeLine (format ("0 FILE %1", mpdName()));
+
+	for (LDObjectPtr obj : objects())
+		writer.writeObject (obj);
+
+	if (isMpd)
+	{
+		writer.writeLine ("0 NOFILE");
+
+		for (LDDocumentPtr embedded : embeddedDocuments())
+		{
+			writer.writeLine (format ("0 FILE %1", embedded->name()));
+
+			for (LDObjectPtr obj : embedded->objects())
+				writer.writeObject (obj);
+
+			writer.writeLine ("0 NOFILE");
 		}
 	}
-	catch (QString& e)
+
+	if (not writer.commit())
+		return false;
+
+	// We have successfully saved, update the save position now.
+	setSavePosition (history()->position());
+	setFullPath (savepath);
+	setName (shortenName (savepath));
+
+	if (g_win != null)
+	{
+		g_win->updateDocumentListItem (self().toStrongRef());
+		g_win->updateTitle();
+	}
+
+	return true;
+}
+
+// =============================================================================
+//
+void LDDocument::clear()
+{
+	// Raw lines were never made into objects, so they can just be dropped.
+	if (m_numRawLines > 0)
 	{
-		// Strange line we couldn't parse
-		return spawn<LDError> (line, e);
+		for (int i = m_rawLines.size() - 1; i >= 0; --i)
+		{
+			if (m_rawLines[i] != -1)
+				m_objects.removeAt (i);
+		}
+
+		invalidateNumbering (0);
+		releaseLazyContents();
 	}
+
+	for (LDObjectPtr obj : objects())
+		forgetObject (obj);
 }
 
 // =============================================================================
 //
 LDDocumentPtr getDocument (QString filename)
 {
+	// Embedded files override everything else
+	LDDocumentPtr doc = findEmbeddedDocument (filename);
+
 	// Try find the file in the list of loaded files
-	LDDocumentPtr doc = findDocument (filename);
+	if (not doc)
+		doc = findDocument (filename);
 
 	// If it's not loaded, try open it
 	if (not doc)
@@ -1084,8 +2240,17 @@ void reloadAllSubfiles()
 //
 int LDDocument::addObject (LDObjectPtr obj)
 {
-	history()->add (new AddHistory (objects().size(), obj));
+	history()->add (new AddHistory (m_objects.size(), obj));
 	m_objects << obj;
+	obj->m_documentPosition = m_objects.size() - 1;
+
+	// Appending keeps the numbering valid
+	if (m_firstUnnumbered == m_objects.size() - 1)
+		++m_firstUnnumbered;
+
+	if (m_numRawLines > 0)
+		m_rawLines << -1;
+
 	addKnownVerticesOf (obj);
 
 #ifdef DEBUG
@@ -1094,7 +2259,13 @@ int LDDocument::addObject (LDObjectPtr obj)
 #endif
 
 	obj->setDocument (this);
-	g_win->R()->compileObject (obj);
+
+	if (isGeometryType (obj->type()))
+		invalidateGeometry();
+
+	if (g_win != null)
+		g_win->R()->compileObject (obj);
+
 	return getObjectCount() - 1;
 }
 
@@ -1109,237 +2280,757 @@ void LDDocument::addObjects (const LDObjectList objs)
 
 // =============================================================================
 //
-void LDDocument::insertObj (int pos, LDObjectPtr obj)
+void LDDocument::insertObj (int pos, LDObjectPtr obj)
+{
+	history()->add (new AddHistory (pos, obj));
+	m_objects.insert (pos, obj);
+	invalidateNumbering (pos);
+
+	if (m_numRawLines > 0)
+		m_rawLines.insert (pos, -1);
+
+	obj->setDocument (this);
+	addKnownVerticesOf (obj);
+
+	if (isGeometryType (obj->type()))
+		invalidateGeometry();
+
+	if (g_win != null)
+		g_win->R()->compileObject (obj);
+
+#ifdef DEBUG
+	if (not isImplicit())
+		dprint ("Inserted object #%1 (%2) at %3\n", obj->id(), obj->typeName(), pos);
+#endif
+}
+
+// =============================================================================
+//
+void LDDocument::addKnownVerticesOf (LDObjectPtr obj)
+{
+	if (isImplicit())
+		return;
+
+	m_pickTreeChanged = true;
+
+	// Out of date known vertices are rebuilt in full anyway
+	if (m_knownVerticesChanged)
+		return;
+
+	if (obj->type() == OBJ_Subfile)
+	{
+		LDSubfilePtr ref = obj.staticCast<LDSubfile>();
+
+		for (Vertex vrt : ref->fileInfo()->inlineVertices())
+		{
+			vrt.transform (ref->transform(), ref->position());
+			addKnownVertexReference (vrt);
+		}
+	}
+	else
+	{
+		for (int i = 0; i < obj->numVertices(); ++i)
+			addKnownVertexReference (obj->vertex (i));
+	}
+}
+
+// =============================================================================
+//
+void LDDocument::removeKnownVerticesOf (LDObjectPtr obj)
+{
+	if (isImplicit())
+		return;
+
+	m_pickTreeChanged = true;
+
+	// Out of date known vertices are rebuilt in full anyway
+	if (m_knownVerticesChanged)
+		return;
+
+	if (obj->type() == OBJ_Subfile)
+	{
+		LDSubfilePtr ref = obj.staticCast<LDSubfile>();
+
+		for (Vertex vrt : ref->fileInfo()->inlineVertices())
+		{
+			vrt.transform (ref->transform(), ref->position());
+			removeKnownVertexReference (vrt);
+		}
+	}
+	else
+	{
+		for (int i = 0; i < obj->numVertices(); ++i)
+			removeKnownVertexReference (obj->vertex (i));
+	}
+}
+
+// =============================================================================
+//
+void LDDocument::forgetObject (LDObjectPtr obj)
+{
+	int idx = obj->lineNumber();
+	obj->deselect();
+	assert (m_objects[idx] == obj);
+
+	if (not isImplicit() && not (flags() & DOCF_IsBeingDestroyed))
+	{
+		history()->add (new DelHistory (idx, obj));
+		removeKnownVerticesOf (obj);
+	}
+
+	m_objects.removeAt (idx);
+	invalidateNumbering (idx);
+
+	if (m_numRawLines > 0)
+		m_rawLines.remove (idx);
+
+	obj->setDocument (LDDocumentPtr());
+
+	if (isGeometryType (obj->type()))
+		invalidateGeometry();
+}
+
+// =============================================================================
+//
+void LDDocument::vertexChanged (const Vertex& a, const Vertex& b)
+{
+	m_pickTreeChanged = true;
+
+	if (m_knownVerticesChanged)
+		return;
+
+	removeKnownVertexReference (a);
+	addKnownVertexReference (b);
+}
+
+// =============================================================================
+//
+// Marks the known vertices out of date. They are then rebuilt from scratch the
+// next time they are needed, instead of being kept up to date object by object.
+//
+void LDDocument::invalidateKnownVertices()
+{
+	if (isImplicit())
+		return;
+
+	m_knownVerticesChanged = true;
+	m_pickTreeChanged = true;
+}
+
+// =============================================================================
+//
+const LDVertexIndex& LDDocument::knownVertices()
+{
+	if (m_knownVerticesChanged)
+	{
+		m_knownVerticesChanged = false;
+		m_knownVertices.clear();
+
+		// Raw lines of lazily loaded documents do not count until parsed
+		for (LDObjectPtr obj : m_objects)
+		{
+			if (obj != null)
+				addKnownVerticesOf (obj);
+		}
+	}
+
+	return m_knownVertices;
+}
+
+// =============================================================================
+//
+void LDDocument::addKnownVertexReference (const Vertex& a)
+{
+	if (isImplicit())
+		return;
+
+	m_knownVertices.add (a);
+}
+
+// =============================================================================
+//
+void LDDocument::removeKnownVertexReference (const Vertex& a)
+{
+	if (isImplicit())
+		return;
+
+	m_knownVertices.remove (a);
+}
+
+// =============================================================================
+//
+bool safeToCloseAll()
+{
+	for (LDDocumentPtr f : LDDocument::explicitDocuments())
+	{
+		if (not f->isSafeToClose())
+			return false;
+	}
+
+	return true;
+}
+
+// =============================================================================
+//
+void LDDocument::setObject (int idx, LDObjectPtr obj)
+{
+	assert (idx >= 0 && idx < m_objects.size());
+
+	if (isRawLine (idx))
+		materializeLine (idx);
+
+	// Mark this change to history
+	if (not m_history->isIgnoring())
+	{
+		QString oldcode = getObject (idx)->asText();
+		QString newcode = obj->asText();
+		*m_history << new EditHistory (idx, oldcode, newcode);
+	}
+
+	const bool changesGeometry = isGeometryType (m_objects[idx]->type()) || isGeometryType (obj->type());
+	removeKnownVerticesOf (m_objects[idx]);
+	m_objects[idx]->deselect();
+	m_objects[idx]->setDocument (LDDocumentPtr());
+	obj->setDocument (this);
+	addKnownVerticesOf (obj);
+	m_objects[idx] = obj;
+	obj->m_documentPosition = idx;
+
+	if (changesGeometry)
+		invalidateGeometry();
+
+	if (g_win != null)
+		g_win->R()->compileObject (obj);
+}
+
+// =============================================================================
+//
+// Close all documents we don't need anymore
+//
+void LDDocument::closeUnused() {}
+
+// =============================================================================
+//
+LDObjectPtr LDDocument::getObject (int pos)
+{
+	if (m_objects.size() <= pos)
+		return LDObjectPtr();
+
+	if (isRawLine (pos))
+		return materializeLine (pos);
+
+	return m_objects[pos];
+}
+
+// =============================================================================
+//
+int LDDocument::getObjectCount() const
+{
+	return m_objects.size();
+}
+
+// =============================================================================
+//
+// Returns all objects of this document. Any raw lines are parsed first.
+//
+const LDObjectList& LDDocument::objects()
+{
+	for (int i = 0; m_numRawLines > 0 && i < m_rawLines.size(); ++i)
+	{
+		if (m_rawLines[i] != -1)
+			materializeLine (i);
+	}
+
+	return m_objects;
+}
+
+// =============================================================================
+//
+bool LDDocument::isRawLine (int pos) const
+{
+	return m_numRawLines > 0 && pos >= 0 && pos < m_rawLines.size() && m_rawLines[pos] != -1;
+}
+
+// =============================================================================
+//
+// Tells what the raw line at @pos would parse into, without creating the
+// object. If @text is given, it receives the comment text of a comment line.
+// Raw lines are always plain comments, so only the text needs to be cut out.
+//
+LDObjectType LDDocument::rawLineType (int pos, QString* text) const
+{
+	assert (isRawLine (pos));
+
+	if (text != null)
+	{
+		int line = m_rawLines[pos];
+		const char* data = m_lazyBuffer->lineData (line);
+		const char* end = data + m_lazyBuffer->lineLength (line);
+
+		while (data != end && *data == ' ')
+			++data;
+
+		// Comment text starts after the line code and the character following it
+		data += 2;
+		*text = (data < end) ? tokenString (data, end - data) : QString();
+	}
+
+	return OBJ_Comment;
+}
+
+// =============================================================================
+//
+// Finds the index of @obj in this document without parsing raw lines. Returns
+// -1 if the object is not in this document. This takes constant time unless
+// objects have been inserted or removed before the object since the last call.
+//
+int LDDocument::indexOf (const LDObject* obj) const
+{
+	int pos = obj->m_documentPosition;
+
+	if (pos >= 0 && pos < m_firstUnnumbered && m_objects[pos] == obj)
+		return pos;
+
+	for (int i = m_firstUnnumbered; i < m_objects.size(); ++i)
+	{
+		if (m_objects[i] != null)
+			m_objects[i]->m_documentPosition = i;
+	}
+
+	m_firstUnnumbered = m_objects.size();
+	pos = obj->m_documentPosition;
+
+	if (pos >= 0 && pos < m_objects.size() && m_objects[pos] == obj)
+		return pos;
+
+	return -1;
+}
+
+// =============================================================================
+//
+void LDDocument::invalidateNumbering (int pos)
 {
-	history()->add (new AddHistory (pos, obj));
-	m_objects.insert (pos, obj);
-	obj->setDocument (this);
-	g_win->R()->compileObject (obj);
-	addKnownVerticesOf (obj);
-
-#ifdef DEBUG
-	if (not isImplicit())
-		dprint ("Inserted object #%1 (%2) at %3\n", obj->id(), obj->typeName(), pos);
-#endif
+	m_firstUnnumbered = qMin (m_firstUnnumbered, pos);
 }
 
 // =============================================================================
 //
-void LDDocument::addKnownVerticesOf (LDObjectPtr obj)
+void LDDocument::setLazyContents (QIODevice* fp, LDFileBuffer* buffer, const LDObjectList& objs)
 {
-	if (isImplicit())
-		return;
-
-	if (obj->type() == OBJ_Subfile)
+	releaseLazyContents();
+	m_lazyFile = fp;
+	m_lazyBuffer = buffer;
+	m_rawLines.fill (-1, m_objects.size());
+	bool changesGeometry = false;
+
+	// Null objects stand for the lines that were left unparsed
+	for (int i = 0; i < objs.size(); ++i)
 	{
-		LDSubfilePtr ref = obj.staticCast<LDSubfile>();
+		LDObjectPtr obj = objs[i];
+		m_objects << obj;
 
-		for (Vertex vrt : ref->fileInfo()->inlineVertices())
+		if (obj == null)
 		{
-			vrt.transform (ref->transform(), ref->position());
-			addKnownVertexReference (vrt);
+			m_rawLines << i;
+			++m_numRawLines;
+			continue;
 		}
+
+		m_rawLines << -1;
+		obj->m_documentPosition = m_objects.size() - 1;
+		obj->setDocument (this);
+		addKnownVerticesOf (obj);
+		changesGeometry |= isGeometryType (obj->type());
+
+		if (g_win != null)
+			g_win->R()->compileObject (obj);
 	}
-	else
-	{
-		for (int i = 0; i < obj->numVertices(); ++i)
-			addKnownVertexReference (obj->vertex (i));
-	}
+
+	if (changesGeometry)
+		invalidateGeometry();
+
+	if (m_numRawLines == 0)
+		releaseLazyContents();
 }
 
 // =============================================================================
 //
-void LDDocument::removeKnownVerticesOf (LDObjectPtr obj)
+// Parses the raw line at @pos into an object. This is not an edit, so the
+// history is not touched.
+//
+LDObjectPtr LDDocument::materializeLine (int pos)
 {
-	if (isImplicit())
-		return;
+	int line = m_rawLines[pos];
+	LDObjectPtr obj = parseLineBuffer (m_lazyBuffer->lineData (line), m_lazyBuffer->lineLength (line));
+	m_rawLines[pos] = -1;
+	m_objects[pos] = obj;
+	obj->m_documentPosition = pos;
+	obj->setDocument (this);
+	addKnownVerticesOf (obj);
 
-	if (obj->type() == OBJ_Subfile)
-	{
-		LDSubfilePtr ref = obj.staticCast<LDSubfile>();
+	// Once everything has been parsed, the file is not needed anymore.
+	if (--m_numRawLines == 0)
+		releaseLazyContents();
 
-		for (Vertex vrt : ref->fileInfo()->inlineVertices())
-		{
-			vrt.transform (ref->transform(), ref->position());
-			removeKnownVertexReference (vrt);
-		}
-	}
-	else
-	{
-		for (int i = 0; i < obj->numVertices(); ++i)
-			removeKnownVertexReference (obj->vertex (i));
-	}
+	return obj;
 }
 
 // =============================================================================
 //
-void LDDocument::forgetObject (LDObjectPtr obj)
+void LDDocument::releaseLazyContents()
 {
-	int idx = obj->lineNumber();
-	obj->deselect();
-	assert (m_objects[idx] == obj);
+	delete m_lazyBuffer;
+	m_lazyBuffer = null;
 
-	if (not isImplicit() && not (flags() & DOCF_IsBeingDestroyed))
+	if (m_lazyFile != null)
 	{
-		history()->add (new DelHistory (idx, obj));
-		removeKnownVerticesOf (obj);
+		m_lazyFile->close();
+		delete m_lazyFile;
+		m_lazyFile = null;
 	}
 
-	m_objects.removeAt (idx);
-	obj->setDocument (LDDocumentPtr());
+	m_rawLines.clear();
+	m_numRawLines = 0;
 }
 
 // =============================================================================
 //
-void LDDocument::vertexChanged (const Vertex& a, const Vertex& b)
+bool LDDocument::hasUnsavedChanges() const
 {
-	removeKnownVertexReference (a);
-	addKnownVertexReference (b);
+	return not isImplicit() && history()->position() != savePosition();
 }
 
 // =============================================================================
 //
-void LDDocument::addKnownVertexReference (const Vertex& a)
+QString LDDocument::getDisplayName()
 {
-	if (isImplicit())
-		return;
+	if (not name().isEmpty())
+		return name();
 
-	auto it = m_vertices.find (a);
+	if (not defaultName().isEmpty())
+		return "[" + defaultName() + "]";
 
-	if (it == m_vertices.end())
-		m_vertices[a] = 1;
-	else
-		++it.value();
+	return tr ("untitled");
 }
 
 // =============================================================================
 //
-void LDDocument::removeKnownVertexReference (const Vertex& a)
+// Is any of the files at @paths open with changes that are not saved yet?
+// Geometry built from such a file does not match the file.
+//
+static bool hasUnsavedDependencies (const QStringList& paths)
 {
-	if (isImplicit())
-		return;
-
-	auto it = m_vertices.find (a);
-	assert (it != m_vertices.end());
+	for (LDDocumentPtr doc : g_explicitDocuments)
+	{
+		if (doc->hasUnsavedChanges() && paths.contains (doc->fullPath()))
+			return true;
+	}
 
-	// If there's no more references to a given vertex, it is to be removed.
-	if (--it.value() == 0)
-		m_vertices.erase (it);
+	return false;
 }
 
 // =============================================================================
 //
-bool safeToCloseAll()
+void LDDocument::initializeCachedData()
 {
-	for (LDDocumentPtr f : LDDocument::explicitDocuments())
+	if (not m_needsReCache || m_isFlattening)
+		return;
+
+	QVector<LDPolygon> polygons;
+	m_isFlattening = true;
+
+	// Possibly substitute with logoed studs:
+	// stud.dat -> stud-logo.dat
+	// stud2.dat -> stud-logo2.dat
+	LDDocumentPtr logoedStud;
+
+	if (cfg::useLogoStuds)
 	{
-		if (not f->isSafeToClose())
-			return false;
+		loadLogoedStuds();
+
+		if (name() == "stud.dat")
+			logoedStud = g_logoedStud;
+		elif (name() == "stud2.dat")
+			logoedStud = g_logoedStud2;
 	}
 
-	return true;
+	if (logoedStud != null)
+		logoedStud->inlinePolygons (polygons, g_identity, g_origin, mainColorIndex);
+	else
+	{
+		loadDeferredObjects();
+
+		// Flatten the geometry straight into the polygon buffer. Each document
+		// referenced is flattened only once, after that its polygons are just
+		// transformed into place.
+		for (LDObjectPtr obj : objects())
+		{
+			if (obj->type() == OBJ_Subfile)
+			{
+				LDSubfilePtr ref = obj.staticCast<LDSubfile>();
+				ref->inlinePolygons (polygons);
+			}
+			else
+			{
+				LDPolygon poly;
+
+				if (obj->getPolygon (poly))
+				{
+					poly.id = 0;
+					polygons << poly;
+				}
+			}
+		}
+	}
+
+	m_storedVertices.clear();
+
+	for (const LDPolygon& poly : polygons)
+	{
+		for (int i = 0; i < poly.numVertices(); ++i)
+			m_storedVertices << poly.vertices[i];
+	}
+
+	removeDuplicates (m_storedVertices);
+	m_polygonData = polygons;
+	m_needsReCache = false;
+	m_isFlattening = false;
+
+	// Implicit documents are library files, store their geometry so that
+	// they need not be parsed in the next session. Geometry that is built
+	// again after an edit is not stored: the entry is still valid as long as
+	// the files did not change, and the edits may not even be saved.
+	if (m_needsCacheStore && isImplicit() && cfg::useGeometryCache && not fullPath().isEmpty())
+	{
+		const QStringList dependencies = geometryDependencies();
+		m_needsCacheStore = false;
+
+		if (not hasUnsavedDependencies (dependencies))
+		{
+			// Writing the entry is left to the thread pool. The arguments are
+			// copies, so the document is free to change meanwhile.
+			QtConcurrent::run (LDGeometryCache::store, LDGeometryCache::currentLocation(),
+				fullPath(), m_polygonData, m_storedVertices, dependencies);
+		}
+	}
 }
 
 // =============================================================================
 //
-void LDDocument::setObject (int idx, LDObjectPtr obj)
+// Sets the geometry of this document from the geometry cache. The objects are
+// left unparsed until loadDeferredObjects() is called.
+//
+void LDDocument::setCachedGeometry (const QVector<LDPolygon>& polygons,
+	const QList<Vertex>& vertices, const QStringList& dependencies)
 {
-	assert (idx >= 0 && idx < m_objects.size());
+	forgetGeometryDependencies();
+	m_polygonData = polygons;
+	m_storedVertices = vertices;
+	m_geometryDependencies = dependencies;
+	m_needsReCache = false;
+	m_hasDeferredObjects = true;
+	m_needsCacheStore = false;
 
-	// Mark this change to history
-	if (not m_history->isIgnoring())
+	for (const QString& dependency : m_geometryDependencies)
 	{
-		QString oldcode = getObject (idx)->asText();
-		QString newcode = obj->asText();
-		*m_history << new EditHistory (idx, oldcode, newcode);
+		if (dependency != fullPath())
+			g_cachedDependents[dependency] << this;
 	}
-
-	removeKnownVerticesOf (m_objects[idx]);
-	m_objects[idx]->deselect();
-	m_objects[idx]->setDocument (LDDocumentPtr());
-	obj->setDocument (this);
-	addKnownVerticesOf (obj);
-	g_win->R()->compileObject (obj);
-	m_objects[idx] = obj;
 }
 
 // =============================================================================
 //
-// Close all documents we don't need anymore
+// Drops the dependencies this document got from the geometry cache.
 //
-void LDDocument::closeUnused() {}
+void LDDocument::forgetGeometryDependencies()
+{
+	for (const QString& dependency : m_geometryDependencies)
+	{
+		auto it = g_cachedDependents.find (dependency);
+
+		if (it != g_cachedDependents.end())
+		{
+			it->remove (this);
+
+			if (it->isEmpty())
+				g_cachedDependents.erase (it);
+		}
+	}
+
+	m_geometryDependencies.clear();
+}
 
 // =============================================================================
 //
-LDObjectPtr LDDocument::getObject (int pos) const
+// Marks the flattened geometry of this document out of date after its contents
+// changed. The documents referencing this one, directly or through other
+// documents, are invalidated as well and their references are recompiled. So
+// are the documents from the geometry cache that were built from this one.
+//
+void LDDocument::invalidateGeometry()
 {
-	if (m_objects.size() <= pos)
-		return LDObjectPtr();
+	// If the geometry was never built since the last change, nothing can have
+	// been built from it either. This also cuts cyclic references.
+	if (m_needsReCache)
+		return;
 
-	return m_objects[pos];
+	m_needsReCache = true;
+	m_polygonData.clear();
+	m_storedVertices.clear();
+	forgetGeometryDependencies();
+
+	// Nothing is flattened here. The known vertices of the referring documents
+	// include the vertices of this one, so they are rebuilt when next needed,
+	// and the references are only staged for compilation. Further edits before
+	// then return early above.
+	for (LDSubfile* ref : m_references)
+	{
+		LDDocumentPtr doc = ref->document().toStrongRef();
+		doc->invalidateGeometry();
+		doc->invalidateKnownVertices();
+
+		if (g_win != null && not doc->isImplicit())
+			g_win->R()->compileObject (ref->self().toStrongRef());
+	}
+
+	// The cached documents parse their objects when their geometry is built
+	// again, after which their references track this document as usual.
+	if (not fullPath().isEmpty())
+	{
+		for (LDDocument* dependent : g_cachedDependents.value (fullPath()))
+			dependent->invalidateGeometry();
+	}
 }
 
 // =============================================================================
 //
-int LDDocument::getObjectCount() const
+void LDDocument::addReference (LDSubfile* ref)
 {
-	return objects().size();
+	m_references << ref;
 }
 
 // =============================================================================
 //
-bool LDDocument::hasUnsavedChanges() const
+void LDDocument::removeReference (LDSubfile* ref)
 {
-	return not isImplicit() && history()->position() != savePosition();
+	m_references.remove (ref);
 }
 
 // =============================================================================
 //
-QString LDDocument::getDisplayName()
+// Returns the paths of the files the inlined geometry of this document is built
+// from, this document's file included.
+//
+QStringList LDDocument::geometryDependencies()
 {
-	if (not name().isEmpty())
-		return name();
+	if (not m_geometryDependencies.isEmpty())
+		return m_geometryDependencies;
 
-	if (not defaultName().isEmpty())
-		return "[" + defaultName() + "]";
+	QStringList dependencies;
 
-	return tr ("untitled");
+	if (not fullPath().isEmpty())
+		dependencies << fullPath();
+
+	// Logoed studs replace the geometry of the regular ones
+	if (cfg::useLogoStuds)
+	{
+		loadLogoedStuds();
+
+		if (name() == "stud.dat" && g_logoedStud != null)
+			dependencies << g_logoedStud->geometryDependencies();
+		elif (name() == "stud2.dat" && g_logoedStud2 != null)
+			dependencies << g_logoedStud2->geometryDependencies();
+	}
+
+	// Cyclic references are cut like in initializeCachedData()
+	if (m_isFlattening)
+		return dependencies;
+
+	m_isFlattening = true;
+
+	for (LDObjectPtr obj : objects())
+	{
+		if (obj->type() != OBJ_Subfile)
+			continue;
+
+		for (const QString& dependency : obj.staticCast<LDSubfile>()->fileInfo()->geometryDependencies())
+		{
+			if (not dependencies.contains (dependency))
+				dependencies << dependency;
+		}
+	}
+
+	m_isFlattening = false;
+	return dependencies;
 }
 
 // =============================================================================
 //
-void LDDocument::initializeCachedData()
+// Parses the objects of a document whose geometry came from the geometry cache.
+//
+void LDDocument::loadDeferredObjects()
 {
-	if (not m_needsReCache)
+	if (not m_hasDeferredObjects)
 		return;
 
-	m_storedVertices.clear();
+	m_hasDeferredObjects = false;
+	QIODevice* fp = LDLibraryArchive::openFile (fullPath());
 
-	for (LDObjectPtr obj : inlineContents (true, true))
-	{
-		assert (obj->type() != OBJ_Subfile);
-		LDPolygon* data = obj->getPolygon();
+	if (fp == null)
+		return;
 
-		if (data != null)
-		{
-			m_polygonData << *data;
-			delete data;
-		}
+	// Whatever is being loaded, this is not the main file.
+	bool wasLoadingMainFile = g_loadingMainFile;
+	g_loadingMainFile = false;
+	int numWarnings;
+	bool ok;
+	LDObjectList objs = loadFileContents (fp, &numWarnings, &ok);
+	g_loadingMainFile = wasLoadingMainFile;
+	delete fp;
 
-		for (int i = 0; i < obj->numVertices(); ++i)
-			m_storedVertices << obj->vertex (i);
+	if (ok)
+	{
+		// The objects are what the cached geometry was built from, so adding
+		// them must not invalidate it.
+		const bool needsReCache = m_needsReCache;
+		m_needsReCache = true;
+		history()->setIgnoring (true);
+		addObjects (objs);
+		history()->setIgnoring (false);
+		m_needsReCache = needsReCache;
 	}
-
-	removeDuplicates (m_storedVertices);
-	m_needsReCache = false;
 }
 
 // =============================================================================
 //
-QList<LDPolygon> LDDocument::inlinePolygons()
+// Appends the flattened polygons of this document to @buffer, transformed by
+// @transform and @position. Polygons of the main color get @color instead.
+//
+void LDDocument::inlinePolygons (QVector<LDPolygon>& buffer, const Matrix& transform,
+	const Vertex& position, int color)
 {
+	if (m_isFlattening)
+	{
+		print (tr ("Warning: %1 references itself, ignoring the reference"), name());
+		return;
+	}
+
 	initializeCachedData();
-	return polygonData();
+	// Iterate through a const reference, so that the polygon data is not
+	// detached from the picking tree and the GL compiler that share it.
+	const QVector<LDPolygon>& polygons = m_polygonData;
+	buffer.reserve (buffer.size() + polygons.size());
+
+	for (LDPolygon poly : polygons)
+	{
+		for (int i = 0; i < poly.numVertices(); ++i)
+			poly.vertices[i].transform (transform, position);
+
+		if (poly.color == mainColorIndex)
+			poly.color = color;
+
+		buffer << poly;
+	}
 }
 
 // =============================================================================
@@ -1360,6 +3051,7 @@ LDObjectList LDDocument::inlineContents (bool deep, bool renderinline)
 			return g_logoedStud2->inlineContents (deep, renderinline);
 	}
 
+	loadDeferredObjects();
 	LDObjectList objs, objcache;
 
 	for (LDObjectPtr obj : objects())
@@ -1460,8 +3152,10 @@ void LDDocument::addToSelection (LDObjectPtr obj) // [protected]
 
 	assert (obj->document() == self());
 	m_sel << obj;
-	g_win->R()->compileObject (obj);
 	obj->setSelected (true);
+
+	if (g_win != null)
+		g_win->R()->compileObject (obj);
 }
 
 // =============================================================================
@@ -1473,8 +3167,10 @@ void LDDocument::removeFromSelection (LDObjectPtr obj) // [protected]
 
 	assert (obj->document() == self());
 	m_sel.removeOne (obj);
-	g_win->R()->compileObject (obj);
 	obj->setSelected (false);
+
+	if (g_win != null)
+		g_win->R()->compileObject (obj);
 }
 
 // =============================================================================
@@ -1498,12 +3194,14 @@ const LDObjectList& LDDocument::getSelection() const
 //
 void LDDocument::swapObjects (LDObjectPtr one, LDObjectPtr other)
 {
-	int a = m_objects.indexOf (one);
-	int b = m_objects.indexOf (other);
+	int a = indexOf (one.data());
+	int b = indexOf (other.data());
 	assert (a != b && a != -1 && b != -1);
 	m_objects[b] = one;
 	m_objects[a] = other;
-	addToHistory (new SwapHistory (one->id(), other->id()));
+	one->m_documentPosition = b;
+	other->m_documentPosition = a;
+	addToHistory (new SwapHistory (one->handle(), other->handle()));
 }
 
 // =============================================================================
@@ -1526,3 +3224,48 @@ QList<Vertex> LDDocument::inlineVertices()
 	initializeCachedData();
 	return m_storedVertices;
 }
+
+// =============================================================================
+//
+// Returns the tree over the flattened polygons of this document. It is built
+// again whenever the polygons have been replaced.
+//
+const LDPolygonBVH& LDDocument::polygonTree()
+{
+	initializeCachedData();
+
+	if (not m_polygonTree.isBuiltFrom (m_polygonData))
+		m_polygonTree.build (m_polygonData);
+
+	return m_polygonTree;
+}
+
+// =============================================================================
+//
+// Returns the ID of the object of this document nearest along @ray, or 0.
+//
+int LDDocument::pickObject (const LDPickRay& ray)
+{
+	if (m_pickTreeChanged)
+	{
+		m_pickTree.build (self().toStrongRef());
+		m_pickTreeChanged = false;
+	}
+
+	return m_pickTree.pick (ray);
+}
+
+// =============================================================================
+//
+// Returns the IDs of the objects of this document within @frustum.
+//
+QList<int> LDDocument::pickObjects (const LDPickFrustum& frustum)
+{
+	if (m_pickTreeChanged)
+	{
+		m_pickTree.build (self().toStrongRef());
+		m_pickTreeChanged = false;
+	}
+
+	return m_pickTree.pick (frustum);
+}
@@ -18,15 +18,24 @@
 
 #pragma once
 #include <QObject>
+#include <QSet>
+#include <QFutureWatcher>
+#include <QVector>
 #include "main.h"
 #include "ldObject.h"
 #include "editHistory.h"
 #include "glShared.h"
+#include "ldVertexIndex.h"
+#include "ldBVH.h"
 
 class History;
 class OpenProgressDialog;
 struct LDGLData;
 class GLCompiler;
+struct LDParseChunk;
+class LDFileBuffer;
+class QIODevice;
+class LDVertexStore;
 
 namespace LDPaths
 {
@@ -45,6 +54,7 @@ namespace LDPaths
 enum LDDocumentFlag
 {
 	DOCF_IsBeingDestroyed = (1 << 0),
+	DOCF_IsEmbedded = (1 << 1), // Embedded file of a multi-part document
 };
 
 Q_DECLARE_FLAGS (LDDocumentFlags, LDDocumentFlag)
@@ -60,24 +70,36 @@ Q_DECLARE_OPERATORS_FOR_FLAGS (LDDocumentFlags)
 // The default name is a placeholder, initially suggested name for a file. The
 // primitive generator uses this to give initial names to primitives.
 //
+// A multi-part document (MPD) bundles several files into one. The main model
+// becomes the document itself, mpdName being the name it has in the bundle.
+// The other embedded files are held as implicit documents named after their
+// files, so that references to them resolve without searching the library.
+// Embedded files are only visible to the multi-part document that holds them:
+// findDocument() does not return them, getDocument() finds them by name,
+// ignoring case, when the holding document is being loaded or is current.
+//
+// Huge documents can be loaded lazily: their plain comments are then kept as
+// raw lines of the file buffer and only parsed into objects when they are
+// accessed with getObject() or objects(). Everything else is parsed up front.
+// Code that only needs to know what a line is can peek at it with isRawLine()
+// and rawLineType() without parsing it.
+//
 class LDDocument : public QObject
 {
 public:
-	using KnownVertexMap = QMap<Vertex, int>;
-
 	PROPERTY (public,	QString,				name,			setName,			STOCK_WRITE)
-	PROPERTY (private,	LDObjectList,		objects, 		setObjects,			STOCK_WRITE)
 	PROPERTY (private,	LDObjectList,		cache, 			setCache,			STOCK_WRITE)
 	PROPERTY (private,	History*,			history,		setHistory,			STOCK_WRITE)
-	PROPERTY (private,	KnownVertexMap,		vertices,		setVertices,		STOCK_WRITE)
 	PROPERTY (public,	QString,				fullPath,		setFullPath,		STOCK_WRITE)
 	PROPERTY (public,	QString,				defaultName,	setDefaultName,		STOCK_WRITE)
 	PROPERTY (public,	bool,				isImplicit,		setImplicit,		CUSTOM_WRITE)
 	PROPERTY (public,	long,				savePosition,	setSavePosition,	STOCK_WRITE)
 	PROPERTY (public,	int,				tabIndex,		setTabIndex,		STOCK_WRITE)
-	PROPERTY (public,	QList<LDPolygon>,	polygonData,	setPolygonData,		STOCK_WRITE)
+	PROPERTY (public,	QVector<LDPolygon>,	polygonData,	setPolygonData,		STOCK_WRITE)
 	PROPERTY (private,	LDDocumentFlags,	flags,			setFlags,			STOCK_WRITE)
 	PROPERTY (private,	LDDocumentWeakPtr,	self,			setSelf,			STOCK_WRITE)
+	PROPERTY (public,	QString,				mpdName,		setMpdName,			STOCK_WRITE)
+	PROPERTY (public,	QList<LDDocumentPtr>, embeddedDocuments, setEmbeddedDocuments, CUSTOM_WRITE)
 
 public:
 	LDDocument(LDDocumentPtr* selfptr);
@@ -94,17 +116,44 @@ public:
 	LDObjectList inlineContents (bool deep, bool renderinline);
 	void insertObj (int pos, LDObjectPtr obj);
 	int getObjectCount() const;
-	LDObjectPtr getObject (int pos) const;
+	LDObjectPtr getObject (int pos);
+	const LDObjectList& objects();
+	bool isRawLine (int pos) const;
+	LDObjectType rawLineType (int pos, QString* text = null) const;
+	int indexOf (const LDObject* obj) const;
+	void setLazyContents (QIODevice* fp, LDFileBuffer* buffer, const LDObjectList& objs);
+
+	inline LDVertexStore* vertexStore() const
+	{
+		return m_vertexStore;
+	}
+
+	const LDVertexIndex& knownVertices();
+	void invalidateKnownVertices();
+
 	bool save (QString path = ""); // Saves this file to disk.
 	void swapObjects (LDObjectPtr one, LDObjectPtr other);
 	bool isSafeToClose(); // Perform safety checks. Do this before closing any files!
 	void setObject (int idx, LDObjectPtr obj);
-	QList<LDPolygon> inlinePolygons();
+	void inlinePolygons (QVector<LDPolygon>& buffer, const Matrix& transform,
+		const Vertex& position, int color);
 	void vertexChanged (const Vertex& a, const Vertex& b);
 	void addKnownVerticesOf(LDObjectPtr obj);
 	void removeKnownVerticesOf (LDObjectPtr sub);
 	QList<Vertex> inlineVertices();
+	const LDPolygonBVH& polygonTree();
+	int pickObject (const LDPickRay& ray);
+	QList<int> pickObjects (const LDPickFrustum& frustum);
 	void clear();
+	void setCachedGeometry (const QVector<LDPolygon>& polygons, const QList<Vertex>& vertices,
+		const QStringList& dependencies);
+	QStringList geometryDependencies();
+	void invalidateGeometry();
+
+	// Subfile references to this document. Only references that are in a
+	// document are tracked.
+	void addReference (LDSubfile* ref);
+	void removeReference (LDSubfile* ref);
 
 	inline LDDocument& operator<< (LDObjectPtr obj)
 	{
@@ -166,16 +215,62 @@ protected:
 	friend class GLRenderer;
 
 private:
+	LDObjectList			m_objects;
 	LDObjectList			m_sel;
 	LDGLData*				m_gldata;
+	LDVertexStore*			m_vertexStore;
 	QList<Vertex>			m_storedVertices;
+	LDVertexIndex			m_knownVertices;
+	bool					m_knownVerticesChanged;
+
+	// Picking trees: the flattened polygons of this document, built when
+	// first needed, and the objects of this document, rebuilt after the
+	// geometry of the objects has changed.
+	LDPolygonBVH			m_polygonTree;
+	LDObjectBVH				m_pickTree;
+	bool					m_pickTreeChanged;
+
+	// Objects know their own index in the document. The indices from
+	// m_firstUnnumbered onwards may be out of date after insertions and
+	// removals, and are renumbered the next time one of them is needed.
+	mutable int				m_firstUnnumbered;
 
 	// If set to true, next polygon inline of this document discards the
 	// stored polygon data and re-builds it.
 	bool					m_needsReCache;
 
+	// The subfile references to this document, i.e. the reverse edges of the
+	// document dependency graph. Used to invalidate dependent geometry.
+	QSet<LDSubfile*>		m_references;
+
+	// Set while the references of this document are being walked, so that
+	// cyclic references can be detected and cut.
+	bool					m_isFlattening;
+
+	// Set when the geometry was loaded from the geometry cache. The objects
+	// are then only parsed once something asks for them.
+	bool					m_hasDeferredObjects;
+	QStringList				m_geometryDependencies;
+
+	// Set as long as the geometry cache has no valid entry for this document,
+	// i.e. until the geometry is loaded from the cache or first stored there.
+	bool					m_needsCacheStore;
+
+	// Lazily loaded lines. m_objects holds null for every raw line and
+	// m_rawLines the line's index in m_lazyBuffer, or -1 for lines that are
+	// objects already. m_rawLines is empty if there are no raw lines.
+	QIODevice*				m_lazyFile;
+	LDFileBuffer*			m_lazyBuffer;
+	QVector<int>			m_rawLines;
+	int						m_numRawLines;
+
 	void addKnownVertexReference (const Vertex& a);
 	void removeKnownVertexReference (const Vertex& a);
+	void loadDeferredObjects();
+	void forgetGeometryDependencies();
+	LDObjectPtr materializeLine (int pos);
+	void releaseLazyContents();
+	void invalidateNumbering (int pos);
 };
 
 inline LDDocumentPtr getCurrentDocument()
@@ -189,7 +284,8 @@ void newFile();
 // Opens the given file as the main file. Everything is closed first.
 void openMainFile (QString path);
 
-// Finds an OpenFile by name or null if not open
+// Finds an OpenFile by name or null if not open. Embedded files of multi-part
+// documents are not considered.
 LDDocumentPtr findDocument (QString name);
 
 // Opens the given file and parses the LDraw code within. Returns a pointer
@@ -197,7 +293,7 @@ LDDocumentPtr findDocument (QString name);
 LDDocumentPtr openDocument (QString path, bool search, bool implicit, LDDocumentPtr fileToOverride = LDDocumentPtr());
 
 // Opens the given file and returns a pointer to it, potentially looking in /parts and /p
-QFile* openLDrawFile (QString relpath, bool subdirs, QString* pathpointer = null);
+QIODevice* openLDrawFile (QString relpath, bool subdirs, QString* pathpointer = null);
 
 // Close all open files, whether user-opened or subfile caches.
 void closeAll();
@@ -205,8 +301,10 @@ void closeAll();
 // Parses a string line containing an LDraw object and returns the object parsed.
 LDObjectPtr parseLine (QString line);
 
-// Retrieves the pointer to the given document by file name. Document is loaded
-// from file if necessary. Can return null if neither succeeds.
+// Retrieves the pointer to the given document by file name. Embedded files of
+// the multi-part document being loaded, or the current document otherwise, are
+// tried first. Document is loaded from file if necessary. Can return null if
+// neither succeeds.
 LDDocumentPtr getDocument (QString filename);
 
 // Re-caches all subfiles.
@@ -215,7 +313,7 @@ void reloadAllSubfiles();
 // Is it safe to close all files?
 bool safeToCloseAll();
 
-LDObjectList loadFileContents (QFile* f, int* numWarnings, bool* ok = null);
+LDObjectList loadFileContents (QIODevice* f, int* numWarnings, bool* ok = null);
 
 inline const LDObjectList& selection()
 {
@@ -227,6 +325,56 @@ void loadLogoedStuds();
 QString basename (QString path);
 QString dirname (QString path);
 
+// =============================================================================
+//
+// LDFileBuffer
+//
+// The contents of a file being loaded. The file is memory-mapped if possible
+// and read in with a single read otherwise. The line boundaries are found once
+// and lines are then handed out as views into the buffer, without the trailing
+// newline. The file must stay open for the lifetime of the buffer. Contents
+// that are in memory already, such as files from the library archive, are
+// used as they are.
+//
+// A buffer can also be a view of the lines [first, last) of another buffer,
+// which then needs to outlive the view.
+//
+// Line offsets are 64-bit since mapped files may be larger than 2 GiB. Single
+// lines are still limited to what fits in an int.
+//
+class LDFileBuffer
+{
+public:
+	LDFileBuffer (QIODevice* fp);
+	LDFileBuffer (const QByteArray& contents);
+	LDFileBuffer (const LDFileBuffer& buffer, int first, int last);
+	~LDFileBuffer();
+
+	int lineLength (int i) const;
+
+	inline const char* lineData (int i) const
+	{
+		return m_data + m_lineOffsets[i];
+	}
+
+	inline int numLines() const
+	{
+		return m_lineOffsets.size() - 1;
+	}
+
+private:
+	QFile*			m_file;
+	uchar*			m_map;
+	QByteArray		m_contents;
+	const char*		m_data;
+	qint64			m_size;
+	QVector<qint64>	m_lineOffsets;
+
+	void findLines();
+
+	Q_DISABLE_COPY (LDFileBuffer)
+};
+
 // =============================================================================
 //
 // LDFileLoader
@@ -235,6 +383,13 @@ QString dirname (QString path);
 // separate class so as to be able to do the work progressively through the
 // event loop, allowing the program to maintain responsivity during loading.
 //
+// In parallel mode, the lines are split into chunks which are parsed in the
+// thread pool. The objects are still created in the main thread in line order
+// so that object IDs and warnings come out the same as in a serial load.
+//
+// If comments are kept raw, plain comment lines are not parsed at all and a
+// null object stands in for each of them.
+//
 class LDFileLoader : public QObject
 {
 	Q_OBJECT
@@ -242,19 +397,35 @@ class LDFileLoader : public QObject
 	PROPERTY (private,	bool,			isDone,			setDone,			STOCK_WRITE)
 	PROPERTY (private,	int,			progress,		setProgress,		STOCK_WRITE)
 	PROPERTY (private,	bool,			isAborted,		setAborted,			STOCK_WRITE)
-	PROPERTY (public,	QStringList,	lines,			setLines,			STOCK_WRITE)
+	PROPERTY (public,	const LDFileBuffer*, buffer,	setBuffer,			STOCK_WRITE)
 	PROPERTY (public,	int*,			warnings,		setWarnings,		STOCK_WRITE)
 	PROPERTY (public,	bool,			isOnForeground,	setOnForeground,	STOCK_WRITE)
+	PROPERTY (public,	bool,			isParallel,		setParallel,		STOCK_WRITE)
+	PROPERTY (public,	bool,			keepsCommentsRaw, setKeepsCommentsRaw, STOCK_WRITE)
+
+	public:
+		LDFileLoader();
+		~LDFileLoader();
 
 	public slots:
 		void start();
 		void abort();
 
 	private:
-		OpenProgressDialog* dlg;
+		OpenProgressDialog*		dlg;
+		QList<LDParseChunk*>	m_chunks;
+		QFutureWatcher<void>	m_chunkWatcher;
+		int						m_pendingLine;
+
+		void	addParsedObject (int i, LDObjectPtr obj);
+		void	finishChunks();
+		bool	keepRawLine (int i);
+		int		parseLines (int i);
+		int		takeChunk (int i);
 
 	private slots:
 		void work (int i);
+		void resume();
 
 	signals:
 		void progressUpdate (int progress);
@@ -0,0 +1,173 @@
+/*
+ *  LDForge: LDraw parts authoring CAD
+ *  Copyright (C) 2013, 2014 Santeri Piippo
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cstdio>
+#include <cstring>
+#include <QCoreApplication>
+#include <QDir>
+#include "ldDocumentWriter.h"
+#include "ldDocument.h"
+#include "ldFormatter.h"
+
+#ifdef WIN32
+# include <windows.h>
+#else
+# include <unistd.h>
+#endif // WIN32
+
+// =============================================================================
+//
+LDDocumentWriter::LDDocumentWriter() :
+	m_length (0),
+	m_isOk (false) {}
+
+// =============================================================================
+//
+LDDocumentWriter::~LDDocumentWriter()
+{
+	// If the file was not committed, get rid of the temporary file.
+	if (m_file.isOpen())
+	{
+		m_file.close();
+		m_file.remove();
+	}
+}
+
+// =============================================================================
+//
+bool LDDocumentWriter::open (QString path)
+{
+	m_path = path;
+	m_file.setFileName (format ("%1.%2.tmp", path, long (QCoreApplication::applicationPid())));
+
+	// QFile's own buffering is not needed, we write whole blocks.
+	if (not m_file.open (QIODevice::WriteOnly | QIODevice::Unbuffered))
+		return false;
+
+	// Keep the permissions of the file being replaced
+	if (QFile::exists (path))
+		m_file.setPermissions (QFile::permissions (path));
+
+	m_buffer.resize (BlockSize);
+	m_length = 0;
+	m_isOk = true;
+	return true;
+}
+
+// =============================================================================
+//
+void LDDocumentWriter::flush()
+{
+	if (m_length > 0 && m_file.write (m_buffer.constData(), m_length) != m_length)
+		m_isOk = false;
+
+	m_length = 0;
+}
+
+// =============================================================================
+//
+void LDDocumentWriter::write (const char* data, int length)
+{
+	if (m_length + length > BlockSize)
+	{
+		flush();
+
+		// Too big to be buffered, write it straight out.
+		if (length > BlockSize)
+		{
+			if (m_file.write (data, length) != length)
+				m_isOk = false;
+
+			return;
+		}
+	}
+
+	memcpy (m_buffer.data() + m_length, data, length);
+	m_length += length;
+}
+
+// =============================================================================
+//
+void LDDocumentWriter::writeObject (LDObjectPtr obj)
+{
+	// Most objects can be formatted without going through QString.
+	LDLineFormatter line;
+
+	if (obj->formatText (line))
+	{
+		write (line.data(), line.length());
+
+		if (obj->type() == OBJ_Subfile)
+		{
+			QByteArray name = obj.staticCast<LDSubfile>()->fileInfo()->name().toUtf8();
+			write (name.constData(), name.size());
+		}
+	}
+	else
+	{
+		QByteArray text = obj->asText().toUtf8();
+		write (text.constData(), text.size());
+	}
+
+	write ("\r\n", 2);
+}
+
+// =============================================================================
+//
+void LDDocumentWriter::writeLine (const QString& line)
+{
+	QByteArray text = line.toUtf8();
+	write (text.constData(), text.size());
+	write ("\r\n", 2);
+}
+
+// =============================================================================
+//
+bool LDDocumentWriter::commit()
+{
+	if (not m_file.isOpen())
+		return false;
+
+	flush();
+
+	// Make sure the data is on the disk before the file is put in place.
+#ifndef WIN32
+	if (m_isOk && fsync (m_file.handle()) != 0)
+		m_isOk = false;
+#endif // WIN32
+
+	m_file.close();
+
+	if (m_isOk)
+	{
+#ifdef WIN32
+		QString source = QDir::toNativeSeparators (m_file.fileName());
+		QString destination = QDir::toNativeSeparators (m_path);
+		m_isOk = MoveFileExW ((const wchar_t*) source.utf16(), (const wchar_t*) destination.utf16(),
+			MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH);
+#else
+		m_isOk = (rename (QFile::encodeName (m_file.fileName()).constData(),
+			QFile::encodeName (m_path).constData()) == 0);
+#endif // WIN32
+	}
+
+	if (not m_isOk)
+		m_file.remove();
+
+	return m_isOk;
+}
@@ -0,0 +1,68 @@
+/*
+ *  LDForge: LDraw parts authoring CAD
+ *  Copyright (C) 2013, 2014 Santeri Piippo
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#include <QFile>
+#include "main.h"
+#include "ldObject.h"
+
+// =============================================================================
+//
+// LDDocumentWriter
+//
+// Writes LDraw code into a file. The lines are formatted straight into an
+// output buffer which is written out a block at a time, so that saving takes
+// a constant amount of memory no matter how large the document is. The file
+// is written under a temporary name and only renamed over the destination
+// once all of it is on the disk, so that the destination is never left half
+// written.
+//
+class LDDocumentWriter
+{
+public:
+	LDDocumentWriter();
+	~LDDocumentWriter();
+
+	// Starts writing a file to be saved as @path.
+	bool open (QString path);
+
+	// Writes the given object as a line. LDraw requires DOS line endings,
+	// so the line is terminated with \r\n.
+	void writeObject (LDObjectPtr obj);
+
+	// Writes a line of raw LDraw code.
+	void writeLine (const QString& line);
+
+	// Writes everything out and replaces the destination file. Returns false
+	// if anything went wrong, in which case the destination is left untouched.
+	bool commit();
+
+private:
+	enum { BlockSize = 64 * 1024 };
+
+	QString		m_path;
+	QFile		m_file;
+	QByteArray	m_buffer;
+	int			m_length;
+	bool		m_isOk;
+
+	void flush();
+	void write (const char* data, int length);
+
+	Q_DISABLE_COPY (LDDocumentWriter)
+};
@@ -0,0 +1,178 @@
+/*
+ *  LDForge: LDraw parts authoring CAD
+ *  Copyright (C) 2013, 2014 Santeri Piippo
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cmath>
+#include <cstring>
+#include "ldFormatter.h"
+
+// =============================================================================
+//
+// QString::number uses %g-style formatting with six significant digits. This
+// produces the same output for the plain decimal form, which is what LDraw
+// files practically always consist of. Numbers which need the exponent form or
+// are too close to a rounding tie to be rounded safely here are handed over to
+// QString::number.
+//
+int formatLDrawNumber (double value, char* buffer)
+{
+	static const double powersOfTen[] =
+	{
+		1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9,
+	};
+
+	double magnitude = fabs (value);
+
+	if (value == 0 && not std::signbit (value))
+	{
+		buffer[0] = '0';
+		return 1;
+	}
+
+	if (magnitude >= 1e-4 && magnitude < 1e6)
+	{
+		// Find the exponent and scale the number to six integer digits. The
+		// scaling is a single multiplication or division by an exact power of
+		// ten, so it's off by half an ulp at most.
+		int exponent = int (floor (log10 (magnitude)));
+		double scaled;
+
+		for (;;)
+		{
+			int shift = 5 - exponent;
+			scaled = (shift >= 0) ? magnitude * powersOfTen[shift] : magnitude / powersOfTen[-shift];
+
+			if (scaled >= 1e6)
+				++exponent;
+			elif (scaled < 1e5)
+				--exponent;
+			else
+				break;
+		}
+
+		double integral = floor (scaled);
+		double fraction = scaled - integral;
+
+		if (fabs (fraction - 0.5) > 1e-7)
+		{
+			int64 digits = int64 (integral) + (fraction > 0.5 ? 1 : 0);
+
+			if (digits == 1000000)
+			{
+				digits = 100000;
+				++exponent;
+			}
+
+			if (exponent < 6)
+			{
+				char text[6];
+				char* it = buffer;
+
+				for (int i = 5; i >= 0; --i)
+				{
+					text[i] = '0' + (digits % 10);
+					digits /= 10;
+				}
+
+				// Drop the trailing zeroes of the fractional part
+				int numDigits = 6;
+
+				while (numDigits > exponent + 1 && text[numDigits - 1] == '0')
+					--numDigits;
+
+				if (value < 0)
+					*it++ = '-';
+
+				if (exponent < 0)
+				{
+					*it++ = '0';
+					*it++ = '.';
+
+					for (int i = exponent + 1; i < 0; ++i)
+						*it++ = '0';
+
+					for (int i = 0; i < numDigits; ++i)
+						*it++ = text[i];
+				}
+				else
+				{
+					for (int i = 0; i < numDigits; ++i)
+					{
+						if (i == exponent + 1)
+							*it++ = '.';
+
+						*it++ = text[i];
+					}
+				}
+
+				return it - buffer;
+			}
+		}
+	}
+
+	QByteArray text = QString::number (value).toLatin1();
+	memcpy (buffer, text.constData(), text.size());
+	return text.size();
+}
+
+// =============================================================================
+//
+void LDLineFormatter::append (const char* text)
+{
+	int length = strlen (text);
+	assert (m_length + length <= Capacity);
+	memcpy (m_buffer + m_length, text, length);
+	m_length += length;
+}
+
+// =============================================================================
+//
+void LDLineFormatter::appendNumber (double value)
+{
+	assert (m_length + 33 <= Capacity);
+	m_buffer[m_length++] = ' ';
+	m_length += formatLDrawNumber (value, m_buffer + m_length);
+}
+
+// =============================================================================
+//
+void LDLineFormatter::appendVertex (const Vertex& vrt)
+{
+	appendNumber (vrt.x());
+	appendNumber (vrt.y());
+	appendNumber (vrt.z());
+}
+
+// =============================================================================
+//
+void LDLineFormatter::appendMatrix (const Matrix& matrix)
+{
+	for (int i = 0; i < 9; ++i)
+		appendNumber (matrix[i]);
+}
+
+// =============================================================================
+//
+void LDLineFormatter::appendColor (LDColor color)
+{
+	assert (m_length + 16 <= Capacity);
+
+	if (color.isDirect())
+		m_length += qsnprintf (m_buffer + m_length, 16, " 0x%X", uint (color.index()));
+	else
+		m_length += qsnprintf (m_buffer + m_length, 16, " %d", int (color.index()));
+}
@@ -0,0 +1,69 @@
+/*
+ *  LDForge: LDraw parts authoring CAD
+ *  Copyright (C) 2013, 2014 Santeri Piippo
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#include "main.h"
+#include "basics.h"
+#include "colors.h"
+
+//
+// Formats @value into @buffer the way QString::number (value) does, i.e. with
+// six significant digits and trailing zeroes dropped. This is the shortest
+// text that reads back as the same six-digit value. Common values are handled
+// without going through QString at all. @buffer must hold at least 32 bytes.
+// Returns the length of the result.
+//
+int formatLDrawNumber (double value, char* buffer);
+
+//
+// Builds a line of LDraw code in a fixed buffer, so that formatting an object
+// does not need any intermediate strings.
+//
+class LDLineFormatter
+{
+public:
+	enum { Capacity = 512 };
+
+	LDLineFormatter() :
+		m_length (0) {}
+
+	void append (const char* text);
+	void appendColor (LDColor color);
+	void appendMatrix (const Matrix& matrix);
+	void appendNumber (double value);
+	void appendVertex (const Vertex& vrt);
+
+	inline const char* data() const
+	{
+		return m_buffer;
+	}
+
+	inline int length() const
+	{
+		return m_length;
+	}
+
+	inline QString toString() const
+	{
+		return QString::fromLatin1 (m_buffer, m_length);
+	}
+
+private:
+	char	m_buffer[Capacity];
+	int		m_length;
+};
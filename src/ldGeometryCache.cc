@@ -0,0 +1,304 @@
+/*
+ *  LDForge: LDraw parts authoring CAD
+ *  Copyright (C) 2013, 2014 Santeri Piippo
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cstring>
+#include <QAtomicInt>
+#include <QCoreApplication>
+#include <QCryptographicHash>
+#include <QDesktopServices>
+#include <QDateTime>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include "ldGeometryCache.h"
+#include "ldLibraryArchive.h"
+#include "configuration.h"
+
+EXTERN_CFGENTRY (Bool, useLogoStuds)
+
+// Bump this whenever the layout of the entries changes
+static const quint32 g_cacheVersion = 1;
+
+//
+// An entry consists of the header, the dependency table, the polygons and the
+// vertices, in that order. Dependency paths are UTF-8 and padded to 8 bytes.
+//
+struct CacheHeader
+{
+	char		magic[4];
+	quint32		version;
+	quint32		numDependencies;
+	quint32		numPolygons;
+	quint32		numVertices;
+	quint32		dependencyTableSize;
+};
+
+struct CachedDependency
+{
+	qint64		modified;
+	qint64		size;
+	quint32		pathLength;
+	quint32		padding;
+};
+
+struct CachedPolygon
+{
+	qint32		num;
+	qint32		color;
+	float		coordinates[12];
+};
+
+struct CachedVertex
+{
+	float		coordinates[3];
+};
+
+// =============================================================================
+//
+LDGeometryCache::Location LDGeometryCache::currentLocation()
+{
+	Location location;
+	location.directory = QDesktopServices::storageLocation (QDesktopServices::CacheLocation)
+		+ DIRSLASH "geometry";
+	location.useLogoStuds = cfg::useLogoStuds;
+	return location;
+}
+
+// =============================================================================
+//
+// The geometry depends on whether the studs are logoed, so both variants get
+// their own entries.
+//
+static QString cacheFilePath (const LDGeometryCache::Location& location, QString path)
+{
+	QByteArray key = QFileInfo (path).absoluteFilePath().toUtf8();
+
+	if (location.useLogoStuds)
+		key += ":logo";
+
+	QByteArray hash = QCryptographicHash::hash (key, QCryptographicHash::Md5).toHex();
+	return format ("%1" DIRSLASH "%2.bin", location.directory, QString::fromLatin1 (hash));
+}
+
+// =============================================================================
+//
+// Files in the library archive have no time stamps of their own, they change
+// when the archive does.
+//
+static QFileInfo dependencyInfo (const QString& path)
+{
+	LDLibraryArchive* archive = LDLibraryArchive::instance();
+
+	if (archive != null && archive->contains (path))
+		return QFileInfo (archive->path());
+
+	return QFileInfo (path);
+}
+
+// =============================================================================
+//
+static inline int paddedLength (int length)
+{
+	return (length + 7) & ~7;
+}
+
+// =============================================================================
+//
+bool LDGeometryCache::load (const Location& location, QString path, QVector<LDPolygon>& polygons,
+	QList<Vertex>& vertices, QStringList& dependencies)
+{
+	QFile fp (cacheFilePath (location, path));
+
+	if (not fp.open (QIODevice::ReadOnly) || fp.size() < qint64 (sizeof (CacheHeader)))
+		return false;
+
+	const qint64 size = fp.size();
+	const uchar* data = fp.map (0, size);
+
+	if (data == null)
+		return false;
+
+	const uchar* end = data + size;
+	const CacheHeader* header = reinterpret_cast<const CacheHeader*> (data);
+	const uchar* it = data + sizeof (CacheHeader);
+	bool ok = false;
+
+	// Validate the header and that the sizes add up
+	if (memcmp (header->magic, "LDGC", 4) == 0
+		&& header->version == g_cacheVersion
+		&& qint64 (sizeof (CacheHeader)) + header->dependencyTableSize
+			+ qint64 (header->numPolygons) * sizeof (CachedPolygon)
+			+ qint64 (header->numVertices) * sizeof (CachedVertex) == size)
+	{
+		const uchar* tableEnd = it + header->dependencyTableSize;
+		QStringList paths;
+		ok = true;
+
+		// Check that none of the files the geometry was built from has changed.
+		for (quint32 i = 0; i < header->numDependencies && ok; ++i)
+		{
+			const CachedDependency* dependency = reinterpret_cast<const CachedDependency*> (it);
+
+			if (it + sizeof (CachedDependency) > tableEnd
+				|| it + sizeof (CachedDependency) + dependency->pathLength > tableEnd)
+			{
+				ok = false;
+				break;
+			}
+
+			QString dependencyPath = QString::fromUtf8 (
+				reinterpret_cast<const char*> (it + sizeof (CachedDependency)), dependency->pathLength);
+			QFileInfo info = dependencyInfo (dependencyPath);
+
+			if (not info.exists()
+				|| info.size() != dependency->size
+				|| info.lastModified().toMSecsSinceEpoch() != dependency->modified)
+			{
+				ok = false;
+			}
+
+			paths << dependencyPath;
+			it += sizeof (CachedDependency) + paddedLength (dependency->pathLength);
+		}
+
+		if (ok)
+		{
+			it = tableEnd;
+			const CachedPolygon* cachedPolygons = reinterpret_cast<const CachedPolygon*> (it);
+			const CachedVertex* cachedVertices = reinterpret_cast<const CachedVertex*> (
+				it + header->numPolygons * sizeof (CachedPolygon));
+			assert (reinterpret_cast<const uchar*> (cachedVertices + header->numVertices) == end);
+
+			polygons.clear();
+			vertices.clear();
+			polygons.reserve (header->numPolygons);
+			vertices.reserve (header->numVertices);
+
+			for (quint32 i = 0; i < header->numPolygons; ++i)
+			{
+				const CachedPolygon& cached = cachedPolygons[i];
+				LDPolygon poly;
+				poly.num = cached.num;
+				poly.color = cached.color;
+				poly.id = 0;
+
+				for (int j = 0; j < 4; ++j)
+				{
+					const float* coordinates = &cached.coordinates[j * 3];
+					poly.vertices[j] = Vertex (coordinates[0], coordinates[1], coordinates[2]);
+				}
+
+				polygons << poly;
+			}
+
+			for (quint32 i = 0; i < header->numVertices; ++i)
+			{
+				const float* coordinates = cachedVertices[i].coordinates;
+				vertices << Vertex (coordinates[0], coordinates[1], coordinates[2]);
+			}
+
+			dependencies = paths;
+		}
+	}
+
+	fp.unmap (const_cast<uchar*> (data));
+	return ok;
+}
+
+// =============================================================================
+//
+void LDGeometryCache::store (const Location& location, QString path,
+	const QVector<LDPolygon>& polygons, const QList<Vertex>& vertices, const QStringList& dependencies)
+{
+	QByteArray table;
+
+	for (const QString& dependencyPath : dependencies)
+	{
+		QFileInfo info = dependencyInfo (dependencyPath);
+
+		// Don't cache anything that we couldn't validate later
+		if (not info.exists())
+			return;
+
+		QByteArray encodedPath = QFileInfo (dependencyPath).absoluteFilePath().toUtf8();
+		CachedDependency dependency;
+		dependency.modified = info.lastModified().toMSecsSinceEpoch();
+		dependency.size = info.size();
+		dependency.pathLength = encodedPath.size();
+		dependency.padding = 0;
+		table.append (reinterpret_cast<const char*> (&dependency), sizeof dependency);
+		table.append (encodedPath);
+		table.append (QByteArray (paddedLength (encodedPath.size()) - encodedPath.size(), '\0'));
+	}
+
+	CacheHeader header;
+	memcpy (header.magic, "LDGC", 4);
+	header.version = g_cacheVersion;
+	header.numDependencies = dependencies.size();
+	header.numPolygons = polygons.size();
+	header.numVertices = vertices.size();
+	header.dependencyTableSize = table.size();
+
+	QByteArray contents;
+	contents.reserve (sizeof header + table.size() + polygons.size() * sizeof (CachedPolygon)
+		+ vertices.size() * sizeof (CachedVertex));
+	contents.append (reinterpret_cast<const char*> (&header), sizeof header);
+	contents.append (table);
+
+	for (const LDPolygon& poly : polygons)
+	{
+		CachedPolygon cached;
+		cached.num = poly.num;
+		cached.color = poly.color;
+
+		for (int i = 0; i < 4; ++i)
+		{
+			cached.coordinates[i * 3 + 0] = poly.vertices[i].x();
+			cached.coordinates[i * 3 + 1] = poly.vertices[i].y();
+			cached.coordinates[i * 3 + 2] = poly.vertices[i].z();
+		}
+
+		contents.append (reinterpret_cast<const char*> (&cached), sizeof cached);
+	}
+
+	for (const Vertex& vrt : vertices)
+	{
+		CachedVertex cached = {{ float (vrt.x()), float (vrt.y()), float (vrt.z()) }};
+		contents.append (reinterpret_cast<const char*> (&cached), sizeof cached);
+	}
+
+	// Write into a temporary file first so that a reader never sees a partial entry.
+	QString filePath = cacheFilePath (location, path);
+	static QAtomicInt tempCounter;
+	QString tempPath = format ("%1.%2.%3.tmp", filePath, long (QCoreApplication::applicationPid()),
+		int (tempCounter.fetchAndAddRelaxed (1)));
+	QDir().mkpath (location.directory);
+	QFile fp (tempPath);
+
+	if (not fp.open (QIODevice::WriteOnly) || fp.write (contents) != contents.size())
+	{
+		fp.remove();
+		return;
+	}
+
+	fp.close();
+	QFile::remove (filePath);
+
+	if (not QFile::rename (tempPath, filePath))
+		QFile::remove (tempPath);
+}
@@ -0,0 +1,58 @@
+/*
+ *  LDForge: LDraw parts authoring CAD
+ *  Copyright (C) 2013, 2014 Santeri Piippo
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#include <QStringList>
+#include <QVector>
+#include "main.h"
+#include "glShared.h"
+
+//
+// The geometry cache stores the flattened polygons and vertices of implicit
+// documents on disk, so that library parts do not need to be parsed again in
+// every session. An entry records the files its geometry was built from with
+// their sizes and modification times, and is only valid as long as none of
+// them changed. Entries are written in a flat binary format which is read
+// straight from a memory-mapped file.
+//
+namespace LDGeometryCache
+{
+	// Where the entries are stored and which variant of the geometry they
+	// hold. The location is resolved in the main thread, after that it is
+	// plain data which can be handed to worker threads.
+	struct Location
+	{
+		QString		directory;
+		bool		useLogoStuds;
+	};
+
+	// Returns the location of the cache for the current configuration. This
+	// must be called in the main thread.
+	Location currentLocation();
+
+	// Loads the cached geometry of the file at @path. Returns false if there
+	// is no valid entry for it. This may be called in any thread.
+	bool load (const Location& location, QString path, QVector<LDPolygon>& polygons,
+		QList<Vertex>& vertices, QStringList& dependencies);
+
+	// Stores the geometry of the file at @path. @dependencies lists the files
+	// the geometry was built from, the file itself included. Like load(), this
+	// may be called in any thread.
+	void store (const Location& location, QString path, const QVector<LDPolygon>& polygons,
+		const QList<Vertex>& vertices, const QStringList& dependencies);
+}
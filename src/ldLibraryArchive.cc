@@ -0,0 +1,388 @@
+/*
+ *  LDForge: LDraw parts authoring CAD
+ *  Copyright (C) 2013, 2014 Santeri Piippo
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cstring>
+#include <QBuffer>
+#include <QDir>
+#include <QFileInfo>
+#include <QtEndian>
+#include <zlib.h>
+#include "ldLibraryArchive.h"
+#include "configuration.h"
+
+CFGENTRY (Int, archiveCacheSize, 32)
+
+static LDLibraryArchive* g_archive = null;
+
+// Signatures of the zip records we need
+static const quint32 g_endOfDirectorySignature = 0x06054B50;
+static const quint32 g_directoryEntrySignature = 0x02014B50;
+static const quint32 g_localHeaderSignature = 0x04034B50;
+
+// Sizes of the fixed parts of these records
+static const int g_endOfDirectorySize = 22;
+static const int g_directoryEntrySize = 46;
+static const int g_localHeaderSize = 30;
+
+// =============================================================================
+//
+static inline quint16 read16 (const uchar* data)
+{
+	return qFromLittleEndian<quint16> (data);
+}
+
+// =============================================================================
+//
+static inline quint32 read32 (const uchar* data)
+{
+	return qFromLittleEndian<quint32> (data);
+}
+
+// =============================================================================
+//
+LDLibraryArchive::LDLibraryArchive (QString path) :
+	m_path (QDir::fromNativeSeparators (QFileInfo (path).absoluteFilePath())),
+	m_file (path),
+	m_data (null),
+	m_size (0)
+{
+	m_cache.setMaxCost (qMax (0, int (cfg::archiveCacheSize)) * 1024 * 1024);
+}
+
+// =============================================================================
+//
+LDLibraryArchive::~LDLibraryArchive()
+{
+	if (m_data != null && m_contents.isEmpty())
+		m_file.unmap (const_cast<uchar*> (m_data));
+}
+
+// =============================================================================
+//
+LDLibraryArchive* LDLibraryArchive::instance() // [static]
+{
+	return g_archive;
+}
+
+// =============================================================================
+//
+bool LDLibraryArchive::open (QString path) // [static]
+{
+	LDLibraryArchive* archive = new LDLibraryArchive (path);
+
+	if (not archive->readDirectory())
+	{
+		delete archive;
+		return false;
+	}
+
+	close();
+	g_archive = archive;
+	return true;
+}
+
+// =============================================================================
+//
+void LDLibraryArchive::close() // [static]
+{
+	delete g_archive;
+	g_archive = null;
+}
+
+// =============================================================================
+//
+QIODevice* LDLibraryArchive::openFile (QString path) // [static]
+{
+	if (g_archive != null && g_archive->contains (path))
+	{
+		bool ok;
+		QByteArray contents = g_archive->read (path, &ok);
+
+		if (not ok)
+			return null;
+
+		QBuffer* buffer = new QBuffer;
+		buffer->setData (contents);
+		buffer->open (QIODevice::ReadOnly);
+		return buffer;
+	}
+
+	QFile* fp = new QFile (path);
+
+	if (fp->open (QIODevice::ReadOnly))
+		return fp;
+
+	delete fp;
+	return null;
+}
+
+// =============================================================================
+//
+// Maps the archive in and reads its central directory. Zip64 archives are not
+// supported, the library is nowhere near 4 GiB.
+//
+bool LDLibraryArchive::readDirectory()
+{
+	if (not m_file.open (QIODevice::ReadOnly))
+		return false;
+
+	m_size = m_file.size();
+	m_data = m_file.map (0, m_size);
+
+	if (m_data == null)
+	{
+		m_contents = m_file.readAll();
+		m_data = reinterpret_cast<const uchar*> (m_contents.constData());
+		m_size = m_contents.size();
+	}
+
+	if (m_size < g_endOfDirectorySize)
+		return false;
+
+	// The end of central directory record is at the end of the archive,
+	// followed by an archive comment of at most 64 KiB.
+	const uchar* end = null;
+
+	for (qint64 i = m_size - g_endOfDirectorySize; i >= qMax (qint64 (0), m_size - g_endOfDirectorySize - 0xFFFF); --i)
+	{
+		if (read32 (m_data + i) == g_endOfDirectorySignature)
+		{
+			end = m_data + i;
+			break;
+		}
+	}
+
+	if (end == null)
+		return false;
+
+	const int numEntries = read16 (end + 10);
+	const quint32 directorySize = read32 (end + 12);
+	const quint32 directoryOffset = read32 (end + 16);
+
+	if (qint64 (directoryOffset) + directorySize > m_size)
+		return false;
+
+	const uchar* it = m_data + directoryOffset;
+	const uchar* directoryEnd = it + directorySize;
+	int rootLength = -1;
+
+	for (int i = 0; i < numEntries; ++i)
+	{
+		if (it + g_directoryEntrySize > directoryEnd || read32 (it) != g_directoryEntrySignature)
+			return false;
+
+		const quint16 flags = read16 (it + 8);
+		const int nameLength = read16 (it + 28);
+		const int recordLength = g_directoryEntrySize + nameLength + read16 (it + 30) + read16 (it + 32);
+
+		if (it + recordLength > directoryEnd)
+			return false;
+
+		Entry entry;
+		entry.method = read16 (it + 10);
+		entry.crc = read32 (it + 16);
+		entry.compressedSize = read32 (it + 20);
+		entry.size = read32 (it + 24);
+		entry.offset = read32 (it + 42);
+		entry.name = QString::fromUtf8 (reinterpret_cast<const char*> (it + g_directoryEntrySize), nameLength);
+		it += recordLength;
+
+		// Skip directories and encrypted files
+		if (entry.name.endsWith ("/") || (flags & 1))
+			continue;
+
+		QString key = entry.name.toLower();
+		m_entries[key] = entry;
+
+		// The library root is where LDConfig.ldr is, usually ldraw/
+		if (key == "ldconfig.ldr" || key.endsWith ("/ldconfig.ldr"))
+		{
+			int length = key.length() - strlen ("ldconfig.ldr");
+
+			if (rootLength == -1 || length < rootLength)
+			{
+				rootLength = length;
+				m_root = key.left (length);
+			}
+		}
+	}
+
+	if (rootLength == -1)
+		return false;
+
+	// The library has to have its parts and primitives
+	bool hasParts = false;
+	bool hasPrimitives = false;
+
+	for (const QString& key : m_entries.keys())
+	{
+		hasParts |= key.startsWith (m_root + "parts/");
+		hasPrimitives |= key.startsWith (m_root + "p/");
+	}
+
+	return hasParts && hasPrimitives;
+}
+
+// =============================================================================
+//
+// Turns the path of a file in the archive into its key in m_entries. Returns
+// an empty string if the path is not inside the archive.
+//
+QString LDLibraryArchive::memberKey (QString path) const
+{
+	path = QDir::fromNativeSeparators (path);
+
+	if (not path.startsWith (m_path + "/"))
+		return "";
+
+	return path.mid (m_path.length() + 1).toLower();
+}
+
+// =============================================================================
+//
+bool LDLibraryArchive::contains (QString path) const
+{
+	return not memberKey (path).isEmpty();
+}
+
+// =============================================================================
+//
+QString LDLibraryArchive::find (QString relpath) const
+{
+	QString key = m_root + relpath.replace ("\\", "/").toLower();
+	auto it = m_entries.find (key);
+
+	if (it == m_entries.end())
+		return "";
+
+	return QDir::toNativeSeparators (m_path + "/" + it->name);
+}
+
+// =============================================================================
+//
+QStringList LDLibraryArchive::files (QString path) const
+{
+	QString prefix = memberKey (path);
+	QStringList result;
+
+	if (prefix.isEmpty())
+		return result;
+
+	if (not prefix.endsWith ("/"))
+		prefix += "/";
+
+	for (auto it = m_entries.begin(); it != m_entries.end(); ++it)
+	{
+		if (it.key().startsWith (prefix))
+			result << QDir::toNativeSeparators (m_path + "/" + it->name);
+	}
+
+	return result;
+}
+
+// =============================================================================
+//
+QByteArray LDLibraryArchive::read (QString path, bool* ok)
+{
+	QString key = memberKey (path);
+
+	if (ok != null)
+		*ok = true;
+
+	{
+		QMutexLocker locker (&m_mutex);
+		QByteArray* cached = m_cache.object (key);
+
+		if (cached != null)
+			return *cached;
+	}
+
+	auto it = m_entries.find (key);
+	QByteArray contents;
+
+	if (it == m_entries.end() || not inflateEntry (*it, contents))
+	{
+		if (ok != null)
+			*ok = false;
+
+		return QByteArray();
+	}
+
+	// Entries bigger than the whole budget are not cached, QCache takes
+	// care of that.
+	QMutexLocker locker (&m_mutex);
+	m_cache.insert (key, new QByteArray (contents), contents.size());
+	return contents;
+}
+
+// =============================================================================
+//
+// Reads the data of @entry into @contents, inflating it if it is compressed.
+// The contents are checked against the size and CRC of the entry.
+//
+bool LDLibraryArchive::inflateEntry (const Entry& entry, QByteArray& contents) const
+{
+	if (qint64 (entry.offset) + g_localHeaderSize > m_size)
+		return false;
+
+	const uchar* header = m_data + entry.offset;
+
+	if (read32 (header) != g_localHeaderSignature)
+		return false;
+
+	// The name and extra field lengths of the local header may differ from
+	// those in the central directory.
+	qint64 dataOffset = qint64 (entry.offset) + g_localHeaderSize + read16 (header + 26) + read16 (header + 28);
+
+	if (dataOffset + entry.compressedSize > m_size)
+		return false;
+
+	const uchar* data = m_data + dataOffset;
+	contents.resize (entry.size);
+
+	if (entry.method == 0)
+	{
+		if (entry.compressedSize != entry.size)
+			return false;
+
+		memcpy (contents.data(), data, entry.size);
+	}
+	elif (entry.method == 8)
+	{
+		// Zip members are raw deflate streams without the zlib header
+		z_stream stream;
+		memset (&stream, 0, sizeof stream);
+
+		if (inflateInit2 (&stream, -MAX_WBITS) != Z_OK)
+			return false;
+
+		stream.next_in = const_cast<Bytef*> (data);
+		stream.avail_in = entry.compressedSize;
+		stream.next_out = reinterpret_cast<Bytef*> (contents.data());
+		stream.avail_out = entry.size;
+		int result = inflate (&stream, Z_FINISH);
+		inflateEnd (&stream);
+
+		if (result != Z_STREAM_END || stream.total_out != entry.size)
+			return false;
+	}
+	else
+		return false;
+
+	return crc32 (0, reinterpret_cast<const Bytef*> (contents.constData()), entry.size) == entry.crc;
+}
@@ -0,0 +1,109 @@
+/*
+ *  LDForge: LDraw parts authoring CAD
+ *  Copyright (C) 2013, 2014 Santeri Piippo
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#include <QByteArray>
+#include <QCache>
+#include <QFile>
+#include <QHash>
+#include <QMutex>
+#include <QStringList>
+#include "main.h"
+
+class QIODevice;
+
+//
+// The LDraw library can be used straight from a zip archive, such as the
+// official complete.zip. The central directory of the archive is read in once
+// into a hash table keyed by the lowercased member names, and members are
+// inflated when they are read. The inflated contents are kept in a cache whose
+// size is limited by archiveCacheSize.
+//
+// Files in the archive are addressed with paths that continue past the archive
+// path, e.g. /opt/complete.zip/ldraw/parts/3001.dat, so that they fit in with
+// the paths of regular files.
+//
+// The archive is thread-safe.
+//
+class LDLibraryArchive
+{
+public:
+	~LDLibraryArchive();
+
+	// Finds the file at @relpath under the library root of the archive,
+	// ignoring case. Returns the path of the file or an empty string.
+	QString find (QString relpath) const;
+
+	// Returns the paths of the files under the directory @path
+	QStringList files (QString path) const;
+
+	// Is @path the path of a file or a directory inside this archive?
+	bool contains (QString path) const;
+
+	// Returns the contents of the file at @path. If the file cannot be read,
+	// returns an empty array and sets @ok to false.
+	QByteArray read (QString path, bool* ok = null);
+
+	inline const QString& path() const
+	{
+		return m_path;
+	}
+
+	// Returns the library archive in use, or null if the library is a
+	// regular directory.
+	static LDLibraryArchive* instance();
+
+	// Starts using the archive at @path as the library. Returns false if it
+	// is not a zip archive of the LDraw library.
+	static bool open (QString path);
+
+	// Goes back to using a library directory
+	static void close();
+
+	// Opens the file at @path for reading, whether it is in the library
+	// archive or on the disk. Returns null on failure.
+	static QIODevice* openFile (QString path);
+
+private:
+	struct Entry
+	{
+		QString		name;
+		quint32		offset;
+		quint32		compressedSize;
+		quint32		size;
+		quint32		crc;
+		quint16		method;
+	};
+
+	QString					m_path;
+	QFile					m_file;
+	QByteArray				m_contents;
+	const uchar*			m_data;
+	qint64					m_size;
+	QString					m_root;
+	QHash<QString, Entry>	m_entries;
+	QCache<QString, QByteArray>	m_cache;
+	QMutex					m_mutex;
+
+	LDLibraryArchive (QString path);
+	bool readDirectory();
+	QString memberKey (QString path) const;
+	bool inflateEntry (const Entry& entry, QByteArray& contents) const;
+
+	Q_DISABLE_COPY (LDLibraryArchive)
+};
@@ -0,0 +1,202 @@
+/*
+ *  LDForge: LDraw parts authoring CAD
+ *  Copyright (C) 2013, 2014 Santeri Piippo
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <QApplication>
+#include <QDir>
+#include <QFile>
+#include <QFileSystemWatcher>
+#include <QRegExp>
+#include "ldLibraryIndex.h"
+
+// =============================================================================
+//
+LDLibraryIndex::LDLibraryIndex() :
+	m_watcher (null)
+{
+	// Look-ups may come from worker threads. The watcher needs an event loop.
+	moveToThread (qApp->thread());
+}
+
+// =============================================================================
+//
+LDLibraryIndex* LDLibraryIndex::instance() // [static]
+{
+	static QMutex mutex;
+	static LDLibraryIndex* index = null;
+	QMutexLocker locker (&mutex);
+
+	if (index == null)
+		index = new LDLibraryIndex;
+
+	return index;
+}
+
+// =============================================================================
+//
+// Returns the index of the given directory, reading it in if necessary. Returns
+// null if the directory does not exist. The returned pointer is only valid until
+// the next call, and the mutex must be held.
+//
+const LDLibraryIndex::Directory* LDLibraryIndex::getDirectory (const QString& path)
+{
+	auto it = m_directories.find (path);
+
+	if (it != m_directories.end())
+		return it->exists ? &*it : null;
+
+	QDir qdir (path);
+	Directory dir;
+	dir.exists = qdir.exists();
+
+	if (not dir.exists)
+	{
+		QString parent = path;
+
+		while (not QDir (parent).exists())
+		{
+			QString grandparent = QFileInfo (parent).path();
+
+			if (grandparent == parent)
+				break;
+
+			parent = grandparent;
+		}
+
+		if (QDir (parent).exists())
+			watchDirectory (parent);
+
+		m_directories.insert (path, dir);
+		return null;
+	}
+
+	for (const QFileInfo& info : qdir.entryInfoList (QDir::Files | QDir::Dirs | QDir::Hidden | QDir::NoDotAndDotDot))
+	{
+		QHash<QString, QString>& names = info.isDir() ? dir.subdirectories : dir.files;
+		QString name = info.fileName();
+		QString key = name.toLower();
+
+		// If two names only differ by case, prefer the lowercase one, since
+		// that's what LDraw references are expected to use.
+		if (not names.contains (key) || name == key)
+			names[key] = name;
+	}
+
+	watchDirectory (path);
+	return &*m_directories.insert (path, dir);
+}
+
+// =============================================================================
+//
+// Starts watching the given directory for changes. The watcher lives in the
+// main thread, so the directory is queued and added to it from there. The mutex
+// must be held.
+//
+void LDLibraryIndex::watchDirectory (const QString& path)
+{
+	m_pendingWatches << path;
+
+	if (m_pendingWatches.size() == 1)
+		QMetaObject::invokeMethod (this, "watchPendingDirectories", Qt::QueuedConnection);
+}
+
+// =============================================================================
+//
+QString LDLibraryIndex::find (QString directory, QString relpath)
+{
+	if (directory.isEmpty())
+		return "";
+
+	QStringList components = relpath.split (QRegExp ("[/\\\\]"), QString::SkipEmptyParts);
+
+	if (components.isEmpty())
+		return "";
+
+	// The index doesn't know about . and .., let the file system deal with those.
+	if (components.contains (".") || components.contains (".."))
+	{
+		QString path = directory + "/" + relpath;
+		return QFile::exists (path) ? path : "";
+	}
+
+	QMutexLocker locker (&m_mutex);
+	QString path = QDir::cleanPath (directory);
+
+	for (int i = 0; i < components.size(); ++i)
+	{
+		const Directory* dir = getDirectory (path);
+
+		if (dir == null)
+			return "";
+
+		const QHash<QString, QString>& names = (i == components.size() - 1) ?
+			dir->files : dir->subdirectories;
+		QString name = names.value (components[i].toLower());
+
+		if (name.isEmpty())
+			return "";
+
+		if (not path.endsWith ("/"))
+			path += "/";
+
+		path += name;
+	}
+
+	return path;
+}
+
+// =============================================================================
+//
+void LDLibraryIndex::directoryChanged (QString path)
+{
+	QMutexLocker locker (&m_mutex);
+	m_directories.remove (path);
+
+	// Directories missing under this one may have been created now
+	const QString prefix = path.endsWith ("/") ? path : path + "/";
+
+	for (auto it = m_directories.begin(); it != m_directories.end();)
+	{
+		if (not it->exists && it.key().startsWith (prefix))
+			it = m_directories.erase (it);
+		else
+			++it;
+	}
+}
+
+// =============================================================================
+//
+void LDLibraryIndex::watchPendingDirectories()
+{
+	QMutexLocker locker (&m_mutex);
+
+	if (m_watcher == null)
+	{
+		m_watcher = new QFileSystemWatcher (this);
+		connect (m_watcher, SIGNAL (directoryChanged (QString)), this, SLOT (directoryChanged (QString)));
+	}
+
+	QStringList watched = m_watcher->directories();
+
+	for (const QString& path : m_pendingWatches)
+	{
+		if (not watched.contains (path))
+			m_watcher->addPath (path);
+	}
+
+	m_pendingWatches.clear();
+}
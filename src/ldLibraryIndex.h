@@ -0,0 +1,73 @@
+/*
+ *  LDForge: LDraw parts authoring CAD
+ *  Copyright (C) 2013, 2014 Santeri Piippo
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#include <QObject>
+#include <QHash>
+#include <QMutex>
+#include <QStringList>
+#include "main.h"
+
+class QFileSystemWatcher;
+
+//
+// The library index finds files on the disk without querying the file system
+// on every look-up. The contents of a directory are read in the first time a
+// path is looked up through it, into hash tables keyed by the lowercased
+// names, so that resolving a path takes a hash look-up per path component.
+// Indexed directories are watched for changes and read in again afterwards,
+// so that e.g. freshly downloaded parts are found.
+//
+// Directories that do not exist are remembered too. The closest existing
+// directory above them is watched instead, so that they are looked for again
+// once something there changes.
+//
+// The index is thread-safe. The file system watcher lives in the main thread.
+//
+class LDLibraryIndex : public QObject
+{
+	Q_OBJECT
+
+public:
+	// Finds the file at @relpath under @directory, ignoring case. Returns the
+	// actual path of the file, or an empty string if there is no such file.
+	QString find (QString directory, QString relpath);
+
+	static LDLibraryIndex* instance();
+
+private:
+	struct Directory
+	{
+		bool					exists;
+		QHash<QString, QString>	files;
+		QHash<QString, QString>	subdirectories;
+	};
+
+	QHash<QString, Directory>	m_directories;
+	QStringList					m_pendingWatches;
+	QMutex						m_mutex;
+	QFileSystemWatcher*			m_watcher;
+
+	LDLibraryIndex();
+	const Directory* getDirectory (const QString& path);
+	void watchDirectory (const QString& path);
+
+private slots:
+	void directoryChanged (QString path);
+	void watchPendingDirectories();
+};
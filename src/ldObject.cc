@@ -17,6 +17,9 @@
  */
 
 
+#include <cstring>
+#include <QMutex>
+#include <QMutexLocker>
 #include "main.h"
 #include "ldObject.h"
 #include "ldDocument.h"
@@ -26,15 +29,140 @@
 #include "glRenderer.h"
 #include "colors.h"
 #include "glCompiler.h"
+#include "ldFormatter.h"
+#include "ldVertexStore.h"
 
 CFGENTRY (String, defaultName, "");
 CFGENTRY (String, defaultUser, "");
 CFGENTRY (Int, defaultLicense, 0);
 
-// List of all LDObjects
-QMap<long, LDObjectWeakPtr>	g_allObjects;
-static int32						g_idcursor = 1; // 0 shalt be null
-static constexpr int32				g_maxID = (1 << 24);
+// =============================================================================
+//
+// LDObjectRegistry
+//
+// Maps object IDs to objects. An ID is an index into a table of slots, so
+// looking an object up by ID is a plain array access. Since IDs double as
+// picking colors they must fit in 24 bits, so the slots of destroyed objects
+// are put on a free list and recycled. Each slot has a generation which is
+// bumped whenever the slot is released, so that a handle (ID and generation)
+// of a destroyed object does not resolve to whatever object got its ID later.
+//
+// Slots are allocated in chunks which never move, and all access goes through
+// a mutex so that objects can be created from any thread.
+//
+class LDObjectRegistry
+{
+public:
+	enum { MaxID = 1 << 24 };
+
+	LDObjectRegistry() :
+		m_numSlots (1), // 0 shalt be null
+		m_firstFree (0)
+	{
+		memset (m_chunks, 0, sizeof m_chunks);
+	}
+
+	// Registers @obj and returns its ID, or 0 if all IDs are in use.
+	int32 add (LDObjectWeakPtr obj, uint32& generation)
+	{
+		QMutexLocker locker (&m_mutex);
+		int32 id;
+
+		if (m_firstFree != 0)
+		{
+			id = m_firstFree;
+			m_firstFree = slot (id).nextFree;
+		}
+		elif (m_numSlots < MaxID)
+		{
+			id = m_numSlots++;
+
+			if (m_chunks[id >> ChunkBits] == null)
+				m_chunks[id >> ChunkBits] = new Slot[ChunkSize];
+		}
+		else
+			return 0;
+
+		Slot& s = slot (id);
+		s.object = obj;
+		s.nextFree = 0;
+		generation = s.generation;
+		return id;
+	}
+
+	void remove (int32 id)
+	{
+		QMutexLocker locker (&m_mutex);
+		Slot& s = slot (id);
+		s.object.clear();
+		++s.generation;
+		s.nextFree = m_firstFree;
+		m_firstFree = id;
+	}
+
+	LDObjectPtr find (int32 id) const
+	{
+		if (id <= 0 || id >= MaxID)
+			return LDObjectPtr();
+
+		QMutexLocker locker (&m_mutex);
+
+		if (id >= m_numSlots)
+			return LDObjectPtr();
+
+		return slot (id).object.toStrongRef();
+	}
+
+	LDObjectPtr find (int32 id, uint32 generation) const
+	{
+		if (id <= 0 || id >= MaxID)
+			return LDObjectPtr();
+
+		QMutexLocker locker (&m_mutex);
+
+		if (id >= m_numSlots || slot (id).generation != generation)
+			return LDObjectPtr();
+
+		return slot (id).object.toStrongRef();
+	}
+
+	// The registry is never destroyed since objects may still be deleted while
+	// static variables are being destroyed.
+	static LDObjectRegistry* instance()
+	{
+		static LDObjectRegistry* registry = new LDObjectRegistry;
+		return registry;
+	}
+
+private:
+	enum
+	{
+		ChunkBits = 12,
+		ChunkSize = 1 << ChunkBits,
+		NumChunks = MaxID / ChunkSize,
+	};
+
+	struct Slot
+	{
+		LDObjectWeakPtr	object;
+		uint32			generation;
+		int32			nextFree;
+
+		Slot() :
+			generation (0),
+			nextFree (0) {}
+	};
+
+	Slot*			m_chunks[NumChunks];
+	int32			m_numSlots;
+	int32			m_firstFree;
+	mutable QMutex	m_mutex;
+
+	inline Slot& slot (int32 id) const
+	{
+		return m_chunks[id >> ChunkBits][id & (ChunkSize - 1)];
+	}
+};
 
 #define LDOBJ_DEFAULT_CTOR(T,BASE) \
 	T :: T (LDObjectPtr* selfptr) : \
@@ -47,13 +175,15 @@ LDObject::LDObject (LDObjectPtr* selfptr) :
 	m_isHidden (false),
 	m_isSelected (false),
 	m_isDestructed (false),
-	qObjListEntry (null)
+	qObjListEntry (null),
+	m_vertexStore (LDVertexStore::detached()),
+	m_vertexBlock (-1),
+	m_documentPosition (-1),
+	m_generation (0)
 {
 	*selfptr = LDObjectPtr (this, [](LDObject* obj){ obj->finalDelete(); });
-	memset (m_coords, 0, sizeof m_coords);
 	m_self = selfptr->toWeakRef();
 	chooseID();
-	g_allObjects[id()] = self();
 	setRandomColor (QColor::fromHsv (rand() % 360, rand() % 256, rand() % 96 + 128));
 }
 
@@ -78,17 +208,19 @@ LDOBJ_DEFAULT_CTOR (LDComment, LDObject)
 //
 void LDObject::chooseID()
 {
-	// If this is the first pass we can just use a global ID counter for each
-	// unique object. Let's hope that nobody goes to create 17 million objects
-	// anytime soon.
-	if (g_idcursor < g_maxID)
+	uint32 generation;
+	int32 id = LDObjectRegistry::instance()->add (self(), generation);
+
+	if (id != 0)
 	{
-		setID (g_idcursor++);
+		setID (id);
+		m_generation = generation;
 		return;
 	}
 
-	// In case someone does, we cannot really continue execution. We must abort,
-	// give the user a chance to save their documents though.
+	// IDs are recycled, so this only happens if there are 17 million objects
+	// alive at the same time. We cannot really continue execution. We must
+	// abort, give the user a chance to save their documents though.
 	critical ("Created too many objects. Execution cannot continue. You have a "
 		"chance to save any changes to documents, then restart.");
 	(void) safeToCloseAll();
@@ -111,64 +243,103 @@ QString LDComment::asText() const
 	return format ("0 %1", text());
 }
 
+// =============================================================================
+//
+bool LDObject::formatText (LDLineFormatter&) const
+{
+	return false;
+}
+
 // =============================================================================
 //
 QString LDSubfile::asText() const
 {
-	QString val = format ("1 %1 %2 ", color(), position());
-	val += transform().toString();
-	val += ' ';
-	val += fileInfo()->name();
-	return val;
+	LDLineFormatter line;
+	formatText (line);
+	return line.toString() + fileInfo()->name();
+}
+
+bool LDSubfile::formatText (LDLineFormatter& line) const
+{
+	line.append ("1");
+	line.appendColor (color());
+	line.appendVertex (position());
+	line.appendMatrix (transform());
+	line.append (" ");
+	return true;
 }
 
 // =============================================================================
 //
-QString LDLine::asText() const
+// Formats a line, triangle, quad or conditional line with the given line code.
+//
+static void formatPolygon (const LDObject* obj, const char* code, LDLineFormatter& line)
 {
-	QString val = format ("2 %1", color());
+	line.append (code);
+	line.appendColor (obj->color());
+
+	for (int i = 0; i < obj->numVertices(); ++i)
+		line.appendVertex (obj->vertex (i));
+}
 
-	for (int i = 0; i < 2; ++i)
-		val += format (" %1", vertex (i));
+// =============================================================================
+//
+QString LDLine::asText() const
+{
+	LDLineFormatter line;
+	formatText (line);
+	return line.toString();
+}
 
-	return val;
+bool LDLine::formatText (LDLineFormatter& line) const
+{
+	formatPolygon (this, "2", line);
+	return true;
 }
 
 // =============================================================================
 //
 QString LDTriangle::asText() const
 {
-	QString val = format ("3 %1", color());
-
-	for (int i = 0; i < 3; ++i)
-		val += format (" %1", vertex (i));
+	LDLineFormatter line;
+	formatText (line);
+	return line.toString();
+}
 
-	return val;
+bool LDTriangle::formatText (LDLineFormatter& line) const
+{
+	formatPolygon (this, "3", line);
+	return true;
 }
 
 // =============================================================================
 //
 QString LDQuad::asText() const
 {
-	QString val = format ("4 %1", color());
-
-	for (int i = 0; i < 4; ++i)
-		val += format (" %1", vertex (i));
+	LDLineFormatter line;
+	formatText (line);
+	return line.toString();
+}
 
-	return val;
+bool LDQuad::formatText (LDLineFormatter& line) const
+{
+	formatPolygon (this, "4", line);
+	return true;
 }
 
 // =============================================================================
 //
 QString LDCondLine::asText() const
 {
-	QString val = format ("5 %1", color());
-
-	// Add the coordinates
-	for (int i = 0; i < 4; ++i)
-		val += format (" %1", vertex (i));
+	LDLineFormatter line;
+	formatText (line);
+	return line.toString();
+}
 
-	return val;
+bool LDCondLine::formatText (LDLineFormatter& line) const
+{
+	formatPolygon (this, "5", line);
+	return true;
 }
 
 // =============================================================================
@@ -182,7 +353,17 @@ QString LDError::asText() const
 //
 QString LDVertex::asText() const
 {
-	return format ("0 !LDFORGE VERTEX %1 %2", color(), pos);
+	LDLineFormatter line;
+	formatText (line);
+	return line.toString();
+}
+
+bool LDVertex::formatText (LDLineFormatter& line) const
+{
+	line.append ("0 !LDFORGE VERTEX");
+	line.appendColor (color());
+	line.appendVertex (pos);
+	return true;
 }
 
 // =============================================================================
@@ -300,7 +481,58 @@ LDCondLine::LDCondLine (LDObjectPtr* selfptr, const Vertex& v0, const Vertex& v1
 
 // =============================================================================
 //
-LDObject::~LDObject() {}
+LDObject::~LDObject()
+{
+	if (m_vertexBlock != -1)
+		m_vertexStore->release (m_vertexBlock);
+}
+
+// =============================================================================
+//
+// The vertices of the object move along into the vertex store of the new
+// document.
+//
+void LDObject::setDocument (const LDDocumentWeakPtr& a)
+{
+	LDVertexStore* store = (a != null) ? a.data()->vertexStore() : LDVertexStore::detached();
+
+	if (m_vertexBlock != -1 && store != m_vertexStore)
+		m_vertexBlock = m_vertexStore->moveBlock (m_vertexBlock, store);
+
+	m_vertexStore = store;
+
+	// Keep the reverse dependencies of the referenced document up to date
+	if (type() == OBJ_Subfile)
+	{
+		LDSubfile* ref = static_cast<LDSubfile*> (this);
+
+		if (ref->fileInfo() != null)
+		{
+			if (m_document != null)
+				ref->fileInfo()->removeReference (ref);
+
+			if (a != null)
+				ref->fileInfo()->addReference (ref);
+		}
+	}
+
+	m_document = a;
+}
+
+// =============================================================================
+//
+void LDObject::setHidden (const bool& a)
+{
+	if (m_isHidden == a)
+		return;
+
+	m_isHidden = a;
+
+	// Hidden objects have no room in the VBOs, so the object must be laid out
+	// again.
+	if (g_win != null && document() != null)
+		g_win->R()->compileObject (self());
+}
 
 // =============================================================================
 //
@@ -315,10 +547,11 @@ void LDObject::destroy()
 		document().toStrongRef()->forgetObject (self());
 
 	// Delete the GL lists
-	g_win->R()->forgetObject (self());
+	if (g_win != null)
+		g_win->R()->forgetObject (self());
 
-	// Remove this object from the list of LDObjects
-	g_allObjects.erase (g_allObjects.find (id()));
+	// Remove this object from the registry, freeing its ID for reuse
+	LDObjectRegistry::instance()->remove (id());
 	setDestructed (true);
 }
 
@@ -391,7 +624,7 @@ LDObjectList LDSubfile::inlineContents (bool deep, bool render)
 
 // =============================================================================
 //
-LDPolygon* LDObject::getPolygon()
+bool LDObject::getPolygon (LDPolygon& data) const
 {
 	LDObjectType ot = type();
 	int num =
@@ -401,30 +634,27 @@ LDPolygon* LDObject::getPolygon()
 		(ot == OBJ_CondLine)	?	5 :
 										0;
 	if (num == 0)
-		return null;
+		return false;
 
-	LDPolygon* data = new LDPolygon;
-	data->id = id();
-	data->num = num;
-	data->color = color().index();
+	data.id = id();
+	data.num = num;
+	data.color = color().index();
 
-	for (int i = 0; i < data->numVertices(); ++i)
-		data->vertices[i] = vertex (i);
+	for (int i = 0; i < data.numVertices(); ++i)
+		data.vertices[i] = vertex (i);
 
-	return data;
+	return true;
 }
 
 // =============================================================================
 //
-QList<LDPolygon> LDSubfile::inlinePolygons()
+// Appends the flattened polygons of the referenced document to @buffer, placed
+// and colored by this reference.
+//
+void LDSubfile::inlinePolygons (QVector<LDPolygon>& buffer)
 {
-	QList<LDPolygon> data = fileInfo()->inlinePolygons();
-
-	for (LDPolygon& entry : data)
-		for (int i = 0; i < entry.numVertices(); ++i)
-			entry.vertices[i].transform (transform(), position());
-
-	return data;
+	if (fileInfo() != null)
+		fileInfo()->inlinePolygons (buffer, transform(), position(), color().index());
 }
 
 // =============================================================================
@@ -432,12 +662,7 @@ QList<LDPolygon> LDSubfile::inlinePolygons()
 long LDObject::lineNumber() const
 {
 	assert (document() != null);
-
-	for (int i = 0; i < document().toStrongRef()->getObjectCount(); ++i)
-		if (document().toStrongRef()->getObject (i) == this)
-			return i;
-
-	return -1;
+	return document().toStrongRef()->indexOf (this);
 }
 
 // =============================================================================
@@ -461,7 +686,7 @@ void LDObject::moveObjects (LDObjectList objs, const bool up)
 		const long idx = obj->lineNumber(),
 				   target = idx + (up ? -1 : 1);
 
-		if ((up && idx == 0) || (not up && idx == (long) file->objects().size() - 1l))
+		if ((up && idx == 0) || (not up && idx == (long) file->getObjectCount() - 1l))
 		{
 			// One of the objects hit the extrema. If this happens, this should be the first
 			// object to be iterated on. Thus, nothing has changed yet and it's safe to just
@@ -480,8 +705,11 @@ void LDObject::moveObjects (LDObjectList objs, const bool up)
 
 	// The objects need to be recompiled, otherwise their pick lists are left with
 	// the wrong index colors which messes up selection.
-	for (LDObjectPtr obj : objsToCompile)
-		g_win->R()->compileObject (obj);
+	if (g_win != null)
+	{
+		for (LDObjectPtr obj : objsToCompile)
+			g_win->R()->compileObject (obj);
+	}
 }
 
 // =============================================================================
@@ -769,12 +997,21 @@ LDLinePtr LDCondLine::toEdgeLine()
 //
 LDObjectPtr LDObject::fromID (int id)
 {
-	auto it = g_allObjects.find (id);
+	return LDObjectRegistry::instance()->find (id);
+}
 
-	if (it != g_allObjects.end())
-		return *it;
+// =============================================================================
+//
+qint64 LDObject::handle() const
+{
+	return (qint64 (m_generation) << 24) | id();
+}
 
-	return LDObjectPtr();
+// =============================================================================
+//
+LDObjectPtr LDObject::fromHandle (qint64 handle)
+{
+	return LDObjectRegistry::instance()->find (handle & 0xFFFFFF, uint32 (handle >> 24));
 }
 
 // =============================================================================
@@ -789,32 +1026,47 @@ void LDOverlay::invert() {}
 
 // =============================================================================
 //
-// Hook the set accessors of certain properties to this changeProperty function.
-// It takes care of history management so we can capture low-level changes, this
-// makes history stuff work out of the box.
+// Makes a change to @obj by calling @change. This takes care of history
+// management so we can capture low-level changes.
 //
-template<typename T>
-static void changeProperty (LDObjectPtr obj, T* ptr, const T& val)
+template<typename Function>
+static void changeObject (LDObjectPtr obj, Function change)
 {
 	long idx;
 
-	if (*ptr == val)
-		return;
-
 	if (obj->document() != null && (idx = obj->lineNumber()) != -1)
 	{
 		QString before = obj->asText();
-		*ptr = val;
+		change();
 		QString after = obj->asText();
 
 		if (before != after)
 		{
 			obj->document().toStrongRef()->addToHistory (new EditHistory (idx, before, after));
-			g_win->R()->compileObject (obj);
+
+			if (isGeometryType (obj->type()))
+				obj->document().toStrongRef()->invalidateGeometry();
+
+			if (g_win != null)
+				g_win->R()->compileObject (obj);
 		}
 	}
 	else
-		*ptr = val;
+		change();
+}
+
+// =============================================================================
+//
+// Hook the set accessors of certain properties to this changeProperty function.
+// It goes through changeObject, which makes history stuff work out of the box.
+//
+template<typename T>
+static void changeProperty (LDObjectPtr obj, T* ptr, const T& val)
+{
+	if (*ptr == val)
+		return;
+
+	changeObject (obj, [&]() { *ptr = val; });
 }
 
 // =============================================================================
@@ -826,19 +1078,31 @@ void LDObject::setColor (LDColor const& val)
 
 // =============================================================================
 //
-const Vertex& LDObject::vertex (int i) const
+Vertex LDObject::vertex (int i) const
 {
-	return m_coords[i];
+	if (m_vertexBlock == -1)
+		return Vertex (0, 0, 0);
+
+	return m_vertexStore->vertex (m_vertexBlock, i);
 }
 
 // =============================================================================
 //
 void LDObject::setVertex (int i, const Vertex& vert)
 {
+	assert (i >= 0 && i < LDVertexStore::BlockSize);
+	Vertex old = vertex (i);
+
+	if (old == vert)
+		return;
+
+	if (m_vertexBlock == -1)
+		m_vertexBlock = m_vertexStore->allocate (numVertices());
+
 	if (document() != null)
-		document().toStrongRef()->vertexChanged (m_coords[i], vert);
+		document().toStrongRef()->vertexChanged (old, vert);
 
-	changeProperty (self(), &m_coords[i], vert);
+	changeObject (self(), [&]() { m_vertexStore->setVertex (m_vertexBlock, i, vert); });
 }
 
 // =============================================================================
@@ -923,17 +1187,93 @@ QString getLicenseText (int id)
 //
 LDObjectPtr LDObject::createCopy() const
 {
-	LDObjectPtr copy = parseLine (asText());
+	LDObjectPtr copy = getDefault (type());
+	copy->copyFrom (this);
 	return copy;
 }
 
+// =============================================================================
+//
+void LDObject::copyFrom (const LDObject* other)
+{
+	if (isColored())
+		setColor (other->color());
+
+	for (int i = 0; i < numVertices(); ++i)
+		setVertex (i, other->vertex (i));
+}
+
+// =============================================================================
+//
+void LDError::copyFrom (const LDObject* other)
+{
+	const LDError* err = static_cast<const LDError*> (other);
+	setFileReferenced (err->fileReferenced());
+	setContents (err->contents());
+	setReason (err->reason());
+}
+
+// =============================================================================
+//
+void LDComment::copyFrom (const LDObject* other)
+{
+	setText (static_cast<const LDComment*> (other)->text());
+}
+
+// =============================================================================
+//
+void LDBFC::copyFrom (const LDObject* other)
+{
+	setStatement (static_cast<const LDBFC*> (other)->statement());
+}
+
+// =============================================================================
+//
+void LDSubfile::copyFrom (const LDObject* other)
+{
+	const LDSubfile* ref = static_cast<const LDSubfile*> (other);
+	LDObject::copyFrom (other);
+	setFileInfo (ref->fileInfo());
+	setTransform (ref->transform());
+	setPosition (ref->position());
+}
+
+// =============================================================================
+//
+void LDVertex::copyFrom (const LDObject* other)
+{
+	LDObject::copyFrom (other);
+	pos = static_cast<const LDVertex*> (other)->pos;
+}
+
+// =============================================================================
+//
+void LDOverlay::copyFrom (const LDObject* other)
+{
+	const LDOverlay* ov = static_cast<const LDOverlay*> (other);
+	setCamera (ov->camera());
+	setX (ov->x());
+	setY (ov->y());
+	setWidth (ov->width());
+	setHeight (ov->height());
+	setFileName (ov->fileName());
+}
+
 // =============================================================================
 //
 void LDSubfile::setFileInfo (const LDDocumentPtr& a)
 {
+	if (a == m_fileInfo)
+		return;
+
 	if (document() != null)
+	{
 		document().toStrongRef()->removeKnownVerticesOf (self());
 
+		if (m_fileInfo != null)
+			m_fileInfo->removeReference (this);
+	}
+
 	m_fileInfo = a;
 
 	// If it's an immediate subfile reference (i.e. this subfile belongs in an
@@ -947,5 +1287,11 @@ void LDSubfile::setFileInfo (const LDDocumentPtr& a)
 	}
 
 	if (document() != null)
+	{
+		if (a != null)
+			a->addReference (this);
+
+		document().toStrongRef()->invalidateGeometry();
 		document().toStrongRef()->addKnownVerticesOf (self());
+	}
 };
@@ -48,11 +48,15 @@ protected:														\
 #define LDOBJ_SCEMANTIC        LDOBJ_CUSTOM_SCEMANTIC { return true; }
 #define LDOBJ_NON_SCEMANTIC    LDOBJ_CUSTOM_SCEMANTIC { return false; }
 
+#define LDOBJ_FORMATTED        public: virtual bool formatText (LDLineFormatter& line) const override;
+
 #define LDOBJ_SETMATRIX(V)     public: virtual bool hasMatrix() const override { return V; }
 #define LDOBJ_HAS_MATRIX       LDOBJ_SETMATRIX (true)
 #define LDOBJ_NO_MATRIX        LDOBJ_SETMATRIX (false)
 
 class QListWidgetItem;
+class LDLineFormatter;
+class LDVertexStore;
 class LDSubfile;
 class LDDocument;
 
@@ -82,6 +86,13 @@ enum LDObjectType
 
 NUMERIC_ENUM_OPERATORS (LDObjectType)
 
+// Does an object of this type have geometry to render?
+inline bool isGeometryType (LDObjectType type)
+{
+	return type == OBJ_Subfile || type == OBJ_Quad || type == OBJ_Triangle
+		|| type == OBJ_Line || type == OBJ_CondLine;
+}
+
 //
 // LDObject
 //
@@ -92,11 +103,11 @@ NUMERIC_ENUM_OPERATORS (LDObjectType)
 //
 class LDObject
 {
-	PROPERTY (public,		bool,				isHidden,		setHidden,		STOCK_WRITE)
+	PROPERTY (public,		bool,				isHidden,		setHidden,		CUSTOM_WRITE)
 	PROPERTY (public,		bool,				isSelected,		setSelected,	STOCK_WRITE)
 	PROPERTY (public,		bool,				isDestructed,	setDestructed,	STOCK_WRITE)
 	PROPERTY (public,		LDObjectWeakPtr,	parent,			setParent,		STOCK_WRITE)
-	PROPERTY (public,		LDDocumentWeakPtr,	document,		setDocument,	STOCK_WRITE)
+	PROPERTY (public,		LDDocumentWeakPtr,	document,		setDocument,	CUSTOM_WRITE)
 	PROPERTY (private,		int32,				id,				setID,			STOCK_WRITE)
 	PROPERTY (public,		LDColor,			color,			setColor,		CUSTOM_WRITE)
 	PROPERTY (private,		QColor,				randomColor,	setRandomColor,	STOCK_WRITE)
@@ -108,7 +119,12 @@ public:
 	// This object as LDraw code
 	virtual QString				asText() const = 0;
 
-	// Makes a copy of this object
+	// Formats this object as LDraw code into @line without going through
+	// QString. Returns false if this object does not support it. The file
+	// name of a subfile reference is left out.
+	virtual bool				formatText (LDLineFormatter& line) const;
+
+	// Makes a copy of this object. The copy is not in any document.
 	LDObjectPtr					createCopy() const;
 
 	// What color does the object default to?
@@ -175,7 +191,7 @@ public:
 	virtual QString				typeName() const = 0;
 
 	// Get a vertex by index
-	const Vertex&				vertex (int i) const;
+	Vertex						vertex (int i) const;
 
 	// Get type name by enumerator
 	static QString typeName (LDObjectType type);
@@ -188,8 +204,20 @@ public:
 
 	// Get a description of a list of LDObjects
 	static QString describeObjects (const LDObjectList& objs);
+
+	// Returns the object with the given ID. IDs of destroyed objects are
+	// reused, so an ID is only meaningful while its object is alive.
 	static LDObjectPtr fromID (int id);
-	LDPolygon* getPolygon();
+
+	// Handles identify an object for as long as it lives, unlike IDs they are
+	// never reused. Use these to refer to objects later on, e.g. in history.
+	qint64 handle() const;
+	static LDObjectPtr fromHandle (qint64 handle);
+
+	// Fills @data with the polygon of this object. Returns false if the object
+	// is not a line, triangle, quad or conditional line.
+	bool getPolygon (LDPolygon& data) const;
+
 
 	// TODO: make this private!
 	QListWidgetItem* qObjListEntry;
@@ -208,15 +236,29 @@ protected:
 	virtual ~LDObject();
 	void chooseID();
 
+	// Copies the color, vertices and any type-specific properties of @other,
+	// an object of the same type, into this object. Used by createCopy().
+	virtual void copyFrom (const LDObject* other);
+
 	// Even though we supply a custom deleter to QSharedPointer, the shared
 	// pointer's base class still calls operator delete directly in one of
 	// its methods. The method should never be called but we need to declare
 	// the class making this delete call a friend anyway.
 	friend class QSharedPointer<LDObject>;
 	friend class QSharedPointer<LDObject>::ExternalRefCount;
+	friend class LDDocument;
 
 private:
-	Vertex m_coords[4];
+	// The vertices are kept in the vertex store of the document, see
+	// LDVertexStore. The block is only allocated once a vertex is set.
+	LDVertexStore*	m_vertexStore;
+	int				m_vertexBlock;
+
+	// Index of this object in its document, maintained by LDDocument
+	int				m_documentPosition;
+
+	// Generation of the registry slot of this object, see handle()
+	uint32			m_generation;
 };
 
 //
@@ -324,6 +366,9 @@ public:
 		LDObject (selfptr),
 		m_contents (contents),
 		m_reason (reason) {}
+
+protected:
+	virtual void copyFrom (const LDObject* other) override;
 };
 
 using LDErrorPtr = QSharedPointer<LDError>;
@@ -364,6 +409,9 @@ public:
 	LDComment (LDObjectPtr* selfptr, QString text) :
 		LDObject (selfptr),
 		m_text (text) {}
+
+protected:
+	virtual void copyFrom (const LDObject* other) override;
 };
 
 using LDCommentPtr = QSharedPointer<LDComment>;
@@ -406,6 +454,9 @@ public:
 
 	// Statement strings
 	static const char* k_statementStrings[];
+
+protected:
+	virtual void copyFrom (const LDObject* other) override;
 };
 
 using LDBFCPtr = QSharedPointer<LDBFC>;
@@ -419,6 +470,7 @@ using LDBFCWeakPtr = QWeakPointer<LDBFC>;
 class LDSubfile : public LDObject, public LDMatrixObject
 {
 	LDOBJ (Subfile)
+	LDOBJ_FORMATTED
 	LDOBJ_NAME (subfile)
 	LDOBJ_VERTICES (0)
 	LDOBJ_COLORED
@@ -440,7 +492,10 @@ public:
 
 	// Inlines this subfile.
 	LDObjectList inlineContents (bool deep, bool render);
-	QList<LDPolygon> inlinePolygons();
+	void inlinePolygons (QVector<LDPolygon>& buffer);
+
+protected:
+	virtual void copyFrom (const LDObject* other) override;
 };
 
 Q_DECLARE_OPERATORS_FOR_FLAGS (LDSubfile::InlineFlags)
@@ -455,6 +510,7 @@ using LDSubfileWeakPtr = QWeakPointer<LDSubfile>;
 class LDLine : public LDObject
 {
 	LDOBJ (Line)
+	LDOBJ_FORMATTED
 	LDOBJ_NAME (line)
 	LDOBJ_VERTICES (2)
 	LDOBJ_COLORED
@@ -477,6 +533,7 @@ using LDLineWeakPtr = QWeakPointer<LDLine>;
 class LDCondLine : public LDLine
 {
 	LDOBJ (CondLine)
+	LDOBJ_FORMATTED
 	LDOBJ_NAME (condline)
 	LDOBJ_VERTICES (4)
 	LDOBJ_COLORED
@@ -503,6 +560,7 @@ using LDCondLineWeakPtr = QWeakPointer<LDCondLine>;
 class LDTriangle : public LDObject
 {
 	LDOBJ (Triangle)
+	LDOBJ_FORMATTED
 	LDOBJ_NAME (triangle)
 	LDOBJ_VERTICES (3)
 	LDOBJ_COLORED
@@ -527,6 +585,7 @@ using LDTriangleWeakPtr = QWeakPointer<LDTriangle>;
 class LDQuad : public LDObject
 {
 	LDOBJ (Quad)
+	LDOBJ_FORMATTED
 	LDOBJ_NAME (quad)
 	LDOBJ_VERTICES (4)
 	LDOBJ_COLORED
@@ -556,6 +615,7 @@ using LDQuadWeakPtr = QWeakPointer<LDQuad>;
 class LDVertex : public LDObject
 {
 	LDOBJ (Vertex)
+	LDOBJ_FORMATTED
 	LDOBJ_NAME (vertex)
 	LDOBJ_VERTICES (0) // TODO: move pos to m_vertices[0]
 	LDOBJ_COLORED
@@ -565,6 +625,9 @@ class LDVertex : public LDObject
 
 public:
 	Vertex pos;
+
+protected:
+	virtual void copyFrom (const LDObject* other) override;
 };
 
 using LDVertexPtr = QSharedPointer<LDVertex>;
@@ -590,6 +653,9 @@ class LDOverlay : public LDObject
 	PROPERTY (public,	int,		width,		setWidth,		STOCK_WRITE)
 	PROPERTY (public,	int,		height,		setHeight,		STOCK_WRITE)
 	PROPERTY (public,	QString,		fileName,	setFileName,	STOCK_WRITE)
+
+protected:
+	virtual void copyFrom (const LDObject* other) override;
 };
 
 using LDOverlayPtr = QSharedPointer<LDOverlay>;
@@ -0,0 +1,367 @@
+/*
+ *  LDForge: LDraw parts authoring CAD
+ *  Copyright (C) 2013, 2014 Santeri Piippo
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#include "main.h"
+
+//
+// The LDraw line tokenizer works in place on a line buffer: tokens are spans
+// into the buffer and numbers are parsed straight from those spans, so that
+// parsing a line does not allocate. The buffer can either be UTF-16 (QChar,
+// i.e. QString data) or raw UTF-8 bytes. LDraw syntax itself is pure ASCII,
+// everything outside of it is treated as an opaque non-space character.
+//
+
+inline char tokenChar (QChar c)
+{
+	return (c.unicode() < 0x80) ? char (c.unicode()) : '\x7F';
+}
+
+inline char tokenChar (char c)
+{
+	return c;
+}
+
+inline QString tokenString (const QChar* data, int length)
+{
+	return QString (data, length);
+}
+
+inline QString tokenString (const char* data, int length)
+{
+	return QString::fromUtf8 (data, length);
+}
+
+// Is @c whitespace as far as QString::simplified() is concerned?
+inline bool isTokenSpace (char c)
+{
+	return c == ' ' || c == '\t' || c == '\n' || c == '\v' || c == '\f' || c == '\r';
+}
+
+//
+// A single token, a span of the line buffer.
+//
+template<typename Char>
+struct LDToken
+{
+	const Char*	begin;
+	const Char*	end;
+
+	inline int length() const
+	{
+		return end - begin;
+	}
+
+	// Compares this token against ASCII @text
+	bool operator== (const char* text) const
+	{
+		const Char* it = begin;
+
+		for (; it != end && *text != '\0'; ++it, ++text)
+		{
+			if (tokenChar (*it) != *text)
+				return false;
+		}
+
+		return it == end && *text == '\0';
+	}
+
+	inline bool operator!= (const char* text) const
+	{
+		return not operator== (text);
+	}
+
+	bool startsWith (const char* text) const
+	{
+		for (const Char* it = begin; *text != '\0'; ++it, ++text)
+		{
+			if (it == end || tokenChar (*it) != *text)
+				return false;
+		}
+
+		return true;
+	}
+
+	inline QString toString() const
+	{
+		return tokenString (begin, length());
+	}
+};
+
+//
+// Splits a line into space-separated tokens, skipping empty parts. This is
+// equivalent to QString::split (" ", QString::SkipEmptyParts) but does not
+// allocate anything. Only the first MaxTokens tokens are stored, but count()
+// yields the total amount of tokens so that token counts can still be checked.
+//
+template<typename Char>
+class LDLineTokenizer
+{
+public:
+	enum { MaxTokens = 16 };
+
+	LDLineTokenizer (const Char* data, int length) :
+		m_count (0)
+	{
+		const Char* end = data + length;
+		const Char* it = data;
+
+		while (it != end)
+		{
+			while (it != end && tokenChar (*it) == ' ')
+				++it;
+
+			if (it == end)
+				break;
+
+			const Char* tokenBegin = it;
+
+			while (it != end && tokenChar (*it) != ' ')
+				++it;
+
+			if (m_count < MaxTokens)
+			{
+				m_tokens[m_count].begin = tokenBegin;
+				m_tokens[m_count].end = it;
+			}
+
+			++m_count;
+		}
+	}
+
+	inline int count() const
+	{
+		return m_count;
+	}
+
+	inline const LDToken<Char>& operator[] (int i) const
+	{
+		assert (i >= 0 && i < m_count && i < MaxTokens);
+		return m_tokens[i];
+	}
+
+private:
+	LDToken<Char>	m_tokens[MaxTokens];
+	int				m_count;
+};
+
+//
+// Compares the span [begin, end) against ASCII @text as if the span had been
+// passed through QString::simplified() first. @text is expected to be already
+// simplified, i.e. its words are separated by single spaces.
+//
+template<typename Char>
+bool simplifiedEquals (const Char* begin, const Char* end, const char* text)
+{
+	const Char* it = begin;
+
+	while (it != end && isTokenSpace (tokenChar (*it)))
+		++it;
+
+	while (*text != '\0')
+	{
+		if (*text == ' ')
+		{
+			// A space in @text matches any non-empty whitespace run
+			if (it == end || not isTokenSpace (tokenChar (*it)))
+				return false;
+
+			while (it != end && isTokenSpace (tokenChar (*it)))
+				++it;
+		}
+		elif (it == end || tokenChar (*it) != *text)
+			return false;
+		else
+			++it;
+
+		++text;
+	}
+
+	while (it != end && isTokenSpace (tokenChar (*it)))
+		++it;
+
+	return it == end;
+}
+
+//
+// Parses an integer in the given @base (10 or 16) from [begin, end). Leading
+// and trailing whitespace and a sign are accepted, like QString::toLong does.
+// Returns false if the span is not a number or does not fit in 64 bits.
+//
+template<typename Char>
+bool parseTokenInteger (const Char* begin, const Char* end, int base, int64& result)
+{
+	while (begin != end && isTokenSpace (tokenChar (*begin)))
+		++begin;
+
+	while (begin != end && isTokenSpace (tokenChar (end[-1])))
+		--end;
+
+	bool negative = false;
+
+	if (begin != end && (tokenChar (*begin) == '-' || tokenChar (*begin) == '+'))
+	{
+		negative = (tokenChar (*begin) == '-');
+		++begin;
+	}
+
+	if (begin == end)
+		return false;
+
+	uint64 value = 0;
+	const uint64 limit = negative ? (uint64 (1) << 63) : (uint64 (1) << 63) - 1;
+
+	for (; begin != end; ++begin)
+	{
+		char c = tokenChar (*begin);
+		int digit;
+
+		if (c >= '0' && c <= '9')
+			digit = c - '0';
+		elif (base == 16 && c >= 'a' && c <= 'f')
+			digit = c - 'a' + 10;
+		elif (base == 16 && c >= 'A' && c <= 'F')
+			digit = c - 'A' + 10;
+		else
+			return false;
+
+		if (value > (limit - digit) / base)
+			return false;
+
+		value = (value * base) + digit;
+	}
+
+	result = negative ? int64 (0 - value) : int64 (value);
+	return true;
+}
+
+//
+// Parses a floating point number from [begin, end) with the same semantics as
+// QString::toDouble. Plain decimal numbers of up to 15 significant digits with
+// a small exponent, i.e. everything LDraw files practically ever contain, are
+// converted exactly with a single floating point operation. Anything else is
+// handed to QString::toDouble.
+//
+template<typename Char>
+bool parseTokenDouble (const Char* begin, const Char* end, double& result)
+{
+	static const double powersOfTen[] =
+	{
+		1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+		1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+	};
+
+	const Char* it = begin;
+	const Char* last = end;
+
+	while (it != last && isTokenSpace (tokenChar (*it)))
+		++it;
+
+	while (it != last && isTokenSpace (tokenChar (last[-1])))
+		--last;
+
+	bool negative = false;
+
+	if (it != last && (tokenChar (*it) == '-' || tokenChar (*it) == '+'))
+	{
+		negative = (tokenChar (*it) == '-');
+		++it;
+	}
+
+	uint64 mantissa = 0;
+	int significantDigits = 0;
+	int numDigits = 0;
+	int exponent = 0;
+	bool fast = true;
+	bool decimalPoint = false;
+
+	for (; it != last; ++it)
+	{
+		char c = tokenChar (*it);
+
+		if (c == '.' && not decimalPoint)
+		{
+			decimalPoint = true;
+			continue;
+		}
+
+		if (c < '0' || c > '9')
+			break;
+
+		++numDigits;
+
+		if (mantissa == 0 && c == '0')
+		{
+			// Leading zeroes are not significant
+			if (decimalPoint)
+				--exponent;
+
+			continue;
+		}
+
+		if (++significantDigits > 15)
+		{
+			fast = false;
+			break;
+		}
+
+		mantissa = (mantissa * 10) + (c - '0');
+
+		if (decimalPoint)
+			--exponent;
+	}
+
+	if (fast && numDigits > 0 && it != last && (tokenChar (*it) == 'e' || tokenChar (*it) == 'E'))
+	{
+		int64 explicitExponent;
+		const Char* expBegin = ++it;
+
+		// Let parseTokenInteger check the exponent, but do not let it accept
+		// whitespace after the 'e'.
+		if (expBegin != last
+			&& not isTokenSpace (tokenChar (*expBegin))
+			&& parseTokenInteger (expBegin, last, 10, explicitExponent)
+			&& explicitExponent >= -22 && explicitExponent <= 22)
+		{
+			exponent += explicitExponent;
+			it = last;
+		}
+		else
+			fast = false;
+	}
+
+	if (fast && numDigits > 0 && it == last && exponent >= -22 && exponent <= 22)
+	{
+		result = double (mantissa);
+
+		if (exponent < 0)
+			result /= powersOfTen[-exponent];
+		else
+			result *= powersOfTen[exponent];
+
+		if (negative)
+			result = -result;
+
+		return true;
+	}
+
+	// Not a plain number, let Qt deal with it.
+	bool ok;
+	result = tokenString (begin, end - begin).toDouble (&ok);
+	return ok;
+}
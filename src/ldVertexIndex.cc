@@ -0,0 +1,255 @@
+/*
+ *  LDForge: LDraw parts authoring CAD
+ *  Copyright (C) 2013, 2014 Santeri Piippo
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cmath>
+#include "ldVertexIndex.h"
+
+// =============================================================================
+//
+// Zeroes are normalized since -0 and 0 compare equal but hash differently.
+//
+LDVertexIndex::Key::Key (const Vertex& a) :
+	x (a.x() + 0.0),
+	y (a.y() + 0.0),
+	z (a.z() + 0.0) {}
+
+// Are @a and @b exactly the same vertex?
+static inline bool isSameVertex (const Vertex& a, const Vertex& b)
+{
+	return a.x() == b.x() && a.y() == b.y() && a.z() == b.z();
+}
+
+// Returns the two axes other than @depthAxis
+static inline void planeAxes (Axis depthAxis, Axis& u, Axis& v)
+{
+	u = (depthAxis == X) ? Y : X;
+	v = (depthAxis == Z) ? Y : Z;
+}
+
+// =============================================================================
+//
+LDVertexIndex::LDVertexIndex() :
+	m_hasBounds (false)
+{
+	for (int i = 0; i < 3; ++i)
+		m_hasGrid[i] = false;
+}
+
+// =============================================================================
+//
+void LDVertexIndex::add (const Vertex& a)
+{
+	int& references = m_references[a];
+
+	if (references++ != 0)
+		return;
+
+	if (m_hasBounds)
+	{
+		m_min = Vertex (qMin (m_min.x(), a.x()), qMin (m_min.y(), a.y()), qMin (m_min.z(), a.z()));
+		m_max = Vertex (qMax (m_max.x(), a.x()), qMax (m_max.y(), a.y()), qMax (m_max.z(), a.z()));
+	}
+
+	for (int i = 0; i < 3; ++i)
+	{
+		if (m_hasGrid[i])
+			m_grids[i][cellOf (Axis (i), a)] << a;
+	}
+}
+
+// =============================================================================
+//
+void LDVertexIndex::remove (const Vertex& a)
+{
+	auto it = m_references.find (a);
+	assert (it != m_references.end());
+
+	// If there's no more references to a given vertex, it is to be removed.
+	if (--it.value() != 0)
+		return;
+
+	m_references.erase (it);
+
+	// Removing a vertex from the inside of the box does not change the box.
+	if (m_hasBounds)
+	{
+		for (int i = 0; i < 3; ++i)
+		{
+			if (a[(Axis) i] == m_min[(Axis) i] || a[(Axis) i] == m_max[(Axis) i])
+				m_hasBounds = false;
+		}
+	}
+
+	for (int i = 0; i < 3; ++i)
+	{
+		if (not m_hasGrid[i])
+			continue;
+
+		auto cell = m_grids[i].find (cellOf (Axis (i), a));
+		assert (cell != m_grids[i].end());
+
+		// Vertex's operator== is fuzzy and could match a nearly equal vertex
+		// in the same cell, so look for the exact coordinates.
+		int index = 0;
+
+		while (index < cell->size() && not isSameVertex (cell->at (index), a))
+			++index;
+
+		assert (index < cell->size());
+		cell->remove (index);
+
+		if (cell->isEmpty())
+			m_grids[i].erase (cell);
+	}
+}
+
+// =============================================================================
+//
+void LDVertexIndex::clear()
+{
+	m_references.clear();
+	m_hasBounds = false;
+
+	for (int i = 0; i < 3; ++i)
+	{
+		m_grids[i].clear();
+		m_hasGrid[i] = false;
+	}
+}
+
+// =============================================================================
+//
+QVector<Vertex> LDVertexIndex::findNear (Axis depthAxis, const Vertex& center, double radius) const
+{
+	QVector<Vertex> result;
+	Axis u, v;
+	planeAxes (depthAxis, u, v);
+
+	if (not m_hasGrid[depthAxis])
+		buildGrid (depthAxis);
+
+	const Grid& grid = m_grids[depthAxis];
+	const int u0 = cellCoordinate (center[u] - radius);
+	const int u1 = cellCoordinate (center[u] + radius);
+	const int v0 = cellCoordinate (center[v] - radius);
+	const int v1 = cellCoordinate (center[v] + radius);
+
+	auto collect = [&](const QVector<Vertex>& cell)
+	{
+		for (const Vertex& a : cell)
+		{
+			if (std::abs (a[u] - center[u]) <= radius && std::abs (a[v] - center[v]) <= radius)
+				result << a;
+		}
+	};
+
+	// If the range covers more cells than there are cells with vertices in
+	// them, e.g. when zoomed far out, go through the occupied cells instead.
+	if ((double (u1) - u0 + 1) * (double (v1) - v0 + 1) > grid.size())
+	{
+		for (auto it = grid.begin(); it != grid.end(); ++it)
+		{
+			const int cu = int (it.key() >> 32);
+			const int cv = int (it.key() & 0xFFFFFFFF);
+
+			if (cu >= u0 && cu <= u1 && cv >= v0 && cv <= v1)
+				collect (it.value());
+		}
+	}
+	else
+	{
+		for (int cu = u0; cu <= u1; ++cu)
+		{
+			for (int cv = v0; cv <= v1; ++cv)
+			{
+				auto it = grid.find (cellKey (cu, cv));
+
+				if (it != grid.end())
+					collect (it.value());
+			}
+		}
+	}
+
+	return result;
+}
+
+// =============================================================================
+//
+bool LDVertexIndex::bounds (Vertex& min, Vertex& max) const
+{
+	if (m_references.isEmpty())
+		return false;
+
+	if (not m_hasBounds)
+	{
+		auto it = m_references.begin();
+		m_min = m_max = it.key().toVertex();
+
+		for (++it; it != m_references.end(); ++it)
+		{
+			const Vertex a = it.key().toVertex();
+			m_min = Vertex (qMin (m_min.x(), a.x()), qMin (m_min.y(), a.y()), qMin (m_min.z(), a.z()));
+			m_max = Vertex (qMax (m_max.x(), a.x()), qMax (m_max.y(), a.y()), qMax (m_max.z(), a.z()));
+		}
+
+		m_hasBounds = true;
+	}
+
+	min = m_min;
+	max = m_max;
+	return true;
+}
+
+// =============================================================================
+//
+void LDVertexIndex::buildGrid (Axis depthAxis) const
+{
+	Grid& grid = m_grids[depthAxis];
+	grid.clear();
+
+	for (auto it = m_references.begin(); it != m_references.end(); ++it)
+	{
+		const Vertex a = it.key().toVertex();
+		grid[cellOf (depthAxis, a)] << a;
+	}
+
+	m_hasGrid[depthAxis] = true;
+}
+
+// =============================================================================
+//
+qint64 LDVertexIndex::cellKey (int u, int v)
+{
+	return (qint64 (u) << 32) | quint32 (v);
+}
+
+// =============================================================================
+//
+int LDVertexIndex::cellCoordinate (double a)
+{
+	return int (std::floor (a / CellSize));
+}
+
+// =============================================================================
+//
+qint64 LDVertexIndex::cellOf (Axis depthAxis, const Vertex& a)
+{
+	Axis u, v;
+	planeAxes (depthAxis, u, v);
+	return cellKey (cellCoordinate (a[u]), cellCoordinate (a[v]));
+}
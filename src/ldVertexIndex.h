@@ -0,0 +1,114 @@
+/*
+ *  LDForge: LDraw parts authoring CAD
+ *  Copyright (C) 2013, 2014 Santeri Piippo
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#include <QHash>
+#include <QVector>
+#include "main.h"
+#include "basics.h"
+
+//
+// Keeps track of the vertices known in a document, i.e. the vertices of its
+// objects and the inlined vertices of its subfile references, with a reference
+// count for each distinct vertex.
+//
+// For snapping, the index can find the vertices near a point as seen along
+// one of the coordinate axes. For each axis that has been queried, the index
+// keeps a grid of square cells over the two other axes, so that a query only
+// looks at the cells its range overlaps. The grids are built on first use and
+// then kept up to date as vertices come and go.
+//
+// The index also keeps the bounding box of its vertices, which is extended as
+// vertices are added and recomputed when first needed after a vertex on its
+// boundary has been removed.
+//
+class LDVertexIndex
+{
+public:
+	// Size of a grid cell in LDraw units
+	enum { CellSize = 8 };
+
+	LDVertexIndex();
+
+	void add (const Vertex& a);
+	void remove (const Vertex& a);
+	void clear();
+
+	// Amount of distinct vertices
+	inline int count() const
+	{
+		return m_references.size();
+	}
+
+	// Finds all vertices whose coordinates on the axes other than @depthAxis
+	// are within @radius of the corresponding coordinates of @center. The
+	// depth coordinate does not matter.
+	QVector<Vertex> findNear (Axis depthAxis, const Vertex& center, double radius) const;
+
+	// Gets the bounding box of the vertices. Returns false if there are none.
+	bool bounds (Vertex& min, Vertex& max) const;
+
+	// Calls @func with each distinct vertex
+	template<typename Func>
+	void forEachVertex (Func func) const
+	{
+		for (auto it = m_references.begin(); it != m_references.end(); ++it)
+			func (it.key().toVertex());
+	}
+
+private:
+	// The exact coordinates of a vertex. Vertex's operator== is fuzzy, so
+	// nearly equal vertices would share a reference count if the vertices
+	// themselves were used as keys.
+	struct Key
+	{
+		double x, y, z;
+
+		Key (const Vertex& a);
+
+		inline bool operator== (const Key& other) const
+		{
+			return x == other.x && y == other.y && z == other.z;
+		}
+
+		inline Vertex toVertex() const
+		{
+			return Vertex (x, y, z);
+		}
+
+		friend inline uint qHash (const Key& a)
+		{
+			const double coords[3] = { a.x, a.y, a.z };
+			return qHash (QByteArray::fromRawData (reinterpret_cast<const char*> (coords), sizeof coords));
+		}
+	};
+
+	using Grid = QHash<qint64, QVector<Vertex>>;
+
+	QHash<Key, int>		m_references;
+	mutable Grid		m_grids[3];
+	mutable bool		m_hasGrid[3];
+	mutable Vertex		m_min;
+	mutable Vertex		m_max;
+	mutable bool		m_hasBounds;
+
+	void buildGrid (Axis depthAxis) const;
+	static qint64 cellKey (int u, int v);
+	static int cellCoordinate (double a);
+	static qint64 cellOf (Axis depthAxis, const Vertex& a);
+};
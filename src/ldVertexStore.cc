@@ -0,0 +1,152 @@
+/*
+ *  LDForge: LDraw parts authoring CAD
+ *  Copyright (C) 2013, 2014 Santeri Piippo
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "ldVertexStore.h"
+
+// =============================================================================
+//
+LDVertexStore::LDVertexStore() :
+	m_numUsedBlocks (0),
+	m_isOrphaned (false) {}
+
+// =============================================================================
+//
+LDVertexStore* LDVertexStore::detached() // [static]
+{
+	// Never deleted, objects may still be destroyed while static variables
+	// are being destroyed.
+	static LDVertexStore* store = new LDVertexStore;
+	return store;
+}
+
+// =============================================================================
+//
+int LDVertexStore::allocate (int numVertices)
+{
+	int block;
+
+	if (not m_freeBlocks.isEmpty())
+	{
+		block = m_freeBlocks.last();
+		m_freeBlocks.removeLast();
+	}
+	else
+	{
+		block = m_blockSizes.size();
+		m_blockSizes.append (0);
+		m_x.resize (m_x.size() + BlockSize);
+		m_y.resize (m_y.size() + BlockSize);
+		m_z.resize (m_z.size() + BlockSize);
+	}
+
+	for (int i = 0; i < BlockSize; ++i)
+		setVertex (block, i, Vertex (0, 0, 0));
+
+	m_blockSizes[block] = numVertices;
+	++m_numUsedBlocks;
+	return block;
+}
+
+// =============================================================================
+//
+void LDVertexStore::release (int block)
+{
+	m_blockSizes[block] = 0;
+	m_freeBlocks.append (block);
+
+	if (--m_numUsedBlocks > 0)
+		return;
+
+	// Nothing is left. Objects are created and released in bulk, so don't
+	// hang on to the memory.
+	if (m_isOrphaned)
+	{
+		delete this;
+		return;
+	}
+
+	m_x.clear();
+	m_y.clear();
+	m_z.clear();
+	m_blockSizes.clear();
+	m_freeBlocks.clear();
+}
+
+// =============================================================================
+//
+int LDVertexStore::moveBlock (int block, LDVertexStore* other)
+{
+	int newBlock = other->allocate (m_blockSizes[block]);
+
+	for (int i = 0; i < BlockSize; ++i)
+		other->setVertex (newBlock, i, vertex (block, i));
+
+	release (block);
+	return newBlock;
+}
+
+// =============================================================================
+//
+void LDVertexStore::orphan()
+{
+	if (m_numUsedBlocks == 0)
+		delete this;
+	else
+		m_isOrphaned = true;
+}
+
+// =============================================================================
+//
+bool LDVertexStore::getExtents (Vertex& minimum, Vertex& maximum) const
+{
+	const double* x = m_x.constData();
+	const double* y = m_y.constData();
+	const double* z = m_z.constData();
+	double lower[3] = { 0, 0, 0 };
+	double upper[3] = { 0, 0, 0 };
+	bool found = false;
+
+	for (int block = 0; block < m_blockSizes.size(); ++block)
+	{
+		const int first = block * BlockSize;
+		const int last = first + m_blockSizes[block];
+
+		for (int k = first; k < last; ++k)
+		{
+			if (not found)
+			{
+				lower[0] = upper[0] = x[k];
+				lower[1] = upper[1] = y[k];
+				lower[2] = upper[2] = z[k];
+				found = true;
+				continue;
+			}
+
+			lower[0] = qMin (lower[0], x[k]);
+			lower[1] = qMin (lower[1], y[k]);
+			lower[2] = qMin (lower[2], z[k]);
+			upper[0] = qMax (upper[0], x[k]);
+			upper[1] = qMax (upper[1], y[k]);
+			upper[2] = qMax (upper[2], z[k]);
+		}
+	}
+
+	minimum = Vertex (lower[0], lower[1], lower[2]);
+	maximum = Vertex (upper[0], upper[1], upper[2]);
+	return found;
+}
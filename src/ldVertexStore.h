@@ -0,0 +1,91 @@
+/*
+ *  LDForge: LDraw parts authoring CAD
+ *  Copyright (C) 2013, 2014 Santeri Piippo
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#include <QVector>
+#include "main.h"
+#include "basics.h"
+
+//
+// The vertices of lines, triangles, quads and conditional lines are kept in
+// vertex stores rather than in the objects themselves. A store keeps the
+// coordinates in separate x, y and z columns so that code which goes through
+// all vertices of a document reads contiguous arrays instead of chasing the
+// objects around the heap.
+//
+// Each object owns a block of BlockSize consecutive vertices in the store of
+// its document. Objects that are not in a document keep their vertices in the
+// detached store. A document's store is deleted once the document is gone and
+// the objects that outlived it have released their blocks.
+//
+// Vertex stores are only used in the main thread.
+//
+class LDVertexStore
+{
+public:
+	enum { BlockSize = 4 };
+
+	LDVertexStore();
+
+	// Allocates a block for an object with @numVertices vertices, initialized
+	// to zero. Returns the index of the block.
+	int allocate (int numVertices);
+
+	// Releases the given block.
+	void release (int block);
+
+	// Moves the vertices of @block into @other and releases the block here.
+	// Returns the index of the block in @other.
+	int moveBlock (int block, LDVertexStore* other);
+
+	// Finds the extents of all vertices in this store. Returns false if there
+	// are no vertices.
+	bool getExtents (Vertex& minimum, Vertex& maximum) const;
+
+	// Tells the store that its document is gone. The store deletes itself once
+	// there are no blocks left.
+	void orphan();
+
+	inline Vertex vertex (int block, int i) const
+	{
+		const int k = (block * BlockSize) + i;
+		return Vertex (m_x[k], m_y[k], m_z[k]);
+	}
+
+	inline void setVertex (int block, int i, const Vertex& a)
+	{
+		const int k = (block * BlockSize) + i;
+		m_x[k] = a.x();
+		m_y[k] = a.y();
+		m_z[k] = a.z();
+	}
+
+	// The store of objects that are not in any document
+	static LDVertexStore* detached();
+
+private:
+	QVector<double>		m_x;
+	QVector<double>		m_y;
+	QVector<double>		m_z;
+	QVector<qint8>		m_blockSizes; // number of vertices used, 0 if the block is free
+	QVector<int>		m_freeBlocks;
+	int					m_numUsedBlocks;
+	bool				m_isOrphaned;
+
+	Q_DISABLE_COPY (LDVertexStore)
+};
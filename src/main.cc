@@ -16,6 +16,7 @@
  *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <cstring>
 #include <QApplication>
 #include <QMessageBox>
 #include <QAbstractButton>
@@ -33,20 +34,26 @@
 #include "configDialog.h"
 #include "dialogs.h"
 #include "crashCatcher.h"
+#include "batchMode.h"
 
-MainWindow* g_win = null;
 static QString g_versionString, g_fullVersionString;
 
-const Vertex g_origin (0.0f, 0.0f, 0.0f);
-const Matrix g_identity ({1.0f, 0.0f, 0.0f, 0.0f, 1.0f, 0.0f, 0.0f, 0.0f, 1.0f});
-
 CFGENTRY (Bool, firstStart, true);
 
 // =============================================================================
 //
 int main (int argc, char* argv[])
 {
-	QApplication app (argc, argv);
+	// Batch mode runs without any windows, so it doesn't need a display.
+	bool batch = false;
+
+	for (int i = 1; i < argc; ++i)
+	{
+		if (strcmp (argv[i], "--batch") == 0)
+			batch = true;
+	}
+
+	QApplication app (argc, argv, not batch);
 	app.setOrganizationName (APPNAME);
 	app.setApplicationName (APPNAME);
 	initCrashCatcher();
@@ -62,6 +69,9 @@ int main (int argc, char* argv[])
 			critical ("Failed to create configuration file!\n");
 	}
 
+	if (batch)
+		return runBatchMode (app.arguments());
+
 	LDPaths::initPaths();
 	initColors();
 	loadPrimitives();
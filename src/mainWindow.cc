@@ -51,6 +51,7 @@
 #include "ui_ldforge.h"
 #include "primitives.h"
 
+MainWindow* g_win = null;
 static bool g_isSelectionLocked = false;
 static QMap<QAction*, QKeySequence> g_defaultShortcuts;
 
@@ -309,11 +310,29 @@ void MainWindow::buildObjList()
 		delete ui->objectList->item (i);
 
 	ui->objectList->clear();
+	LDDocumentPtr doc = getCurrentDocument();
 
-	for (LDObjectPtr obj : getCurrentDocument()->objects())
+	for (int line = 0; line < doc->getObjectCount(); ++line)
 	{
 		QString descr;
 
+		// The comments of a lazily loaded document are listed without parsing
+		// them into objects.
+		if (doc->isRawLine (line))
+		{
+			doc->rawLineType (line, &descr);
+
+			while (descr[0] == ' ')
+				descr.remove (0, 1);
+
+			QListWidgetItem* item = new QListWidgetItem (descr);
+			item->setIcon (getIcon ("comment"));
+			ui->objectList->insertItem (ui->objectList->count(), item);
+			continue;
+		}
+
+		LDObjectPtr obj = doc->getObject (line);
+
 		switch (obj->type())
 		{
 			case OBJ_Comment:
@@ -449,17 +468,24 @@ void MainWindow::slot_selectionChanged()
 	// Get the objects from the object list selection
 	getCurrentDocument()->clearSelection();
 	const QList<QListWidgetItem*> items = ui->objectList->selectedItems();
+	QList<int> rows;
 
-	for (LDObjectPtr obj : getCurrentDocument()->objects())
+	for (QListWidgetItem* item : items)
+		rows << ui->objectList->row (item);
+
+	// Select in document order. Lines of a lazily loaded document may only
+	// get parsed here, so their list entries are assigned now.
+	qSort (rows);
+
+	for (int row : rows)
 	{
-		for (QListWidgetItem* item : items)
-		{
-			if (item == obj->qObjListEntry)
-			{
-				obj->select();
-				break;
-			}
-		}
+		LDObjectPtr obj = getCurrentDocument()->getObject (row);
+
+		if (obj == null)
+			continue;
+
+		obj->qObjListEntry = ui->objectList->item (row);
+		obj->select();
 	}
 
 	// The select() method calls may have selected additional items (i.e. invertnexts)
@@ -700,13 +726,12 @@ void MainWindow::updateEditModeActions()
 //
 void MainWindow::slot_editObject (QListWidgetItem* listitem)
 {
-	for (LDObjectPtr it : getCurrentDocument()->objects())
+	LDObjectPtr obj = getCurrentDocument()->getObject (ui->objectList->row (listitem));
+
+	if (obj != null)
 	{
-		if (it->qObjListEntry == listitem)
-		{
-			AddObjectDialog::staticDialog (it->type(), it);
-			break;
-		}
+		obj->qObjListEntry = listitem;
+		AddObjectDialog::staticDialog (obj->type(), obj);
 	}
 }
 
@@ -803,6 +828,13 @@ bool confirm (const QString& title, const QString& message)
 //
 void critical (const QString& message)
 {
+	// Without a main window, there's nobody to show a message box to.
+	if (g_win == null)
+	{
+		fprint (stderr, "%1\n", message);
+		return;
+	}
+
 	QMessageBox::critical (g_win, MainWindow::tr ("Error"), message,
 		(QMessageBox::Close), QMessageBox::Close);
 }
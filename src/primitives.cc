@@ -20,6 +20,7 @@
 #include <QRegExp>
 #include <QFileDialog>
 #include "ldDocument.h"
+#include "ldLibraryArchive.h"
 #include "mainWindow.h"
 #include "primitives.h"
 #include "ui_makeprim.h"
@@ -112,10 +113,21 @@ PrimitiveScanner::PrimitiveScanner (QObject* parent) :
 	m_i (0)
 {
 	g_activeScanner = this;
-	QDir dir (LDPaths::prims());
-	assert (dir.exists());
-	m_baselen = dir.absolutePath().length();
-	recursiveGetFilenames (dir, m_files);
+	LDLibraryArchive* archive = LDLibraryArchive::instance();
+
+	if (archive != null && archive->contains (LDPaths::prims()))
+	{
+		m_baselen = LDPaths::prims().length();
+		m_files = archive->files (LDPaths::prims());
+	}
+	else
+	{
+		QDir dir (LDPaths::prims());
+		assert (dir.exists());
+		m_baselen = dir.absolutePath().length();
+		recursiveGetFilenames (dir, m_files);
+	}
+
 	emit starting (m_files.size());
 	print ("Scanning primitives...");
 }
@@ -136,16 +148,17 @@ void PrimitiveScanner::work()
 	for (; m_i < j; ++m_i)
 	{
 		QString fname = m_files[m_i];
-		QFile f (fname);
+		QIODevice* f = LDLibraryArchive::openFile (fname);
 
-		if (not f.open (QIODevice::ReadOnly))
+		if (f == null)
 			continue;
 
 		Primitive info;
 		info.name = fname.mid (m_baselen + 1);  // make full path relative
 		info.name.replace ('/', '\\');  // use DOS backslashes, they're expected
 		info.category = null;
-		QByteArray titledata = f.readLine();
+		QByteArray titledata = f->readLine();
+		delete f;
 
 		if (titledata != QByteArray())
 			info.title = QString::fromUtf8 (titledata);
@@ -0,0 +1,112 @@
+/*
+ *  LDForge: LDraw parts authoring CAD
+ *  Copyright (C) 2013, 2014 Santeri Piippo
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+//
+// Checks that formatLDrawNumber gives the same text as QString::number, i.e.
+// %.6g with the trailing zeroes dropped, for edge cases and random values.
+//
+
+#include <cfloat>
+#include <cmath>
+#include <cstdlib>
+#include <limits>
+#include <QCoreApplication>
+#include "main.h"
+#include "ldFormatter.h"
+
+static int g_numFailures = 0;
+
+// =============================================================================
+//
+static void check (double value)
+{
+	char buffer[64];
+	QString result = QString::fromLatin1 (buffer, formatLDrawNumber (value, buffer));
+	QString expected = QString::number (value);
+
+	if (result != expected)
+	{
+		if (++g_numFailures <= 20)
+		{
+			fprint (stderr, "%1: expected `%2`, got `%3`\n",
+				QString::number (value, 'g', 17), expected, result);
+		}
+	}
+}
+
+// =============================================================================
+//
+// Returns a random double with @bits random bits
+//
+static double randomBits (int bits)
+{
+	double value = 0.0;
+
+	for (int i = 0; i < bits; i += 15)
+		value = (value * 32768.0) + (qrand() & 0x7FFF);
+
+	return value;
+}
+
+// =============================================================================
+//
+int main (int argc, char* argv[])
+{
+	QCoreApplication app (argc, argv);
+	static const double edgeCases[] =
+	{
+		0.0, -0.0, 1.0, -1.0, 0.5, 0.1, 0.2, 0.3, 2.5, -2.5, 10.0, 100.0,
+		1e-4, 9.99999e-5, 9.999995e-5, 1e-5, 0.000123456, 0.0001234565,
+		123456.0, 123456.5, 123457.5, 999999.0, 999999.4, 999999.5, 1e6,
+		-999999.5, 1.0000005, 1.0000015, 0.7071067811865476, 3.14159265358979,
+		1e20, -1e20, 1e-20, 1.5e300, DBL_MAX, DBL_MIN, DBL_EPSILON,
+		std::numeric_limits<double>::denorm_min(),
+		std::numeric_limits<double>::infinity(),
+		-std::numeric_limits<double>::infinity(),
+		std::numeric_limits<double>::quiet_NaN(),
+	};
+
+	for (double value : edgeCases)
+		check (value);
+
+	qsrand (1);
+
+	for (int i = 0; i < 1000000; ++i)
+	{
+		// Typical LDraw coordinates with up to three decimals
+		check ((qrand() % 2000001 - 1000000) / 1000.0);
+
+		// Seven to eight digits, to hit the rounding to six digits
+		check ((qrand() % 200000001 - 100000000) / 1000.0);
+
+		// Coordinates that went through rotations
+		check ((qrand() % 200001 - 100000) / 1000.0 * 0.7071067811865476);
+
+		// Any double, with random mantissa bits and a random exponent
+		double value = ldexp (randomBits (60), (qrand() % 80) - 100);
+		check ((qrand() & 1) ? -value : value);
+	}
+
+	if (g_numFailures != 0)
+	{
+		fprint (stderr, "%1 values were formatted differently\n", g_numFailures);
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}